@@ -272,8 +272,11 @@ static inline TranslationBlock *tb_lookup(CPUState *cpu, vaddr pc,
         goto hit;
     }
 
+    /* Only count misses, to keep the jump cache hit path free of stores */
+    qatomic_set(&jc->jc_miss_count, jc->jc_miss_count + 1);
     tb = tb_htable_lookup(cpu, pc, cs_base, flags, cflags);
     if (tb == NULL) {
+        qatomic_set(&jc->htable_miss_count, jc->htable_miss_count + 1);
         return NULL;
     }
 
@@ -289,6 +292,112 @@ hit:
     return tb;
 }
 
+#ifndef CONFIG_USER_ONLY
+/*
+ * In MTTCG mode, vCPUs often run into the same code for the first time
+ * together, e.g. when all of them come out of the firmware or start the
+ * same kernel code.  Rather than having each of them translate the block,
+ * the first vCPU that misses records the translation as in flight; the
+ * others wait for it to finish and then find the block in the hash table.
+ *
+ * The table only has a few slots; a miss that hashes to a slot that is
+ * busy with a different block is translated right away, and waiting is
+ * bounded in case the translating vCPU is held up, e.g. by a TB flush.
+ */
+#define TB_INFLIGHT_BITS    6
+#define TB_INFLIGHT_WAIT_MS 10
+
+typedef struct TBInFlight {
+    CPUState *owner;
+    vaddr pc;
+    uint64_t cs_base;
+    uint32_t flags;
+    uint32_t cflags;
+} TBInFlight;
+
+static struct {
+    QemuMutex lock;
+    QemuCond cond;
+    TBInFlight slot[1 << TB_INFLIGHT_BITS];
+} tb_inflight;
+
+static __thread TBInFlight *tb_inflight_owned;
+
+static void tb_inflight_init(void)
+{
+    qemu_mutex_init(&tb_inflight.lock);
+    qemu_cond_init(&tb_inflight.cond);
+}
+
+static bool tb_inflight_match(TBInFlight *s, vaddr pc, uint64_t cs_base,
+                              uint32_t flags, uint32_t cflags)
+{
+    return s->owner && s->pc == pc && s->cs_base == cs_base &&
+           s->flags == flags && s->cflags == cflags;
+}
+
+/*
+ * Either claim the translation of the block, or wait for another vCPU to
+ * translate it.  Returns true if the caller should look the block up
+ * again before translating it.
+ */
+static bool tb_inflight_begin(CPUState *cpu, vaddr pc, uint64_t cs_base,
+                              uint32_t flags, uint32_t cflags)
+{
+    TBInFlight *s;
+    int64_t deadline;
+    bool waited = false;
+
+    if (!(cflags & CF_PARALLEL)) {
+        return false;
+    }
+
+    s = &tb_inflight.slot[tb_jmp_cache_hash_func(pc) &
+                          ((1 << TB_INFLIGHT_BITS) - 1)];
+    deadline = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + TB_INFLIGHT_WAIT_MS;
+
+    qemu_mutex_lock(&tb_inflight.lock);
+    while (s->owner != cpu &&
+           tb_inflight_match(s, pc, cs_base, flags, cflags)) {
+        int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+        waited = true;
+        if (now >= deadline) {
+            break;
+        }
+        qemu_cond_timedwait(&tb_inflight.cond, &tb_inflight.lock,
+                            deadline - now);
+    }
+    if (!waited && (!s->owner || s->owner == cpu)) {
+        *s = (TBInFlight) {
+            .owner = cpu,
+            .pc = pc,
+            .cs_base = cs_base,
+            .flags = flags,
+            .cflags = cflags,
+        };
+        tb_inflight_owned = s;
+    }
+    qemu_mutex_unlock(&tb_inflight.lock);
+
+    trace_tb_inflight_begin(cpu->cpu_index, pc, waited);
+    return waited;
+}
+
+static void tb_inflight_end(void)
+{
+    if (!tb_inflight_owned) {
+        return;
+    }
+
+    qemu_mutex_lock(&tb_inflight.lock);
+    tb_inflight_owned->owner = NULL;
+    tb_inflight_owned = NULL;
+    qemu_cond_broadcast(&tb_inflight.cond);
+    qemu_mutex_unlock(&tb_inflight.lock);
+}
+#endif /* !CONFIG_USER_ONLY */
+
 static void log_cpu_exec(vaddr pc, CPUState *cpu,
                          const TranslationBlock *tb)
 {
@@ -561,6 +670,7 @@ static void cpu_exec_longjmp_cleanup(CPUState *cpu)
         tb_unlock_pages(tcg_ctx->gen_tb);
         tcg_ctx->gen_tb = NULL;
     }
+    tb_inflight_end();
 #endif
     if (bql_locked()) {
         bql_unlock();
@@ -989,6 +1099,12 @@ cpu_exec_loop(CPUState *cpu, SyncClocks *sc)
             }
 
             tb = tb_lookup(cpu, pc, cs_base, flags, cflags);
+#ifndef CONFIG_USER_ONLY
+            if (tb == NULL &&
+                tb_inflight_begin(cpu, pc, cs_base, flags, cflags)) {
+                tb = tb_lookup(cpu, pc, cs_base, flags, cflags);
+            }
+#endif
             if (tb == NULL) {
                 CPUJumpCache *jc;
                 uint32_t h;
@@ -996,6 +1112,9 @@ cpu_exec_loop(CPUState *cpu, SyncClocks *sc)
                 mmap_lock();
                 tb = tb_gen_code(cpu, pc, cs_base, flags, cflags);
                 mmap_unlock();
+#ifndef CONFIG_USER_ONLY
+                tb_inflight_end();
+#endif
 
                 /*
                  * We add the TB in the virtual pc hash table
@@ -1082,6 +1201,9 @@ bool tcg_exec_realizefn(CPUState *cpu, Error **errp)
         assert(cpu->cc->tcg_ops->cpu_exec_halt);
 #endif /* !CONFIG_USER_ONLY */
         cpu->cc->tcg_ops->initialize();
+#ifndef CONFIG_USER_ONLY
+        tb_inflight_init();
+#endif
         tcg_target_initialized = true;
     }
 
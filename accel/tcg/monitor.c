@@ -19,6 +19,7 @@
 #include "tcg/tcg.h"
 #include "internal-common.h"
 #include "tb-context.h"
+#include "tb-jmp-cache.h"
 
 
 static void dump_drift_info(GString *buf)
@@ -141,6 +142,34 @@ static void tlb_flush_counts(size_t *pfull, size_t *ppart, size_t *pelide)
     *pelide = elide;
 }
 
+static void dump_tb_lookup_info(GString *buf)
+{
+    CPUState *cpu;
+
+    g_string_append_printf(buf, "\nTB lookups (jump cache size %d):\n",
+                           TB_JMP_CACHE_SIZE);
+    g_string_append_printf(buf, "%-5s %14s %14s %14s %14s\n", "CPU",
+                           "jmp cache miss", "htable hit", "htable hit %",
+                           "translated");
+
+    CPU_FOREACH(cpu) {
+        CPUJumpCache *jc = cpu->tb_jmp_cache;
+        size_t jc_misses, htable_misses, htable_hits;
+
+        if (!jc) {
+            continue;
+        }
+        /* Read the smaller count first, so that the difference stays >= 0 */
+        htable_misses = qatomic_read(&jc->htable_miss_count);
+        jc_misses = qatomic_read(&jc->jc_miss_count);
+        htable_hits = jc_misses - htable_misses;
+        g_string_append_printf(buf, "%-5d %14zu %14zu %14zu %14zu\n",
+                               cpu->cpu_index, jc_misses, htable_hits,
+                               jc_misses ? (htable_hits * 100) / jc_misses : 0,
+                               qatomic_read(&jc->translate_count));
+    }
+}
+
 static void tcg_dump_info(GString *buf)
 {
     g_string_append_printf(buf, "[TCG profiler not compiled]\n");
@@ -189,6 +218,8 @@ static void dump_exec_info(GString *buf)
     g_string_append_printf(buf, "\nStatistics:\n");
     g_string_append_printf(buf, "TB flush count      %u\n",
                            qatomic_read(&tb_ctx.tb_flush_count));
+    g_string_append_printf(buf, "TB eviction count   %u\n",
+                           qatomic_read(&tb_ctx.tb_evict_count));
     g_string_append_printf(buf, "TB invalidate count %u\n",
                            qatomic_read(&tb_ctx.tb_phys_invalidate_count));
 
@@ -196,6 +227,8 @@ static void dump_exec_info(GString *buf)
     g_string_append_printf(buf, "TLB full flushes    %zu\n", flush_full);
     g_string_append_printf(buf, "TLB partial flushes %zu\n", flush_part);
     g_string_append_printf(buf, "TLB elided flushes  %zu\n", flush_elide);
+
+    dump_tb_lookup_info(buf);
     tcg_dump_info(buf);
 }
 
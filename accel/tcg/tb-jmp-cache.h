@@ -28,6 +28,15 @@ typedef struct CPUJumpCache {
         TranslationBlock *tb;
         vaddr pc;
     } array[TB_JMP_CACHE_SIZE];
+    /*
+     * Lookup statistics for "info jit".  Written only by the owning CPU
+     * with qatomic_set(), read by the monitor with qatomic_read().
+     * Hits are not counted, so that the jump cache fast path does not
+     * store anything; hash table hits are jc_miss_count - htable_miss_count.
+     */
+    size_t jc_miss_count;
+    size_t htable_miss_count;
+    size_t translate_count;
 } CPUJumpCache;
 
 #endif /* ACCEL_TCG_TB_JMP_CACHE_H */
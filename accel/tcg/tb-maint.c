@@ -902,7 +902,8 @@ static void tb_jmp_cache_inval_tb(TranslationBlock *tb)
  * In !user-mode, if @rm_from_page_list is set, call with the TB's pages'
  * locks held.
  */
-static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
+static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list,
+                                  bool inval_jmp_cache)
 {
     uint32_t h;
     tb_page_addr_t phys_pc;
@@ -929,7 +930,9 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
     }
 
     /* remove the TB from the hash list */
-    tb_jmp_cache_inval_tb(tb);
+    if (inval_jmp_cache) {
+        tb_jmp_cache_inval_tb(tb);
+    }
 
     /* suppress this TB from the two jump lists */
     tb_remove_from_jmp_list(tb, 0);
@@ -945,7 +948,7 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
 static void tb_phys_invalidate__locked(TranslationBlock *tb)
 {
     qemu_thread_jit_write();
-    do_tb_phys_invalidate(tb, true);
+    do_tb_phys_invalidate(tb, true, true);
     qemu_thread_jit_execute();
 }
 
@@ -957,10 +960,91 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 {
     if (page_addr == -1 && tb_page_addr0(tb) != -1) {
         tb_lock_pages(tb);
-        do_tb_phys_invalidate(tb, true);
+        do_tb_phys_invalidate(tb, true, true);
+        tb_unlock_pages(tb);
+    } else {
+        do_tb_phys_invalidate(tb, false, true);
+    }
+}
+
+/*
+ * When the code buffer is full, evict this fraction of its regions, oldest
+ * first, instead of flushing all translations.
+ */
+#define TB_EVICT_FRACTION 8
+
+/* Changes whenever the code buffer is flushed or regions are evicted */
+static unsigned tb_cache_generation(void)
+{
+    return qatomic_read(&tb_ctx.tb_flush_count) +
+           qatomic_read(&tb_ctx.tb_evict_count);
+}
+
+static gboolean tb_evict_one(gpointer key, gpointer value, gpointer data)
+{
+    TranslationBlock *tb = value;
+
+    /* The jump caches are flushed once all TBs are gone */
+    if (tb_page_addr0(tb) != -1) {
+        tb_lock_pages(tb);
+        do_tb_phys_invalidate(tb, true, false);
         tb_unlock_pages(tb);
     } else {
-        do_tb_phys_invalidate(tb, false);
+        do_tb_phys_invalidate(tb, false, false);
+    }
+    return false;
+}
+
+static void do_tb_evict(CPUState *cpu, run_on_cpu_data tb_gen)
+{
+    bool did_evict = false;
+    size_t nr;
+
+    mmap_lock();
+    /* If it is already been done on request of another CPU, just retry. */
+    if (tb_cache_generation() != tb_gen.host_int) {
+        mmap_unlock();
+        return;
+    }
+
+    nr = MAX(tcg_region_count() / TB_EVICT_FRACTION, 1);
+    qemu_thread_jit_write();
+    if (tcg_region_evict(nr, tb_evict_one, NULL)) {
+        CPUState *other;
+
+        CPU_FOREACH(other) {
+            tcg_flush_jmp_cache(other);
+        }
+        qatomic_inc(&tb_ctx.tb_evict_count);
+        did_evict = true;
+    }
+    qemu_thread_jit_execute();
+    mmap_unlock();
+
+    /*
+     * Every full region is in use: always the case with user mode or
+     * single-threaded TCG, which use a single region.
+     */
+    if (!did_evict) {
+        do_tb_flush(cpu,
+                    RUN_ON_CPU_HOST_INT(qatomic_read(&tb_ctx.tb_flush_count)));
+    }
+}
+
+/*
+ * Make room in the code buffer: drop the translations of its oldest
+ * regions, so that the TBs that are still in use mostly survive.  Falls
+ * back to tb_flush() if no region can be evicted, which is always the
+ * case unless MTTCG split the buffer into more regions than vCPUs.
+ */
+void tb_evict(CPUState *cpu)
+{
+    unsigned tb_gen = tb_cache_generation();
+
+    if (cpu_in_serial_context(cpu)) {
+        do_tb_evict(cpu, RUN_ON_CPU_HOST_INT(tb_gen));
+    } else {
+        async_safe_run_on_cpu(cpu, do_tb_evict, RUN_ON_CPU_HOST_INT(tb_gen));
     }
 }
 
@@ -316,8 +316,8 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     assert_no_pages_locked();
     tb = tcg_tb_alloc(tcg_ctx);
     if (unlikely(!tb)) {
-        /* flush must be done */
-        tb_flush(cpu);
+        /* evict old translations, or flush them all */
+        tb_evict(cpu);
         mmap_unlock();
         /* Make the execution loop process the flush as soon as possible.  */
         cpu->exception_index = EXCP_INTERRUPT;
@@ -510,6 +510,8 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     qatomic_set(&tcg_ctx->code_gen_ptr, (void *)
         ROUND_UP((uintptr_t)gen_code_buf + gen_code_size + search_size,
                  CODE_GEN_ALIGN));
+    qatomic_set(&cpu->tb_jmp_cache->translate_count,
+                cpu->tb_jmp_cache->translate_count + 1);
 
     /* init jump list */
     qemu_spin_init(&tb->jmp_lock);
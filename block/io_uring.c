@@ -16,6 +16,9 @@
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
 #include "qemu/defer-call.h"
+#include "qemu/error-report.h"
+#include "qemu/lockable.h"
+#include "qemu/rcu.h"
 #include "qapi/error.h"
 #include "sysemu/block-backend.h"
 #include "trace.h"
@@ -26,14 +29,29 @@
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Size of the fixed file and fixed buffer tables registered with each ring */
+#define MAX_FIXED_FILES 1024
+#define MAX_FIXED_BUFS 16384
+
+/* The kernel refuses to register buffers larger than this */
+#define FIXED_BUF_CHUNK_SIZE (1ULL << 30)
+
 typedef struct LuringAIOCB {
     Coroutine *co;
+    LuringState *s;
     struct io_uring_sqe sqeq;
     ssize_t ret;
     QEMUIOVector *qiov;
     bool is_read;
     QSIMPLEQ_ENTRY(LuringAIOCB) next;
 
+    /*
+     * Set if the request was queued on the AioContext's fd monitoring ring
+     * with aio_add_sqe() instead of LuringState::ring.
+     */
+    bool shared_ring;
+    CqeHandler cqe_handler;
+
     /*
      * Buffered reads may require resubmission, see
      * luring_resubmit_short_read().
@@ -58,16 +76,429 @@ struct LuringState {
     LuringQueue io_q;
 
     QEMUBH *completion_bh;
+
+    /*
+     * Fixed files and buffers, see luring_fixed_join().  fixed_joined is
+     * only accessed from the AioContext home thread, the other fields are
+     * protected by luring_fixed.lock.  fixed_files_ok and fixed_bufs_ok are
+     * also read locklessly by the home thread.
+     */
+    bool fixed_joined;
+    bool fixed_files_ok;
+    bool fixed_bufs_ok;
+    QLIST_ENTRY(LuringState) fixed_next;
 };
 
+/*
+ * A guest RAM range registered with luring_register_buf().  The range is
+ * split into FIXED_BUF_CHUNK_SIZE pieces that occupy consecutive slots of the
+ * fixed buffer table, starting at first_slot.
+ */
+typedef struct LuringFixedBuf {
+    void *host;
+    size_t size;
+    unsigned int first_slot;
+    unsigned int refcnt;
+} LuringFixedBuf;
+
+/*
+ * Array sorted by host address.  It is replaced as a whole when buffers are
+ * added or removed; refcnt is only accessed under luring_fixed.lock.
+ */
+typedef struct LuringFixedBufTable {
+    struct rcu_head rcu;
+    unsigned int nbufs;
+    LuringFixedBuf bufs[];
+} LuringFixedBufTable;
+
+/*
+ * Files and buffers are registered globally so that requests can use them
+ * no matter which AioContext they are submitted from.  Every ring that has
+ * joined (see luring_fixed_join()) mirrors the file and buffer tables below
+ * slot for slot; updates are pushed to all rings with io_uring_register(2),
+ * which may be called from any thread.
+ */
+static struct {
+    QemuMutex lock;
+
+    /* RCU-protected, looked up locklessly during request submission */
+    LuringFixedBufTable *bufs;
+
+    struct iovec buf_slots[MAX_FIXED_BUFS];
+    int file_slots[MAX_FIXED_FILES];
+    QLIST_HEAD(, LuringState) rings;
+} luring_fixed;
+
+static void __attribute__((__constructor__)) luring_fixed_init(void)
+{
+    int i;
+
+    qemu_mutex_init(&luring_fixed.lock);
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        luring_fixed.file_slots[i] = -1;
+    }
+    QLIST_INIT(&luring_fixed.rings);
+}
+
+/* Called with luring_fixed.lock held */
+static void luring_fixed_update_files(LuringState *s, unsigned int slot,
+                                      unsigned int nr)
+{
+    int ret;
+
+    if (!s->fixed_files_ok) {
+        return;
+    }
+
+    ret = io_uring_register_files_update(&s->ring, slot,
+                                         &luring_fixed.file_slots[slot], nr);
+    if (ret < 0) {
+        warn_report("io_uring fixed file update failed (%s), "
+                    "falling back to regular file descriptors",
+                    strerror(-ret));
+        qatomic_set(&s->fixed_files_ok, false);
+    }
+}
+
+/* Called with luring_fixed.lock held */
+static void luring_fixed_update_bufs(LuringState *s, unsigned int slot,
+                                     unsigned int nr)
+{
+    int ret;
+
+    if (!s->fixed_bufs_ok) {
+        return;
+    }
+
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+    ret = io_uring_register_buffers_update_tag(&s->ring, slot,
+                                               &luring_fixed.buf_slots[slot],
+                                               NULL, nr);
+#else
+    ret = -ENOSYS;
+#endif
+    if (ret < 0) {
+        warn_report("io_uring fixed buffer update failed (%s), "
+                    "falling back to regular buffers", strerror(-ret));
+        qatomic_set(&s->fixed_bufs_ok, false);
+    }
+}
+
+/**
+ * luring_fixed_join:
+ *
+ * Register sparse fixed file and buffer tables with the ring, fill them with
+ * everything that is currently registered and start receiving updates.  This
+ * is done lazily on the first request that asks for fixed resources, so that
+ * rings which never see such requests do not pin guest RAM.
+ */
+static void luring_fixed_join(LuringState *s)
+{
+    unsigned int i;
+    int files_ret, bufs_ret;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    s->fixed_joined = true;
+
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+    files_ret = io_uring_register_files_sparse(&s->ring, MAX_FIXED_FILES);
+    bufs_ret = io_uring_register_buffers_sparse(&s->ring, MAX_FIXED_BUFS);
+#else
+    files_ret = -ENOSYS;
+    bufs_ret = -ENOSYS;
+#endif
+    s->fixed_files_ok = (files_ret == 0);
+    s->fixed_bufs_ok = (bufs_ret == 0);
+    trace_luring_fixed_join(s, files_ret, bufs_ret);
+
+    if (files_ret < 0) {
+        warn_report_once("io_uring fixed files could not be registered (%s), "
+                         "falling back to regular file descriptors",
+                         strerror(-files_ret));
+    }
+    if (bufs_ret < 0) {
+        warn_report_once("io_uring fixed buffers could not be registered "
+                         "(%s), falling back to regular buffers",
+                         strerror(-bufs_ret));
+    }
+
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (luring_fixed.file_slots[i] != -1) {
+            luring_fixed_update_files(s, i, 1);
+        }
+    }
+    for (i = 0; i < MAX_FIXED_BUFS; i++) {
+        if (luring_fixed.buf_slots[i].iov_base) {
+            luring_fixed_update_bufs(s, i, 1);
+        }
+    }
+
+    QLIST_INSERT_HEAD(&luring_fixed.rings, s, fixed_next);
+}
+
+static void luring_fixed_leave(LuringState *s)
+{
+    if (s->fixed_joined) {
+        QEMU_LOCK_GUARD(&luring_fixed.lock);
+        QLIST_REMOVE(s, fixed_next);
+    }
+}
+
+/**
+ * luring_fixed_buf_index:
+ *
+ * Returns the fixed buffer slot that covers [@addr, @addr + @len), or -1 if
+ * the range is not (entirely) inside a single registered chunk.
+ */
+static int luring_fixed_buf_index(void *addr, size_t len)
+{
+    LuringFixedBufTable *table;
+    unsigned int lo, hi;
+    uintptr_t start = (uintptr_t)addr;
+
+    RCU_READ_LOCK_GUARD();
+
+    table = qatomic_rcu_read(&luring_fixed.bufs);
+    if (!table) {
+        return -1;
+    }
+
+    lo = 0;
+    hi = table->nbufs;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        LuringFixedBuf *buf = &table->bufs[mid];
+        uintptr_t host = (uintptr_t)buf->host;
+
+        if (start < host) {
+            hi = mid;
+        } else if (start - host >= buf->size) {
+            lo = mid + 1;
+        } else {
+            uint64_t offset = start - host;
+
+            if (len > buf->size - offset ||
+                offset % FIXED_BUF_CHUNK_SIZE + len > FIXED_BUF_CHUNK_SIZE) {
+                return -1;
+            }
+            return buf->first_slot + offset / FIXED_BUF_CHUNK_SIZE;
+        }
+    }
+    return -1;
+}
+
+/* Called with luring_fixed.lock held */
+static void luring_fixed_publish_bufs(LuringFixedBufTable *table)
+{
+    LuringFixedBufTable *old = luring_fixed.bufs;
+
+    qatomic_rcu_set(&luring_fixed.bufs, table);
+    if (old) {
+        g_free_rcu(old, rcu);
+    }
+}
+
+/**
+ * luring_register_buf:
+ *
+ * Register a guest RAM range for use with IORING_OP_READ_FIXED and
+ * IORING_OP_WRITE_FIXED.  Ranges that are registered more than once (e.g. by
+ * several nodes) are reference counted.
+ */
+bool luring_register_buf(void *host, size_t size, Error **errp)
+{
+    LuringFixedBufTable *old, *table;
+    LuringState *s;
+    unsigned int nslots = DIV_ROUND_UP(size, FIXED_BUF_CHUNK_SIZE);
+    unsigned int first_slot, run, i, pos;
+    size_t remaining;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    old = luring_fixed.bufs;
+    for (pos = 0; old && pos < old->nbufs; pos++) {
+        LuringFixedBuf *buf = &old->bufs[pos];
+
+        if (buf->host == host && buf->size == size) {
+            buf->refcnt++;
+            return true;
+        }
+        if ((uintptr_t)buf->host >= (uintptr_t)host + size) {
+            break;
+        }
+        if ((uintptr_t)buf->host + buf->size > (uintptr_t)host) {
+            error_setg(errp, "Buffer overlaps with a registered io_uring "
+                       "fixed buffer");
+            return false;
+        }
+    }
+
+    /* Find a run of free slots, first fit */
+    run = 0;
+    first_slot = 0;
+    for (i = 0; i < MAX_FIXED_BUFS && run < nslots; i++) {
+        if (luring_fixed.buf_slots[i].iov_base) {
+            run = 0;
+            first_slot = i + 1;
+        } else {
+            run++;
+        }
+    }
+    if (run < nslots) {
+        error_setg(errp, "Out of io_uring fixed buffer slots");
+        return false;
+    }
+
+    remaining = size;
+    for (i = first_slot; i < first_slot + nslots; i++) {
+        size_t len = MIN(remaining, FIXED_BUF_CHUNK_SIZE);
+
+        luring_fixed.buf_slots[i] = (struct iovec) {
+            .iov_base = (uint8_t *)host + (size - remaining),
+            .iov_len = len,
+        };
+        remaining -= len;
+    }
+    QLIST_FOREACH(s, &luring_fixed.rings, fixed_next) {
+        luring_fixed_update_bufs(s, first_slot, nslots);
+    }
+
+    /* Rings know about the slots now, make them visible to lookups */
+    table = g_malloc(sizeof(*table) +
+                     ((old ? old->nbufs : 0) + 1) * sizeof(table->bufs[0]));
+    table->nbufs = (old ? old->nbufs : 0) + 1;
+    if (old) {
+        memcpy(table->bufs, old->bufs, pos * sizeof(table->bufs[0]));
+        memcpy(&table->bufs[pos + 1], &old->bufs[pos],
+               (old->nbufs - pos) * sizeof(table->bufs[0]));
+    }
+    table->bufs[pos] = (LuringFixedBuf) {
+        .host = host,
+        .size = size,
+        .first_slot = first_slot,
+        .refcnt = 1,
+    };
+    luring_fixed_publish_bufs(table);
+
+    trace_luring_register_buf(host, size, first_slot, nslots);
+    return true;
+}
+
+void luring_unregister_buf(void *host, size_t size)
+{
+    LuringFixedBufTable *old, *table;
+    LuringFixedBuf *buf = NULL;
+    LuringState *s;
+    unsigned int first_slot, nslots, i, pos;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    old = luring_fixed.bufs;
+    for (pos = 0; old && pos < old->nbufs; pos++) {
+        if (old->bufs[pos].host == host && old->bufs[pos].size == size) {
+            buf = &old->bufs[pos];
+            break;
+        }
+    }
+    if (!buf || --buf->refcnt > 0) {
+        return;
+    }
+
+    first_slot = buf->first_slot;
+    nslots = DIV_ROUND_UP(size, FIXED_BUF_CHUNK_SIZE);
+
+    /* Stop lookups before the slots go away */
+    table = g_malloc(sizeof(*table) +
+                     (old->nbufs - 1) * sizeof(table->bufs[0]));
+    table->nbufs = old->nbufs - 1;
+    memcpy(table->bufs, old->bufs, pos * sizeof(table->bufs[0]));
+    memcpy(&table->bufs[pos], &old->bufs[pos + 1],
+           (old->nbufs - pos - 1) * sizeof(table->bufs[0]));
+    luring_fixed_publish_bufs(table);
+
+    for (i = first_slot; i < first_slot + nslots; i++) {
+        luring_fixed.buf_slots[i] = (struct iovec) {};
+    }
+    QLIST_FOREACH(s, &luring_fixed.rings, fixed_next) {
+        luring_fixed_update_bufs(s, first_slot, nslots);
+    }
+
+    trace_luring_unregister_buf(host, size, first_slot, nslots);
+}
+
+/**
+ * luring_register_file:
+ *
+ * Register @fd in the fixed file table of all rings.  Returns the fixed file
+ * index to pass to luring_co_submit(), or -1 if the table is full.
+ */
+int luring_register_file(int fd)
+{
+    LuringState *s;
+    int i;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (luring_fixed.file_slots[i] == -1) {
+            break;
+        }
+    }
+    if (i == MAX_FIXED_FILES) {
+        trace_luring_register_file(fd, -1);
+        warn_report("io_uring fixed file table is full, "
+                    "falling back to a regular file descriptor");
+        return -1;
+    }
+
+    luring_fixed.file_slots[i] = fd;
+    QLIST_FOREACH(s, &luring_fixed.rings, fixed_next) {
+        luring_fixed_update_files(s, i, 1);
+    }
+
+    trace_luring_register_file(fd, i);
+    return i;
+}
+
+/*
+ * Drop a file registered with luring_register_file().  This must be called
+ * before the file descriptor is closed because the rings otherwise keep the
+ * open file description (including its OFD locks) alive.
+ */
+void luring_unregister_file(int fixed_file)
+{
+    LuringState *s;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    trace_luring_unregister_file(luring_fixed.file_slots[fixed_file],
+                                 fixed_file);
+    luring_fixed.file_slots[fixed_file] = -1;
+    QLIST_FOREACH(s, &luring_fixed.rings, fixed_next) {
+        luring_fixed_update_files(s, fixed_file, 1);
+    }
+}
+
 /**
  * luring_resubmit:
  *
  * Resubmit a request by appending it to submit_queue.  The caller must ensure
  * that ioq_submit() is called later so that submit_queue requests are started.
+ *
+ * Requests on the shared ring go back to it unless the AioContext stopped
+ * using io_uring for fd monitoring in the meantime.
  */
 static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
 {
+    if (luringcb->shared_ring) {
+        if (aio_add_sqe(s->aio_context, &luringcb->sqeq,
+                        &luringcb->cqe_handler)) {
+            return;
+        }
+        luringcb->shared_ring = false;
+    }
+
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
     s->io_q.in_queue++;
 }
@@ -102,12 +533,92 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
 
     /* Update sqe */
     luringcb->sqeq.off += nread;
-    luringcb->sqeq.addr = (uintptr_t)luringcb->resubmit_qiov.iov;
-    luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED) {
+        /* The fixed buffer slot still covers the shortened buffer */
+        luringcb->sqeq.addr += nread;
+        luringcb->sqeq.len -= nread;
+    } else {
+        luringcb->sqeq.addr = (uintptr_t)luringcb->resubmit_qiov.iov;
+        luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
+    }
 
     luring_resubmit(s, luringcb);
 }
 
+/**
+ * luring_complete:
+ * @s: AIO state
+ * @luringcb: AIO control block
+ * @ret: cqe result
+ *
+ * Handles the result of a request.  The request is either resubmitted, or
+ * luringcb->ret is filled in and the coroutine is woken up.
+ */
+static void luring_complete(LuringState *s, LuringAIOCB *luringcb, int ret)
+{
+    int total_bytes;
+
+    trace_luring_process_completion(s, luringcb, ret);
+
+    /* total_read is non-zero only for resubmitted read requests */
+    total_bytes = ret + luringcb->total_read;
+
+    if (ret < 0) {
+        /*
+         * Only writev/readv/fsync requests on regular files or host block
+         * devices are submitted. Therefore -EAGAIN is not expected but it's
+         * known to happen sometimes with Linux SCSI. Submit again and hope
+         * the request completes successfully.
+         *
+         * For more information, see:
+         * https://lore.kernel.org/io-uring/20210727165811.284510-3-axboe@kernel.dk/T/#u
+         *
+         * If the code is changed to submit other types of requests in the
+         * future, then this workaround may need to be extended to deal with
+         * genuine -EAGAIN results that should not be resubmitted
+         * immediately.
+         */
+        if (ret == -EINTR || ret == -EAGAIN) {
+            luring_resubmit(s, luringcb);
+            return;
+        }
+    } else if (!luringcb->qiov) {
+        goto end;
+    } else if (total_bytes == luringcb->qiov->size) {
+        ret = 0;
+    /* Only read/write */
+    } else {
+        /* Short Read/Write */
+        if (luringcb->is_read) {
+            if (ret > 0) {
+                luring_resubmit_short_read(s, luringcb, ret);
+                return;
+            } else {
+                /* Pad with zeroes */
+                qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
+                                  luringcb->qiov->size - total_bytes);
+                ret = 0;
+            }
+        } else {
+            ret = -ENOSPC;
+        }
+    }
+end:
+    luringcb->ret = ret;
+    qemu_iovec_destroy(&luringcb->resubmit_qiov);
+
+    /*
+     * If the coroutine is already entered it must be in ioq_submit()
+     * and will notice luringcb->ret has been filled in when it
+     * eventually runs later. Coroutines cannot be entered recursively
+     * so avoid doing that!
+     */
+    assert(luringcb->co->ctx == s->aio_context);
+    if (!qemu_coroutine_entered(luringcb->co)) {
+        aio_co_wake(luringcb->co);
+    }
+}
+
 /**
  * luring_process_completions:
  * @s: AIO state
@@ -124,7 +635,6 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
 static void luring_process_completions(LuringState *s)
 {
     struct io_uring_cqe *cqes;
-    int total_bytes;
 
     defer_call_begin();
 
@@ -160,65 +670,7 @@ static void luring_process_completions(LuringState *s)
 
         /* Change counters one-by-one because we can be nested. */
         s->io_q.in_flight--;
-        trace_luring_process_completion(s, luringcb, ret);
-
-        /* total_read is non-zero only for resubmitted read requests */
-        total_bytes = ret + luringcb->total_read;
-
-        if (ret < 0) {
-            /*
-             * Only writev/readv/fsync requests on regular files or host block
-             * devices are submitted. Therefore -EAGAIN is not expected but it's
-             * known to happen sometimes with Linux SCSI. Submit again and hope
-             * the request completes successfully.
-             *
-             * For more information, see:
-             * https://lore.kernel.org/io-uring/20210727165811.284510-3-axboe@kernel.dk/T/#u
-             *
-             * If the code is changed to submit other types of requests in the
-             * future, then this workaround may need to be extended to deal with
-             * genuine -EAGAIN results that should not be resubmitted
-             * immediately.
-             */
-            if (ret == -EINTR || ret == -EAGAIN) {
-                luring_resubmit(s, luringcb);
-                continue;
-            }
-        } else if (!luringcb->qiov) {
-            goto end;
-        } else if (total_bytes == luringcb->qiov->size) {
-            ret = 0;
-        /* Only read/write */
-        } else {
-            /* Short Read/Write */
-            if (luringcb->is_read) {
-                if (ret > 0) {
-                    luring_resubmit_short_read(s, luringcb, ret);
-                    continue;
-                } else {
-                    /* Pad with zeroes */
-                    qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
-                                      luringcb->qiov->size - total_bytes);
-                    ret = 0;
-                }
-            } else {
-                ret = -ENOSPC;
-            }
-        }
-end:
-        luringcb->ret = ret;
-        qemu_iovec_destroy(&luringcb->resubmit_qiov);
-
-        /*
-         * If the coroutine is already entered it must be in ioq_submit()
-         * and will notice luringcb->ret has been filled in when it
-         * eventually runs later. Coroutines cannot be entered recursively
-         * so avoid doing that!
-         */
-        assert(luringcb->co->ctx == s->aio_context);
-        if (!qemu_coroutine_entered(luringcb->co)) {
-            aio_co_wake(luringcb->co);
-        }
+        luring_complete(s, luringcb, ret);
     }
 
     qemu_bh_cancel(s->completion_bh);
@@ -279,6 +731,21 @@ static void luring_process_completions_and_submit(LuringState *s)
     }
 }
 
+/* Completion of a request on the AioContext's fd monitoring ring */
+static void luring_cqe_handler(CqeHandler *cqe_handler)
+{
+    LuringAIOCB *luringcb = container_of(cqe_handler, LuringAIOCB,
+                                         cqe_handler);
+    LuringState *s = luringcb->s;
+
+    luring_complete(s, luringcb, cqe_handler->cqe.res);
+
+    /* In case the request had to fall back to LuringState::ring */
+    if (s->io_q.in_queue > 0 && !s->io_q.blocked) {
+        ioq_submit(s);
+    }
+}
+
 static void qemu_luring_completion_bh(void *opaque)
 {
     LuringState *s = opaque;
@@ -326,6 +793,7 @@ static void luring_deferred_fn(void *opaque)
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
+ * @fixed_file: fixed file index for I/O, or -1
  * @luringcb: AIO control block
  * @s: AIO state
  * @offset: offset for request
@@ -334,24 +802,47 @@ static void luring_deferred_fn(void *opaque)
  * Fetches sqes from ring, adds to pending queue and preps them
  *
  */
-static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
-                            uint64_t offset, int type)
+static int luring_do_submit(int fd, int fixed_file, LuringAIOCB *luringcb,
+                            LuringState *s, uint64_t offset, int type)
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    QEMUIOVector *qiov = luringcb->qiov;
+    bool use_fixed = fixed_file >= 0;
+    int buf_index = -1;
+
+    if (use_fixed) {
+        if (unlikely(!s->fixed_joined)) {
+            luring_fixed_join(s);
+        }
+        if (qiov && qiov->niov == 1 && qatomic_read(&s->fixed_bufs_ok)) {
+            buf_index = luring_fixed_buf_index(qiov->iov[0].iov_base,
+                                               qiov->iov[0].iov_len);
+        }
+        if (qatomic_read(&s->fixed_files_ok)) {
+            fd = fixed_file;
+        } else {
+            fixed_file = -1;
+        }
+    }
 
     switch (type) {
     case QEMU_AIO_WRITE:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
-        break;
     case QEMU_AIO_ZONE_APPEND:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
+        if (buf_index >= 0) {
+            io_uring_prep_write_fixed(sqes, fd, qiov->iov[0].iov_base,
+                                      qiov->iov[0].iov_len, offset, buf_index);
+        } else {
+            io_uring_prep_writev(sqes, fd, qiov->iov, qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
-                            luringcb->qiov->niov, offset);
+        if (buf_index >= 0) {
+            io_uring_prep_read_fixed(sqes, fd, qiov->iov[0].iov_base,
+                                     qiov->iov[0].iov_len, offset, buf_index);
+        } else {
+            io_uring_prep_readv(sqes, fd, qiov->iov, qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_FLUSH:
         io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
@@ -361,8 +852,23 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+    if (fixed_file >= 0) {
+        io_uring_sqe_set_flags(sqes, IOSQE_FIXED_FILE);
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
+    /*
+     * Share the ring that the AioContext uses for fd monitoring when
+     * possible, so that one io_uring_enter(2) reaps both kinds of events.
+     * Fixed files and buffers are only registered with LuringState::ring.
+     */
+    if (!use_fixed &&
+        aio_add_sqe(s->aio_context, sqes, &luringcb->cqe_handler)) {
+        luringcb->shared_ring = true;
+        trace_luring_do_submit_shared_ring(s, luringcb);
+        return 0;
+    }
+
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
     s->io_q.in_queue++;
     trace_luring_do_submit(s, s->io_q.blocked, s->io_q.in_queue,
@@ -379,21 +885,23 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
     return 0;
 }
 
-int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
-                                  QEMUIOVector *qiov, int type)
+int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, int fixed_file,
+                                  uint64_t offset, QEMUIOVector *qiov, int type)
 {
     int ret;
     AioContext *ctx = qemu_get_current_aio_context();
     LuringState *s = aio_get_linux_io_uring(ctx);
     LuringAIOCB luringcb = {
         .co         = qemu_coroutine_self(),
+        .s          = s,
         .ret        = -EINPROGRESS,
         .qiov       = qiov,
         .is_read    = (type == QEMU_AIO_READ),
+        .cqe_handler.cb = luring_cqe_handler,
     };
     trace_luring_co_submit(bs, s, &luringcb, fd, offset, qiov ? qiov->size : 0,
                            type);
-    ret = luring_do_submit(fd, &luringcb, s, offset, type);
+    ret = luring_do_submit(fd, fixed_file, &luringcb, s, offset, type);
 
     if (ret < 0) {
         return ret;
@@ -444,6 +952,7 @@ LuringState *luring_init(Error **errp)
 
 void luring_cleanup(LuringState *s)
 {
+    luring_fixed_leave(s);
     io_uring_queue_exit(&s->ring);
     trace_luring_cleanup_state(s);
     g_free(s);
@@ -24,15 +24,26 @@
 
 #include "qemu/osdep.h"
 #include "block/block-io.h"
+#include "qemu/host-utils.h"
 #include "qemu/memalign.h"
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Cached tables are found through a hash table with chaining, keyed by their
+ * offset in the image file.  Replacement uses the CLOCK algorithm: a table
+ * gets its referenced bit set whenever it is used, and the clock hand clears
+ * the bit of each table it passes until it finds one that has not been used
+ * since the last sweep.  This keeps both lookups and replacement O(1) on
+ * average instead of scanning all entries.
+ */
 typedef struct Qcow2CachedTable {
     int64_t  offset;
-    uint64_t lru_counter;
     int      ref;
+    int      hash_next;         /* next entry in the hash chain, or -1 */
     bool     dirty;
+    bool     referenced;        /* CLOCK reference bit, accessed atomically */
+    bool     used_since_clean;  /* see qcow2_cache_clean_unused(), atomic */
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -42,8 +53,10 @@ struct Qcow2Cache {
     int                     table_size;
     bool                    depends_on_flush;
     void                   *table_array;
-    uint64_t                lru_counter;
-    uint64_t                cache_clean_lru_counter;
+    int                    *buckets;    /* first entry of each chain, or -1 */
+    unsigned                bucket_bits;
+    int                     clock_hand;
+    QemuSeqLock            *seqlock;    /* see qcow2_cache_lookup_nolock() */
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -59,6 +72,100 @@ static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
     return idx;
 }
 
+static inline unsigned qcow2_cache_bucket(Qcow2Cache *c, uint64_t offset)
+{
+    uint64_t key = offset / c->table_size;
+
+    /* Fibonacci hashing, the high bits are the well-mixed ones */
+    return (key * 0x9e3779b97f4a7c15ULL) >> (64 - c->bucket_bits);
+}
+
+/* Returns the index of the entry caching @offset, or -1 */
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = c->buckets[qcow2_cache_bucket(c, offset)]; i != -1;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i, uint64_t offset)
+{
+    unsigned bucket = qcow2_cache_bucket(c, offset);
+
+    assert(c->entries[i].offset == 0);
+    if (c->seqlock) {
+        seqlock_write_begin(c->seqlock);
+    }
+    c->entries[i].offset = offset;
+    c->entries[i].hash_next = c->buckets[bucket];
+    c->buckets[bucket] = i;
+    if (c->seqlock) {
+        seqlock_write_end(c->seqlock);
+    }
+}
+
+/* Drop entry @i from the hash table and mark it unused */
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *link;
+
+    if (c->entries[i].offset == 0) {
+        return;
+    }
+
+    link = &c->buckets[qcow2_cache_bucket(c, c->entries[i].offset)];
+    while (*link != i) {
+        assert(*link != -1);
+        link = &c->entries[*link].hash_next;
+    }
+
+    if (c->seqlock) {
+        seqlock_write_begin(c->seqlock);
+    }
+    *link = c->entries[i].hash_next;
+    c->entries[i].offset = 0;
+    c->entries[i].hash_next = -1;
+    if (c->seqlock) {
+        seqlock_write_end(c->seqlock);
+    }
+    qatomic_set(&c->entries[i].referenced, false);
+}
+
+/*
+ * Advance the clock hand to an unused entry that may be replaced.  Returns -1
+ * if all entries are in use.
+ */
+static int qcow2_cache_find_victim(Qcow2Cache *c)
+{
+    int n;
+
+    /* The first sweep may only clear reference bits, so do two at most */
+    for (n = 0; n < 2 * c->size; n++) {
+        int i = c->clock_hand;
+        Qcow2CachedTable *t = &c->entries[i];
+
+        if (++c->clock_hand == c->size) {
+            c->clock_hand = 0;
+        }
+
+        if (t->ref) {
+            continue;
+        }
+        if (qatomic_read(&t->referenced) && t->offset != 0) {
+            qatomic_set(&t->referenced, false);
+            continue;
+        }
+        return i;
+    }
+    return -1;
+}
+
 static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
 {
     if (c == s->refcount_block_cache) {
@@ -90,9 +197,10 @@ static inline bool can_clean_entry(Qcow2Cache *c, int i)
 {
     Qcow2CachedTable *t = &c->entries[i];
     return t->ref == 0 && !t->dirty && t->offset != 0 &&
-        t->lru_counter <= c->cache_clean_lru_counter;
+        !qatomic_read(&t->used_since_clean);
 }
 
+/* Drop all tables that have not been used since the previous call */
 void qcow2_cache_clean_unused(Qcow2Cache *c)
 {
     int i = 0;
@@ -101,13 +209,13 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* Skip the entries that we don't need to clean */
         while (i < c->size && !can_clean_entry(c, i)) {
+            qatomic_set(&c->entries[i].used_since_clean, false);
             i++;
         }
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_hash_remove(c, i);
             i++;
             to_clean++;
         }
@@ -116,8 +224,6 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
             qcow2_cache_table_release(c, i - to_clean, to_clean);
         }
     }
-
-    c->cache_clean_lru_counter = c->lru_counter;
 }
 
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
@@ -125,6 +231,7 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    int i;
 
     assert(num_tables > 0);
     assert(is_power_of_2(table_size));
@@ -134,15 +241,26 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
     c->table_size = table_size;
+    /* About two buckets per entry keeps the chains short */
+    c->bucket_bits = ctz64(pow2ceil(num_tables)) + 1;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->buckets = g_try_new(int, 1 << c->bucket_bits);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * c->table_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->buckets || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_free(c->buckets);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].hash_next = -1;
+    }
+    for (i = 0; i < (1 << c->bucket_bits); i++) {
+        c->buckets[i] = -1;
     }
 
     return c;
@@ -157,6 +275,7 @@ int qcow2_cache_destroy(Qcow2Cache *c)
     }
 
     qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -309,13 +428,13 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+        qcow2_cache_hash_remove(c, i);
+        qatomic_set(&c->entries[i].used_since_clean, false);
     }
 
     qcow2_cache_table_release(c, 0, c->size);
 
-    c->lru_counter = 0;
+    c->clock_hand = 0;
 
     return 0;
 }
@@ -327,9 +446,6 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     BDRVQcow2State *s = bs->opaque;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -344,29 +460,19 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
+    i = qcow2_cache_find_victim(c);
+    if (i == -1) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -377,7 +483,7 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_hash_remove(c, i);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -390,11 +496,13 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
         }
     }
 
-    c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i, offset);
 
     /* And return the right table */
 found:
     c->entries[i].ref++;
+    qatomic_set(&c->entries[i].referenced, true);
+    qatomic_set(&c->entries[i].used_since_clean, true);
     *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -423,7 +531,8 @@ void qcow2_cache_put(Qcow2Cache *c, void **table)
     *table = NULL;
 
     if (c->entries[i].ref == 0) {
-        c->entries[i].lru_counter = ++c->lru_counter;
+        qatomic_set(&c->entries[i].referenced, true);
+        qatomic_set(&c->entries[i].used_since_clean, true);
     }
 
     assert(c->entries[i].ref >= 0);
@@ -436,26 +545,61 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
     c->entries[i].dirty = true;
 }
 
-void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
+/*
+ * Once a seqlock is set, every change to which tables are cached bumps it.
+ * Together with the writers of the table contents bumping the same seqlock
+ * this allows lookups with qcow2_cache_lookup_nolock().
+ */
+void qcow2_cache_set_seqlock(Qcow2Cache *c, QemuSeqLock *seqlock)
 {
-    int i;
+    c->seqlock = seqlock;
+}
 
-    for (i = 0; i < c->size; i++) {
+/*
+ * Look up the table at @offset without holding the lock that protects the
+ * cache and without taking a reference.  The caller must be in a read section
+ * of the seqlock set with qcow2_cache_set_seqlock() and may only rely on the
+ * table (or NULL for a miss) if the section does not need a retry.
+ */
+void *qcow2_cache_lookup_nolock(Qcow2Cache *c, uint64_t offset)
+{
+    int i, n = 0;
+
+    assert(c->seqlock);
+
+    /* The chain can be modified under our feet, so bound the walk */
+    for (i = c->buckets[qcow2_cache_bucket(c, offset)];
+         i != -1 && n < c->size;
+         i = c->entries[i].hash_next, n++) {
         if (c->entries[i].offset == offset) {
+            qatomic_set(&c->entries[i].referenced, true);
+            qatomic_set(&c->entries[i].used_since_clean, true);
             return qcow2_cache_get_table_addr(c, i);
         }
     }
     return NULL;
 }
 
+void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    if (offset == 0) {
+        return NULL;
+    }
+
+    i = qcow2_cache_lookup(c, offset);
+    return i >= 0 ? qcow2_cache_get_table_addr(c, i) : NULL;
+}
+
 void qcow2_cache_discard(Qcow2Cache *c, void *table)
 {
     int i = qcow2_cache_get_table_idx(c, table);
 
     assert(c->entries[i].ref == 0);
 
-    c->entries[i].offset = 0;
-    c->entries[i].lru_counter = 0;
+    qcow2_cache_hash_remove(c, i);
+    qatomic_set(&c->entries[i].used_since_clean, false);
     c->entries[i].dirty = false;
 
     qcow2_cache_table_release(c, i, 1);
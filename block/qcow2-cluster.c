@@ -30,8 +30,42 @@
 #include "qcow2.h"
 #include "qemu/bswap.h"
 #include "qemu/memalign.h"
+#include "qemu/rcu.h"
 #include "trace.h"
 
+typedef struct Qcow2OldL1Table {
+    struct rcu_head rcu;
+    uint64_t *l1_table;
+} Qcow2OldL1Table;
+
+static void qcow2_free_old_l1_table(Qcow2OldL1Table *old)
+{
+    qemu_vfree(old->l1_table);
+    g_free(old);
+}
+
+/*
+ * Make @l1_table the active L1 table.  qcow2_get_host_offset_nolock() may
+ * still be looking at the old one, so it is only freed after an RCU grace
+ * period.
+ */
+void qcow2_replace_l1_table(BDRVQcow2State *s, uint64_t *l1_table,
+                            int l1_size)
+{
+    uint64_t *old_l1_table = s->l1_table;
+
+    seqlock_write_begin(&s->mapping_seqlock);
+    qatomic_rcu_set(&s->l1_table, l1_table);
+    qatomic_set(&s->l1_size, l1_size);
+    seqlock_write_end(&s->mapping_seqlock);
+
+    if (old_l1_table) {
+        Qcow2OldL1Table *old = g_new(Qcow2OldL1Table, 1);
+        old->l1_table = old_l1_table;
+        call_rcu(old, qcow2_free_old_l1_table, rcu);
+    }
+}
+
 int coroutine_fn qcow2_shrink_l1_table(BlockDriverState *bs,
                                        uint64_t exact_size)
 {
@@ -68,7 +102,9 @@ int coroutine_fn qcow2_shrink_l1_table(BlockDriverState *bs,
         }
         qcow2_free_clusters(bs, s->l1_table[i] & L1E_OFFSET_MASK,
                             s->cluster_size, QCOW2_DISCARD_ALWAYS);
+        seqlock_write_begin(&s->mapping_seqlock);
         s->l1_table[i] = 0;
+        seqlock_write_end(&s->mapping_seqlock);
     }
     return 0;
 
@@ -78,8 +114,10 @@ fail:
      * overwritten l1_table. In this case it would be better to clear the
      * l1_table in memory to avoid possible image corruption.
      */
+    seqlock_write_begin(&s->mapping_seqlock);
     memset(s->l1_table + new_l1_size, 0,
            (s->l1_size - new_l1_size) * L1E_SIZE);
+    seqlock_write_end(&s->mapping_seqlock);
     return ret;
 }
 
@@ -177,12 +215,10 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
     if (ret < 0) {
         goto fail;
     }
-    qemu_vfree(s->l1_table);
     old_l1_table_offset = s->l1_table_offset;
     s->l1_table_offset = new_l1_table_offset;
-    s->l1_table = new_l1_table;
     old_l1_size = s->l1_size;
-    s->l1_size = new_l1_size;
+    qcow2_replace_l1_table(s, new_l1_table, new_l1_size);
     qcow2_free_clusters(bs, old_l1_table_offset, old_l1_size * L1E_SIZE,
                         QCOW2_DISCARD_OTHER);
     return 0;
@@ -357,7 +393,9 @@ static int GRAPH_RDLOCK l2_allocate(BlockDriverState *bs, int l1_index)
 
     /* update the L1 entry */
     trace_qcow2_l2_allocate_write_l1(bs, l1_index);
+    seqlock_write_begin(&s->mapping_seqlock);
     s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
+    seqlock_write_end(&s->mapping_seqlock);
     ret = qcow2_write_l1_entry(bs, l1_index);
     if (ret < 0) {
         goto fail;
@@ -371,7 +409,9 @@ fail:
     if (l2_slice != NULL) {
         qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
     }
+    seqlock_write_begin(&s->mapping_seqlock);
     s->l1_table[l1_index] = old_l2_offset;
+    seqlock_write_end(&s->mapping_seqlock);
     if (l2_offset > 0) {
         qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                             QCOW2_DISCARD_ALWAYS);
@@ -596,6 +636,12 @@ int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
     QCow2SubclusterType type;
     int ret;
 
+    /* Most data of large, fully allocated images is found in the extent map */
+    if (qcow2_extent_map_lookup(s, offset, bytes, host_offset)) {
+        *subcluster_type = QCOW2_SUBCLUSTER_NORMAL;
+        return 0;
+    }
+
     offset_in_cluster = offset_into_cluster(s, offset);
     bytes_needed = (uint64_t) *bytes + offset_in_cluster;
 
@@ -742,6 +788,143 @@ fail:
     return ret;
 }
 
+/*
+ * Lockless variant of qcow2_get_host_offset() for the read path.
+ *
+ * This only looks at metadata that is already in memory and may therefore be
+ * called without holding s->lock.  Consistency with concurrent metadata
+ * updates is checked with s->mapping_seqlock.
+ *
+ * Returns 0 and fills in the same values as qcow2_get_host_offset() on
+ * success.  Returns -EAGAIN if the L2 slice is not cached, the mapping
+ * changed while it was being looked up, or the entry is anything the slow
+ * path has to report as corrupted; the caller must then take s->lock and use
+ * qcow2_get_host_offset().
+ */
+int qcow2_get_host_offset_nolock(BlockDriverState *bs, uint64_t offset,
+                                 unsigned int *bytes, uint64_t *host_offset,
+                                 QCow2SubclusterType *subcluster_type)
+{
+    BDRVQcow2State *s = bs->opaque;
+    unsigned int l2_index, sc_index;
+    uint64_t l1_index, l2_offset, *l1_table, *l2_slice, l2_entry, l2_bitmap;
+    int l1_size, sc, start_of_slice;
+    unsigned int offset_in_cluster;
+    uint64_t bytes_available, bytes_needed, nb_clusters;
+    uint64_t host_cluster_offset = 0;
+    QCow2SubclusterType type;
+    unsigned seq;
+
+    if (qcow2_extent_map_lookup(s, offset, bytes, host_offset)) {
+        *subcluster_type = QCOW2_SUBCLUSTER_NORMAL;
+        return 0;
+    }
+
+    offset_in_cluster = offset_into_cluster(s, offset);
+    bytes_needed = (uint64_t) *bytes + offset_in_cluster;
+    bytes_available =
+        ((uint64_t) (s->l2_slice_size - offset_to_l2_slice_index(s, offset)))
+        << s->cluster_bits;
+    if (bytes_needed > bytes_available) {
+        bytes_needed = bytes_available;
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    seq = seqlock_read_begin(&s->mapping_seqlock);
+    l1_table = qatomic_rcu_read(&s->l1_table);
+    l1_size = qatomic_read(&s->l1_size);
+    /* Make sure l1_size belongs to l1_table before indexing it */
+    if (seqlock_read_retry(&s->mapping_seqlock, seq)) {
+        return -EAGAIN;
+    }
+
+    l1_index = offset_to_l1_index(s, offset);
+    if (l1_index >= l1_size) {
+        type = QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN;
+        goto out;
+    }
+
+    l2_offset = l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset) {
+        type = QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN;
+        goto out;
+    }
+    if (offset_into_cluster(s, l2_offset)) {
+        return -EAGAIN;
+    }
+
+    start_of_slice = l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
+    l2_slice = qcow2_cache_lookup_nolock(s->l2_table_cache,
+                                         l2_offset + start_of_slice);
+    if (!l2_slice) {
+        return -EAGAIN;
+    }
+
+    l2_index = offset_to_l2_slice_index(s, offset);
+    sc_index = offset_to_sc_index(s, offset);
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+    nb_clusters = size_to_clusters(s, bytes_needed);
+
+    type = qcow2_get_subcluster_type(bs, l2_entry, l2_bitmap, sc_index);
+    switch (type) {
+    case QCOW2_SUBCLUSTER_COMPRESSED:
+        if (has_data_file(bs)) {
+            return -EAGAIN;
+        }
+        host_cluster_offset = l2_entry;
+        break;
+    case QCOW2_SUBCLUSTER_ZERO_PLAIN:
+    case QCOW2_SUBCLUSTER_ZERO_ALLOC:
+        if (s->qcow_version < 3) {
+            return -EAGAIN;
+        }
+        if (type == QCOW2_SUBCLUSTER_ZERO_PLAIN) {
+            break;
+        }
+        /* fall through */
+    case QCOW2_SUBCLUSTER_NORMAL:
+    case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
+        host_cluster_offset = l2_entry & L2E_OFFSET_MASK;
+        if (offset_into_cluster(s, host_cluster_offset)) {
+            return -EAGAIN;
+        }
+        host_cluster_offset += offset_in_cluster;
+        if (has_data_file(bs) && host_cluster_offset != offset) {
+            return -EAGAIN;
+        }
+        break;
+    case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+        break;
+    default:
+        return -EAGAIN;
+    }
+
+    sc = count_contiguous_subclusters(bs, nb_clusters, sc_index,
+                                      l2_slice, &l2_index);
+    if (sc < 0) {
+        return -EAGAIN;
+    }
+    bytes_available = ((int64_t)sc + sc_index) << s->subcluster_bits;
+
+out:
+    if (seqlock_read_retry(&s->mapping_seqlock, seq)) {
+        return -EAGAIN;
+    }
+
+    if (bytes_available > bytes_needed) {
+        bytes_available = bytes_needed;
+    }
+    assert(bytes_available - offset_in_cluster <= UINT_MAX);
+    *bytes = bytes_available - offset_in_cluster;
+    *host_offset = host_cluster_offset;
+    *subcluster_type = type;
+
+    return 0;
+}
+
 /*
  * get_cluster_table
  *
@@ -816,20 +999,24 @@ get_cluster_table(BlockDriverState *bs, uint64_t offset,
 }
 
 /*
- * alloc_compressed_cluster_offset
+ * alloc_compressed_cluster_offsets
  *
- * For a given offset on the virtual disk, allocate a new compressed cluster
- * and put the host offset of the cluster into *host_offset. If a cluster is
- * already allocated at the offset, return an error.
+ * For @nb_clusters consecutive clusters starting at @offset on the virtual
+ * disk, allocate new compressed clusters of @compressed_sizes[i] bytes and
+ * put their host offsets into @host_offsets[i].  Clusters with a negative
+ * size are skipped.  The L2 entries are updated one L2 slice at a time.  If
+ * a cluster is already allocated at one of the offsets, return an error.
  *
  * Return 0 on success and -errno in error cases
  */
 int coroutine_fn GRAPH_RDLOCK
-qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs, uint64_t offset,
-                                      int compressed_size, uint64_t *host_offset)
+qcow2_alloc_compressed_cluster_offsets(BlockDriverState *bs, uint64_t offset,
+                                       int nb_clusters,
+                                       const int *compressed_sizes,
+                                       uint64_t *host_offsets)
 {
     BDRVQcow2State *s = bs->opaque;
-    int l2_index, ret;
+    int l2_index, ret, i, n;
     uint64_t *l2_slice;
     int64_t cluster_offset;
     int nb_csectors;
@@ -838,49 +1025,68 @@ qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs, uint64_t offset,
         return 0;
     }
 
-    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
-    if (ret < 0) {
-        return ret;
-    }
+    while (nb_clusters > 0) {
+        ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
+        if (ret < 0) {
+            return ret;
+        }
 
-    /* Compression can't overwrite anything. Fail if the cluster was already
-     * allocated. */
-    cluster_offset = get_l2_entry(s, l2_slice, l2_index);
-    if (cluster_offset & L2E_OFFSET_MASK) {
-        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
-        return -EIO;
-    }
+        n = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
-    cluster_offset = qcow2_alloc_bytes(bs, compressed_size);
-    if (cluster_offset < 0) {
-        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
-        return cluster_offset;
-    }
+        /*
+         * Compression can't overwrite anything. Fail if one of the clusters
+         * was already allocated.
+         */
+        for (i = 0; i < n; i++) {
+            if (compressed_sizes[i] >= 0 &&
+                (get_l2_entry(s, l2_slice, l2_index + i) & L2E_OFFSET_MASK)) {
+                qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+                return -EIO;
+            }
+        }
 
-    nb_csectors =
-        (cluster_offset + compressed_size - 1) / QCOW2_COMPRESSED_SECTOR_SIZE -
-        (cluster_offset / QCOW2_COMPRESSED_SECTOR_SIZE);
+        BLKDBG_CO_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
 
-    /* The offset and size must fit in their fields of the L2 table entry */
-    assert((cluster_offset & s->cluster_offset_mask) == cluster_offset);
-    assert((nb_csectors & s->csize_mask) == nb_csectors);
+        for (i = 0; i < n; i++) {
+            if (compressed_sizes[i] < 0) {
+                continue;
+            }
 
-    cluster_offset |= QCOW_OFLAG_COMPRESSED |
-                      ((uint64_t)nb_csectors << s->csize_shift);
+            cluster_offset = qcow2_alloc_bytes(bs, compressed_sizes[i]);
+            if (cluster_offset < 0) {
+                qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+                return cluster_offset;
+            }
 
-    /* update L2 table */
+            nb_csectors =
+                (cluster_offset + compressed_sizes[i] - 1) /
+                QCOW2_COMPRESSED_SECTOR_SIZE -
+                (cluster_offset / QCOW2_COMPRESSED_SECTOR_SIZE);
 
-    /* compressed clusters never have the copied flag */
+            /* The offset and size must fit in their fields of the L2 entry */
+            assert((cluster_offset & s->cluster_offset_mask) ==
+                   cluster_offset);
+            assert((nb_csectors & s->csize_mask) == nb_csectors);
 
-    BLKDBG_CO_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
-    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
-    set_l2_entry(s, l2_slice, l2_index, cluster_offset);
-    if (has_subclusters(s)) {
-        set_l2_bitmap(s, l2_slice, l2_index, 0);
+            host_offsets[i] = cluster_offset;
+
+            /* compressed clusters never have the copied flag */
+            set_l2_entry(s, l2_slice, l2_index + i,
+                         cluster_offset | QCOW_OFLAG_COMPRESSED |
+                         ((uint64_t)nb_csectors << s->csize_shift));
+            if (has_subclusters(s)) {
+                set_l2_bitmap(s, l2_slice, l2_index + i, 0);
+            }
+        }
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+        offset += (uint64_t)n << s->cluster_bits;
+        compressed_sizes += n;
+        host_offsets += n;
+        nb_clusters -= n;
     }
-    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
 
-    *host_offset = cluster_offset & s->cluster_offset_mask;
     return 0;
 }
 
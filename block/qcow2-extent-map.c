@@ -0,0 +1,376 @@
+/*
+ * Extent map for the QCOW version 2 format
+ *
+ * Copyright (c) 2026 The QEMU Project Developers
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+/*
+ * The extent map summarizes the active L1/L2 tables as a sorted list of
+ * (guest offset, host offset, length) runs of normal, allocated data.  On
+ * large, mostly sequentially laid out images it is a few orders of magnitude
+ * smaller than the L2 tables, so it can be kept in memory completely and
+ * lets qcow2_get_host_offset() resolve most requests without loading L2
+ * slices into a (possibly small) L2 cache.
+ *
+ * The map is only trusted while QCOW2_AUTOCLEAR_EXTENT_MAP is set.  When the
+ * image is opened read-write the bit is cleared on disk, and any change to
+ * an L2 entry that may be covered by an extent drops the in-memory map.  On
+ * close, the bit is set again if the map survived; otherwise the map is
+ * freed.  Programs that don't know about the extent map clear the autoclear
+ * bit as well, so the map can never be used when it doesn't describe the L2
+ * tables anymore.  Such a stale map is dropped the next time the image is
+ * opened read-write, and "qemu-img amend -o extent_map=on" builds a new one.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block-io.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/rcu.h"
+
+#include "qcow2.h"
+
+typedef struct Qcow2OldExtentMap {
+    struct rcu_head rcu;
+    Qcow2Extent *extents;
+} Qcow2OldExtentMap;
+
+static void qcow2_free_old_extent_map(Qcow2OldExtentMap *old)
+{
+    g_free(old->extents);
+    g_free(old);
+}
+
+/*
+ * Drop the in-memory extent map.  qcow2_get_host_offset_nolock() may still
+ * be looking at it, so it is only freed after an RCU grace period.
+ */
+void qcow2_extent_map_invalidate(BDRVQcow2State *s)
+{
+    Qcow2OldExtentMap *old;
+
+    if (!s->extent_map) {
+        return;
+    }
+
+    old = g_new(Qcow2OldExtentMap, 1);
+    old->extents = s->extent_map;
+
+    seqlock_write_begin(&s->mapping_seqlock);
+    qatomic_rcu_set(&s->extent_map, NULL);
+    seqlock_write_end(&s->mapping_seqlock);
+
+    call_rcu(old, qcow2_free_old_extent_map, rcu);
+}
+
+/*
+ * Load the extent map if the image has a valid one.  A map that doesn't pass
+ * validation is treated like a stale one: it is ignored and dropped once the
+ * image is writable.
+ */
+int coroutine_fn qcow2_read_extent_map(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t size = bs->total_sectors * BDRV_SECTOR_SIZE;
+    uint64_t i, prev_end = 0;
+    Qcow2Extent *extents;
+    int ret;
+
+    if (!s->extent_map_offset ||
+        !(s->autoclear_features & QCOW2_AUTOCLEAR_EXTENT_MAP)) {
+        return 0;
+    }
+
+    extents = g_try_new(Qcow2Extent, s->extent_map_nb_extents);
+    if (!extents) {
+        error_setg(errp, "Could not allocate extent map");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_co_pread(bs->file, s->extent_map_offset,
+                        s->extent_map_nb_extents * sizeof(Qcow2Extent),
+                        extents, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read extent map");
+        g_free(extents);
+        return ret;
+    }
+
+    for (i = 0; i < s->extent_map_nb_extents; i++) {
+        Qcow2Extent *e = &extents[i];
+
+        e->guest_offset = be64_to_cpu(e->guest_offset);
+        e->host_offset = be64_to_cpu(e->host_offset);
+        e->length = be64_to_cpu(e->length);
+
+        if (!e->length ||
+            !QEMU_IS_ALIGNED(e->guest_offset | e->host_offset | e->length,
+                             s->subcluster_size) ||
+            e->guest_offset < prev_end || e->length > size ||
+            e->guest_offset > size - e->length ||
+            (has_data_file(bs) && e->host_offset != e->guest_offset))
+        {
+            warn_report("qcow2: Ignoring invalid extent map entry %" PRIu64,
+                        i);
+            g_free(extents);
+            s->autoclear_features &= ~QCOW2_AUTOCLEAR_EXTENT_MAP;
+            return 0;
+        }
+        prev_end = e->guest_offset + e->length;
+    }
+
+    s->extent_map = extents;
+    return 0;
+}
+
+/*
+ * Take ownership of the extent map when the image becomes writable: the
+ * on-disk map is marked stale until qcow2_store_extent_map() is called.
+ *
+ * A map that is stale already, e.g. because a program that doesn't know about
+ * extent maps has written to the image, is dropped from the header.  Its
+ * clusters are leaked rather than freed: this runs while the image is opened,
+ * before the refcounts of a dirty image are repaired, and a program that
+ * didn't know the clusters may have reused them already.  "qemu-img check -r
+ * leaks" reclaims them.
+ *
+ * Returns true if the image header needs to be updated.
+ */
+bool qcow2_extent_map_mark_in_use(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!s->extent_map_offset || s->extent_map_in_use) {
+        return false;
+    }
+
+    if (!s->extent_map) {
+        s->extent_map_offset = 0;
+        qatomic_set(&s->extent_map_nb_extents, 0);
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_EXTENT_MAP;
+        return true;
+    }
+
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_EXTENT_MAP;
+    s->extent_map_in_use = true;
+    return true;
+}
+
+/*
+ * Mark the extent map valid on disk if it still describes the L2 tables, or
+ * remove it otherwise.  To be called before the image stops being writable.
+ */
+int qcow2_store_extent_map(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!s->extent_map_in_use) {
+        return 0;
+    }
+    s->extent_map_in_use = false;
+
+    if (s->extent_map) {
+        /* The L2 tables must be on disk before the map is declared valid */
+        ret = qcow2_flush_caches(bs);
+        if (ret < 0) {
+            return ret;
+        }
+        s->autoclear_features |= QCOW2_AUTOCLEAR_EXTENT_MAP;
+    } else {
+        qcow2_remove_extent_map(bs);
+    }
+
+    return qcow2_update_header(bs);
+}
+
+/*
+ * Drop the extent map and free its clusters.  The caller has to update the
+ * image header.
+ */
+void qcow2_remove_extent_map(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    qcow2_extent_map_invalidate(s);
+    if (s->extent_map_offset) {
+        qcow2_free_clusters(bs, s->extent_map_offset,
+                            s->extent_map_nb_extents * sizeof(Qcow2Extent),
+                            QCOW2_DISCARD_OTHER);
+    }
+
+    s->extent_map_offset = 0;
+    qatomic_set(&s->extent_map_nb_extents, 0);
+    s->extent_map_in_use = false;
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_EXTENT_MAP;
+}
+
+/*
+ * Walk the active L2 tables, merge all contiguous normal clusters into
+ * extents and store the result in the image, replacing any existing extent
+ * map.  Images without any allocated data don't get an extent map.
+ */
+int qcow2_build_extent_map(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t size = bs->total_sectors * BDRV_SECTOR_SIZE;
+    g_autoptr(GArray) extents = g_array_new(false, false, sizeof(Qcow2Extent));
+    g_autofree Qcow2Extent *buf = NULL;
+    QCow2SubclusterType type;
+    uint64_t offset, host_offset, map_size, i;
+    int64_t map_offset;
+    unsigned int bytes;
+    int ret;
+
+    qcow2_remove_extent_map(bs);
+
+    for (offset = 0; offset < size; offset += bytes) {
+        Qcow2Extent *last;
+        Qcow2Extent e;
+
+        bytes = MIN(size - offset, BDRV_REQUEST_MAX_BYTES);
+        ret = qcow2_get_host_offset(bs, offset, &bytes, &host_offset, &type);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read L2 tables");
+            return ret;
+        }
+
+        if (type != QCOW2_SUBCLUSTER_NORMAL) {
+            continue;
+        }
+
+        if (extents->len) {
+            last = &g_array_index(extents, Qcow2Extent, extents->len - 1);
+            if (last->guest_offset + last->length == offset &&
+                last->host_offset + last->length == host_offset) {
+                last->length += bytes;
+                continue;
+            }
+        }
+
+        if (extents->len >= QCOW2_MAX_EXTENTS) {
+            error_setg(errp, "Image is too fragmented for an extent map");
+            return -EFBIG;
+        }
+
+        e = (Qcow2Extent) {
+            .guest_offset = offset,
+            .host_offset = host_offset,
+            .length = bytes,
+        };
+        g_array_append_val(extents, e);
+    }
+
+    if (!extents->len) {
+        return 0;
+    }
+
+    map_size = extents->len * sizeof(Qcow2Extent);
+    buf = g_new(Qcow2Extent, extents->len);
+    for (i = 0; i < extents->len; i++) {
+        Qcow2Extent *e = &g_array_index(extents, Qcow2Extent, i);
+
+        buf[i].guest_offset = cpu_to_be64(e->guest_offset);
+        buf[i].host_offset = cpu_to_be64(e->host_offset);
+        buf[i].length = cpu_to_be64(e->length);
+    }
+
+    map_offset = qcow2_alloc_clusters(bs, map_size);
+    if (map_offset < 0) {
+        error_setg_errno(errp, -map_offset, "Could not allocate extent map");
+        return map_offset;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, map_offset, map_size, false);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(bs->file, map_offset, map_size, buf, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->extent_map_offset = map_offset;
+    seqlock_write_begin(&s->mapping_seqlock);
+    qatomic_set(&s->extent_map_nb_extents, extents->len);
+    qatomic_rcu_set(&s->extent_map,
+                    (Qcow2Extent *)g_array_free(g_steal_pointer(&extents),
+                                                false));
+    seqlock_write_end(&s->mapping_seqlock);
+    s->extent_map_in_use = true;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update qcow2 header");
+        qcow2_remove_extent_map(bs);
+        return ret;
+    }
+
+    return 0;
+
+fail:
+    qcow2_free_clusters(bs, map_offset, map_size, QCOW2_DISCARD_OTHER);
+    error_setg_errno(errp, -ret, "Could not write extent map");
+    return ret;
+}
+
+/*
+ * Look up @offset in the extent map.  If it is covered by an extent, store
+ * the corresponding host offset in *host_offset, limit *bytes to the end of
+ * the extent and return true.
+ *
+ * This may be called without holding s->lock.  If the map is replaced or
+ * dropped concurrently, false is returned and the caller has to look at the
+ * L2 tables instead.
+ */
+bool qcow2_extent_map_lookup(BDRVQcow2State *s, uint64_t offset,
+                             unsigned int *bytes, uint64_t *host_offset)
+{
+    uint64_t lo = 0, hi, guest_offset, length;
+    Qcow2Extent *extents, *e;
+    unsigned seq;
+
+    RCU_READ_LOCK_GUARD();
+
+    seq = seqlock_read_begin(&s->mapping_seqlock);
+    extents = qatomic_rcu_read(&s->extent_map);
+    hi = qatomic_read(&s->extent_map_nb_extents);
+    /* Make sure the number of extents belongs to the map before indexing it */
+    if (!extents || seqlock_read_retry(&s->mapping_seqlock, seq)) {
+        return false;
+    }
+
+    /* Find the first extent that starts after offset */
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+
+        if (extents[mid].guest_offset <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == 0) {
+        return false;
+    }
+
+    e = &extents[lo - 1];
+    guest_offset = e->guest_offset;
+    length = e->length;
+    if (offset - guest_offset >= length) {
+        return false;
+    }
+
+    /* The L2 tables may have changed since; the map was dropped then */
+    if (seqlock_read_retry(&s->mapping_seqlock, seq)) {
+        return false;
+    }
+
+    *host_offset = e->host_offset + (offset - guest_offset);
+    *bytes = MIN(*bytes, guest_offset + length - offset);
+    return true;
+}
@@ -40,6 +40,9 @@ static int update_refcount(BlockDriverState *bs,
                            int64_t offset, int64_t length, uint64_t addend,
                            bool decrease, enum qcow2_discard_type type);
 
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_refcount_repair_pause_point(BlockDriverState *bs);
+
 static uint64_t get_refcount_ro0(const void *refcount_array, uint64_t index);
 static uint64_t get_refcount_ro1(const void *refcount_array, uint64_t index);
 static uint64_t get_refcount_ro2(const void *refcount_array, uint64_t index);
@@ -977,6 +980,11 @@ alloc_clusters_noref(BlockDriverState *bs, uint64_t size, uint64_t max)
         qcow2_process_discards(bs, 0);
     }
 
+    /* Refcounts below the repair floor may claim used clusters to be free */
+    if (s->free_cluster_index < s->refcount_repair_floor) {
+        s->free_cluster_index = s->refcount_repair_floor;
+    }
+
     nb_clusters = size_to_clusters(s, size);
 retry:
     for(i = 0; i < nb_clusters; i++) {
@@ -1145,8 +1153,25 @@ void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
                           enum qcow2_discard_type type)
 {
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t floor_offset = s->refcount_repair_floor << s->cluster_bits;
     int ret;
 
+    /*
+     * Refcounts below the repair floor may be too low, so decreasing them
+     * could free clusters that are still in use.  Leak these clusters
+     * instead; the background repair accounts for them.
+     */
+    if (offset < floor_offset) {
+        int64_t skip = MIN(size, floor_offset - offset);
+
+        offset += skip;
+        size -= skip;
+        if (!size) {
+            return;
+        }
+    }
+
     BLKDBG_EVENT(bs->file, BLKDBG_CLUSTER_FREE);
     ret = update_refcount(bs, offset, size, 1, true, type);
     if (ret < 0) {
@@ -1902,6 +1927,13 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
 
     /* Do the actual checks */
     for (i = 0; i < l1_size; i++) {
+        if (i % 32 == 0 && s->refcount_repair_co == qemu_coroutine_self()) {
+            ret = qcow2_refcount_repair_pause_point(bs);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
         if (!l1_table[i]) {
             continue;
         }
@@ -2287,6 +2319,27 @@ calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
+    /* compression dictionary */
+    if (s->compression_dict_size) {
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                       s->compression_dict_offset,
+                                       s->compression_dict_size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    /* extent map */
+    if (s->extent_map_offset) {
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                       s->extent_map_offset,
+                                       s->extent_map_nb_extents *
+                                       sizeof(Qcow2Extent));
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     /* bitmaps */
     ret = qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
     if (ret < 0) {
@@ -3040,6 +3093,14 @@ int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
         }
     }
 
+    if ((chk & QCOW2_OL_COMPRESSION_DICT) && s->compression_dict_size) {
+        if (overlaps_with(s->compression_dict_offset,
+                          s->compression_dict_size))
+        {
+            return QCOW2_OL_COMPRESSION_DICT;
+        }
+    }
+
     return 0;
 }
 
@@ -3053,6 +3114,7 @@ static const char *metadata_ol_names[] = {
     [QCOW2_OL_INACTIVE_L1_BITNR]        = "inactive L1 table",
     [QCOW2_OL_INACTIVE_L2_BITNR]        = "inactive L2 table",
     [QCOW2_OL_BITMAP_DIRECTORY_BITNR]   = "bitmap directory",
+    [QCOW2_OL_COMPRESSION_DICT_BITNR]   = "compression dictionary",
 };
 QEMU_BUILD_BUG_ON(QCOW2_OL_MAX_BITNR != ARRAY_SIZE(metadata_ol_names));
 
@@ -3748,3 +3810,281 @@ qcow2_detect_metadata_preallocation(BlockDriverState *bs)
 
     return cluster_count >= threshold;
 }
+
+/*
+ * Background refcount repair
+ *
+ * An image with lazy refcounts that was not closed cleanly has refcounts
+ * that may be too low.  Instead of repairing them synchronously at open time,
+ * qcow2_start_refcount_repair() sets s->refcount_repair_floor to the end of
+ * the image file and repairs the refcounts of all clusters below it in a
+ * coroutine while the image is in use.  Until the repair is done:
+ *
+ * - clusters are only allocated at or above the floor, so in-use clusters
+ *   with too low a refcount are never handed out again;
+ * - clusters below the floor are never freed, i.e. their refcounts only
+ *   stay the same or are set by the repair;
+ * - operations that need correct refcounts for the whole image (internal
+ *   snapshots, shrinking) fail with -EBUSY, and the image stays marked dirty.
+ *
+ * As a consequence, no new references to clusters below the floor can be
+ * created while the repair is running, so the metadata walk can drop
+ * s->lock between L2 tables: it may count references that disappear during
+ * the walk (which at worst leaks clusters), but it never misses one that
+ * still exists.
+ */
+
+static int coroutine_fn TSA_NO_TSA
+qcow2_refcount_repair_acquire(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    while (true) {
+        if (qatomic_read(&s->refcount_repair_cancel)) {
+            return -ECANCELED;
+        }
+
+        bdrv_inc_in_flight(bs);
+        if (!qatomic_read(&s->refcount_repair_pause)) {
+            break;
+        }
+        bdrv_dec_in_flight(bs);
+
+        /*
+         * Woken up by qcow2_refcount_repair_wake(), unless the drain ended
+         * or the repair got cancelled before it could see the flag
+         */
+        qatomic_set(&s->refcount_repair_waiting, true);
+        if (qatomic_read(&s->refcount_repair_pause) &&
+            !qatomic_read(&s->refcount_repair_cancel)) {
+            qemu_coroutine_yield();
+        } else if (qatomic_xchg(&s->refcount_repair_waiting, false)) {
+            continue;
+        } else {
+            qemu_coroutine_yield();
+        }
+    }
+
+    bdrv_graph_co_rdlock();
+    qemu_co_mutex_lock(&s->lock);
+    s->refcount_repair_locked = true;
+    return 0;
+}
+
+static void coroutine_fn TSA_NO_TSA
+qcow2_refcount_repair_release(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    s->refcount_repair_locked = false;
+    qemu_co_mutex_unlock(&s->lock);
+    bdrv_graph_co_rdunlock();
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Let other requests take s->lock.  If the node is being drained or the
+ * repair is cancelled, drop the in-flight request and the graph lock as
+ * well.  Returns -ECANCELED without holding any locks if the repair was
+ * cancelled.
+ */
+static int coroutine_fn TSA_NO_TSA
+qcow2_refcount_repair_pause_point(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (qatomic_read(&s->refcount_repair_pause) ||
+        qatomic_read(&s->refcount_repair_cancel)) {
+        qcow2_refcount_repair_release(bs);
+        return qcow2_refcount_repair_acquire(bs);
+    }
+
+    qemu_co_mutex_unlock(&s->lock);
+    qemu_co_mutex_lock(&s->lock);
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_co_repair_refcounts(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvCheckResult res = {0};
+    g_autofree void *refcount_table = NULL;
+    uint64_t refcount, reference;
+    int64_t size, nb_clusters, i;
+    bool rebuild = false;
+    int ret;
+
+    size = bdrv_co_getlength(bs->file->bs);
+    if (size < 0) {
+        return size;
+    }
+    nb_clusters = size_to_clusters(s, size);
+
+    ret = calculate_refcounts(bs, &res, 0, &rebuild, &refcount_table,
+                              &nb_clusters);
+    if (ret < 0) {
+        return ret;
+    }
+    if (rebuild || res.corruptions || res.check_errors) {
+        return -EIO;
+    }
+
+    for (i = 0; i < MIN(nb_clusters, s->refcount_repair_floor); i++) {
+        if (i % s->refcount_block_size == 0) {
+            ret = qcow2_refcount_repair_pause_point(bs);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        ret = qcow2_get_refcount(bs, i, &refcount);
+        if (ret < 0) {
+            return ret;
+        }
+
+        reference = s->get_refcount(refcount_table, i);
+        if (refcount != reference) {
+            ret = update_refcount(bs, i << s->cluster_bits, 1,
+                                  refcount_diff(refcount, reference),
+                                  refcount > reference, QCOW2_DISCARD_ALWAYS);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    /* Lazy refcounts may have left OFLAG_COPIED set on shared clusters */
+    ret = check_oflag_copied(bs, &res, BDRV_FIX_ERRORS);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = qcow2_flush_caches(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->refcount_repair_floor = 0;
+    return qcow2_mark_clean(bs);
+}
+
+static void coroutine_fn TSA_NO_TSA
+qcow2_co_refcount_repair_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    ret = qcow2_refcount_repair_acquire(bs);
+    if (ret == 0) {
+        ret = qcow2_co_repair_refcounts(bs);
+        if (s->refcount_repair_locked) {
+            qcow2_refcount_repair_release(bs);
+        }
+    }
+
+    trace_qcow2_refcount_repair_done(bs, ret);
+    if (ret < 0 && ret != -ECANCELED) {
+        error_report("qcow2: Background refcount repair of '%s' failed: %s; "
+                     "run 'qemu-img check -r all' on the image",
+                     bdrv_get_device_or_node_name(bs), strerror(-ret));
+    }
+
+    s->refcount_repair_co = NULL;
+    aio_wait_kick();
+}
+
+static void qcow2_refcount_repair_wake(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (qatomic_xchg(&s->refcount_repair_waiting, false)) {
+        aio_co_enter(bdrv_get_aio_context(bs), s->refcount_repair_co);
+    }
+}
+
+static void qcow2_launch_refcount_repair(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    s->refcount_repair_cancel = false;
+    s->refcount_repair_co =
+        qemu_coroutine_create(qcow2_co_refcount_repair_entry, bs);
+
+    trace_qcow2_refcount_repair_start(bs, s->refcount_repair_floor);
+    aio_co_schedule(bdrv_get_aio_context(bs), s->refcount_repair_co);
+}
+
+/*
+ * Start repairing the refcounts of a dirty image in the background.  Must be
+ * called before any clusters are allocated.
+ */
+int coroutine_fn GRAPH_RDLOCK qcow2_start_refcount_repair(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t size;
+
+    assert(!s->refcount_repair_co);
+
+    size = bdrv_co_getlength(bs->file->bs);
+    if (size < 0) {
+        return size;
+    }
+
+    s->refcount_repair_floor = MAX(size_to_clusters(s, size), 1);
+    qcow2_launch_refcount_repair(bs);
+    return 0;
+}
+
+/*
+ * Restart a background refcount repair that was stopped when the image was
+ * reopened read-only.  The floor is kept: all clusters above it have been
+ * allocated with correct refcounts.
+ */
+void qcow2_resume_refcount_repair(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!s->refcount_repair_floor || s->refcount_repair_co) {
+        return;
+    }
+
+    qcow2_launch_refcount_repair(bs);
+}
+
+/*
+ * Stop the background refcount repair, if it is running.  The image stays
+ * dirty and refcounts below the floor stay untrusted, so that the repair is
+ * done again when the image is made writable again or the next time it is
+ * opened.
+ */
+void qcow2_stop_refcount_repair(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!s->refcount_repair_co) {
+        return;
+    }
+
+    qatomic_set(&s->refcount_repair_cancel, true);
+    qcow2_refcount_repair_wake(bs);
+    BDRV_POLL_WHILE(bs, s->refcount_repair_co != NULL);
+}
+
+void qcow2_refcount_repair_drain_begin(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    qatomic_set(&s->refcount_repair_pause, true);
+}
+
+void qcow2_refcount_repair_drain_end(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    qatomic_set(&s->refcount_repair_pause, false);
+    if (s->refcount_repair_co) {
+        qcow2_refcount_repair_wake(bs);
+    }
+}
@@ -652,6 +652,11 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
         return -ENOTSUP;
     }
 
+    /* Snapshots change refcounts that may not be repaired yet */
+    if (s->refcount_repair_floor) {
+        return -EBUSY;
+    }
+
     memset(sn, 0, sizeof(*sn));
 
     /* Generate an ID */
@@ -771,6 +776,10 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
         return -ENOTSUP;
     }
 
+    if (s->refcount_repair_floor) {
+        return -EBUSY;
+    }
+
     /* Search the snapshot */
     snapshot_index = find_snapshot_by_id_or_name(bs, snapshot_id);
     if (snapshot_index < 0) {
@@ -871,11 +880,15 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
 
     /*
      * Now update the in-memory L1 table to be in sync with the on-disk one. We
-     * need to do this even if updating refcounts failed.
+     * need to do this even if updating refcounts failed.  None of the
+     * extents in the extent map describe the new L1 table.
      */
+    qcow2_extent_map_invalidate(s);
+    seqlock_write_begin(&s->mapping_seqlock);
     for(i = 0;i < s->l1_size; i++) {
         s->l1_table[i] = be64_to_cpu(sn_l1_table[i]);
     }
+    seqlock_write_end(&s->mapping_seqlock);
 
     if (ret < 0) {
         goto fail;
@@ -919,6 +932,11 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
         return -ENOTSUP;
     }
 
+    if (s->refcount_repair_floor) {
+        error_setg(errp, "Refcounts are still being repaired");
+        return -EBUSY;
+    }
+
     /* Search the snapshot */
     snapshot_index = find_snapshot_by_id_and_name(bs, snapshot_id, name);
     if (snapshot_index < 0) {
@@ -1061,16 +1079,14 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
         return ret;
     }
 
-    /* Switch the L1 table */
-    qemu_vfree(s->l1_table);
+    for(i = 0;i < sn->l1_size; i++) {
+        be64_to_cpus(&new_l1_table[i]);
+    }
 
-    s->l1_size = sn->l1_size;
+    /* Switch the L1 table; the extent map describes the active one */
+    qcow2_extent_map_invalidate(s);
     s->l1_table_offset = sn->l1_table_offset;
-    s->l1_table = new_l1_table;
-
-    for(i = 0;i < s->l1_size; i++) {
-        be64_to_cpus(&s->l1_table[i]);
-    }
+    qcow2_replace_l1_table(s, new_l1_table, sn->l1_size);
 
     return 0;
 }
@@ -33,6 +33,7 @@
 #include <zstd_errors.h>
 #endif
 
+#include "qapi/error.h"
 #include "qcow2.h"
 #include "block/block-io.h"
 #include "block/thread-pool.h"
@@ -45,7 +46,7 @@ qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
     BDRVQcow2State *s = bs->opaque;
 
     qemu_co_mutex_lock(&s->lock);
-    while (s->nb_threads >= QCOW2_MAX_THREADS) {
+    while (s->nb_threads >= s->max_threads) {
         qemu_co_queue_wait(&s->thread_task_queue, &s->lock);
     }
     s->nb_threads++;
@@ -66,9 +67,11 @@ qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
  * Compression
  */
 
-typedef ssize_t (*Qcow2CompressFunc)(void *dest, size_t dest_size,
+typedef ssize_t (*Qcow2CompressFunc)(BDRVQcow2State *s,
+                                     void *dest, size_t dest_size,
                                      const void *src, size_t src_size);
 typedef struct Qcow2CompressData {
+    BDRVQcow2State *s;
     void *dest;
     size_t dest_size;
     const void *src;
@@ -83,6 +86,7 @@ typedef struct Qcow2CompressData {
  *
  * Compress @src_size bytes of data using zlib compression method
  *
+ * @s - image state, provides the compression level
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
  *
@@ -90,15 +94,17 @@ typedef struct Qcow2CompressData {
  *          -ENOMEM destination buffer is not enough to store compressed data
  *          -EIO    on any other error
  */
-static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
+static ssize_t qcow2_zlib_compress(BDRVQcow2State *s,
+                                   void *dest, size_t dest_size,
                                    const void *src, size_t src_size)
 {
     ssize_t ret;
     z_stream strm;
+    int level = s->compression_level ?: Z_DEFAULT_COMPRESSION;
 
     /* best compression, small window, no zlib header */
     memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+    ret = deflateInit2(&strm, level, Z_DEFLATED,
                        -12, 9, Z_DEFAULT_STRATEGY);
     if (ret != Z_OK) {
         return -EIO;
@@ -137,7 +143,8 @@ static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
  * Returns: 0 on success
  *          -EIO on fail
  */
-static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
+static ssize_t qcow2_zlib_decompress(BDRVQcow2State *s,
+                                     void *dest, size_t dest_size,
                                      const void *src, size_t src_size)
 {
     int ret;
@@ -178,6 +185,7 @@ static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
  *
  * Compress @src_size bytes of data using zstd compression method
  *
+ * @s - image state, provides the compression level and dictionary
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
  *
@@ -185,7 +193,8 @@ static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
  *          -ENOMEM destination buffer is not enough to store compressed data
  *          -EIO    on any other error
  */
-static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
+static ssize_t qcow2_zstd_compress(BDRVQcow2State *s,
+                                   void *dest, size_t dest_size,
                                    const void *src, size_t src_size)
 {
     ssize_t ret;
@@ -205,6 +214,18 @@ static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
     if (!cctx) {
         return -EIO;
     }
+
+    /* A prepared dictionary already carries the compression level */
+    if (s->zstd_cdict) {
+        zstd_ret = ZSTD_CCtx_refCDict(cctx, s->zstd_cdict);
+    } else {
+        zstd_ret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+                                          s->compression_level);
+    }
+    if (ZSTD_isError(zstd_ret)) {
+        ret = -EIO;
+        goto out;
+    }
     /*
      * Use the zstd streamed interface for symmetry with decompression,
      * where streaming is essential since we don't record the exact
@@ -247,13 +268,15 @@ out:
  * Decompress some data (not more than @src_size bytes) to produce exactly
  * @dest_size bytes using zstd compression method
  *
+ * @s - image state, provides the dictionary
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
  *
  * Returns: 0 on success
  *          -EIO on any error
  */
-static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
+static ssize_t qcow2_zstd_decompress(BDRVQcow2State *s,
+                                     void *dest, size_t dest_size,
                                      const void *src, size_t src_size)
 {
     size_t zstd_ret = 0;
@@ -274,6 +297,12 @@ static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
         return -EIO;
     }
 
+    if (s->zstd_ddict &&
+        ZSTD_isError(ZSTD_DCtx_refDDict(dctx, s->zstd_ddict))) {
+        ZSTD_freeDCtx(dctx);
+        return -EIO;
+    }
+
     /*
      * The compressed stream from the input buffer may consist of more
      * than one zstd frame. So we iterate until we get a fully
@@ -325,11 +354,83 @@ static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
 }
 #endif
 
+/*
+ * qcow2_compression_check_level()
+ *
+ * Check that @level can be used with compression type @type.  Callers
+ * handle 0, which selects the default level of the compression type, before
+ * calling this.
+ */
+int qcow2_compression_check_level(Qcow2CompressionType type, int level,
+                                  Error **errp)
+{
+    int max;
+
+    switch (type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        max = Z_BEST_COMPRESSION;
+        break;
+
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        max = ZSTD_maxCLevel();
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    if (level < 1 || level > max) {
+        error_setg(errp, "Compression level must be between 1 and %d for this "
+                   "compression type", max);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/*
+ * qcow2_compression_dict_load()
+ *
+ * Prepare the dictionary @dict of @size bytes for all compression and
+ * decompression in the image, using s->compression_level for compression.
+ * @dict is copied and may be freed by the caller.
+ */
+int qcow2_compression_dict_load(BDRVQcow2State *s, const void *dict,
+                                size_t size, Error **errp)
+{
+#ifdef CONFIG_ZSTD
+    assert(s->compression_type == QCOW2_COMPRESSION_TYPE_ZSTD);
+
+    qcow2_compression_dict_free(s);
+    s->zstd_cdict = ZSTD_createCDict(dict, size, s->compression_level);
+    s->zstd_ddict = ZSTD_createDDict(dict, size);
+    if (!s->zstd_cdict || !s->zstd_ddict) {
+        qcow2_compression_dict_free(s);
+        error_setg(errp, "Could not load the zstd compression dictionary");
+        return -EINVAL;
+    }
+    return 0;
+#else
+    error_setg(errp, "Compression dictionaries require zstd support");
+    return -ENOTSUP;
+#endif
+}
+
+void qcow2_compression_dict_free(BDRVQcow2State *s)
+{
+#ifdef CONFIG_ZSTD
+    ZSTD_freeCDict(s->zstd_cdict);
+    ZSTD_freeDDict(s->zstd_ddict);
+#endif
+    s->zstd_cdict = NULL;
+    s->zstd_ddict = NULL;
+}
+
 static int qcow2_compress_pool_func(void *opaque)
 {
     Qcow2CompressData *data = opaque;
 
-    data->ret = data->func(data->dest, data->dest_size,
+    data->ret = data->func(data->s, data->dest, data->dest_size,
                            data->src, data->src_size);
 
     return 0;
@@ -340,6 +441,7 @@ qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                      const void *src, size_t src_size, Qcow2CompressFunc func)
 {
     Qcow2CompressData arg = {
+        .s = bs->opaque,
         .dest = dest,
         .dest_size = dest_size,
         .src = src,
@@ -73,6 +73,8 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_CRYPTO_HEADER 0x0537be77
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
+#define  QCOW2_EXT_MAGIC_COMPRESSION 0x636d7072
+#define  QCOW2_EXT_MAGIC_EXTENT_MAP 0x6578746d
 
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
@@ -432,6 +434,89 @@ qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             break;
         }
 
+        case QCOW2_EXT_MAGIC_COMPRESSION:
+        {
+            Qcow2CompressionHeaderExt compression_ext;
+
+            if (ext.len != sizeof(compression_ext)) {
+                error_setg(errp, "Compression parameters header extension "
+                           "size %u, but expected size %zu", ext.len,
+                           sizeof(compression_ext));
+                return -EINVAL;
+            }
+
+            ret = bdrv_co_pread(bs->file, offset, ext.len, &compression_ext,
+                                0);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Unable to read compression "
+                                 "parameters header extension");
+                return ret;
+            }
+            s->compression_level =
+                be32_to_cpu(compression_ext.compression_level);
+            s->compression_dict_size = be32_to_cpu(compression_ext.dict_size);
+            s->compression_dict_offset =
+                be64_to_cpu(compression_ext.dict_offset);
+
+            if (s->compression_dict_size &&
+                offset_into_cluster(s, s->compression_dict_offset)) {
+                error_setg(errp, "Compression dictionary offset '%" PRIu64
+                           "' is not a multiple of cluster size '%u'",
+                           s->compression_dict_offset, s->cluster_size);
+                return -EINVAL;
+            }
+
+            /* The level is only a hint for writers, don't refuse the image */
+            if (s->compression_level &&
+                qcow2_compression_check_level(s->compression_type,
+                                              s->compression_level,
+                                              NULL) < 0) {
+                warn_report("qcow2: Ignoring invalid compression level %d",
+                            s->compression_level);
+                s->compression_level = 0;
+            }
+            break;
+        }
+
+        case QCOW2_EXT_MAGIC_EXTENT_MAP:
+        {
+            Qcow2ExtentMapHeaderExt extent_map_ext;
+
+            if (ext.len != sizeof(extent_map_ext)) {
+                error_setg(errp, "Extent map header extension size %u, but "
+                           "expected size %zu", ext.len,
+                           sizeof(extent_map_ext));
+                return -EINVAL;
+            }
+
+            ret = bdrv_co_pread(bs->file, offset, ext.len, &extent_map_ext,
+                                0);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Unable to read extent map "
+                                 "header extension");
+                return ret;
+            }
+            s->extent_map_nb_extents = be64_to_cpu(extent_map_ext.nb_extents);
+            s->extent_map_offset =
+                be64_to_cpu(extent_map_ext.extent_map_offset);
+
+            if (!s->extent_map_nb_extents ||
+                s->extent_map_nb_extents > QCOW2_MAX_EXTENTS) {
+                error_setg(errp, "Invalid number of extents in extent map: "
+                           "%" PRIu64, s->extent_map_nb_extents);
+                return -EINVAL;
+            }
+
+            if (!s->extent_map_offset ||
+                offset_into_cluster(s, s->extent_map_offset)) {
+                error_setg(errp, "Extent map offset '%" PRIu64 "' is not a "
+                           "non-zero multiple of cluster size '%u'",
+                           s->extent_map_offset, s->cluster_size);
+                return -EINVAL;
+            }
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             /* If you add a new feature, make sure to also update the fast
@@ -537,10 +622,15 @@ int qcow2_mark_dirty(BlockDriverState *bs)
  * function when there are no pending requests, it does not guard against
  * concurrent requests dirtying the image.
  */
-static int GRAPH_RDLOCK qcow2_mark_clean(BlockDriverState *bs)
+int qcow2_mark_clean(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
 
+    /* Refcounts are only correct once the background repair has finished */
+    if (s->refcount_repair_floor) {
+        return 0;
+    }
+
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         int ret;
 
@@ -696,6 +786,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_OVERLAP_INACTIVE_L1,
     QCOW2_OPT_OVERLAP_INACTIVE_L2,
     QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY,
+    QCOW2_OPT_OVERLAP_COMPRESSION_DICT,
     QCOW2_OPT_CACHE_SIZE,
     QCOW2_OPT_L2_CACHE_SIZE,
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
@@ -734,6 +825,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Do not unreference discarded clusters",
         },
+        {
+            .name = QCOW2_OPT_BACKGROUND_REFCOUNT_REPAIR,
+            .type = QEMU_OPT_BOOL,
+            .help = "Repair the refcounts of a dirty image in the background "
+                    "instead of while opening it",
+        },
         {
             .name = QCOW2_OPT_OVERLAP,
             .type = QEMU_OPT_STRING,
@@ -791,6 +888,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Check for unintended writes into the bitmap directory",
         },
+        {
+            .name = QCOW2_OPT_OVERLAP_COMPRESSION_DICT,
+            .type = QEMU_OPT_BOOL,
+            .help = "Check for unintended writes into the compression "
+                    "dictionary",
+        },
         {
             .name = QCOW2_OPT_CACHE_SIZE,
             .type = QEMU_OPT_SIZE,
@@ -833,6 +936,7 @@ static const char *overlap_bool_option_names[QCOW2_OL_MAX_BITNR] = {
     [QCOW2_OL_INACTIVE_L1_BITNR]      = QCOW2_OPT_OVERLAP_INACTIVE_L1,
     [QCOW2_OL_INACTIVE_L2_BITNR]      = QCOW2_OPT_OVERLAP_INACTIVE_L2,
     [QCOW2_OL_BITMAP_DIRECTORY_BITNR] = QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY,
+    [QCOW2_OL_COMPRESSION_DICT_BITNR] = QCOW2_OPT_OVERLAP_COMPRESSION_DICT,
 };
 
 static void cache_clean_timer_cb(void *opaque)
@@ -978,6 +1082,7 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     bool discard_no_unref;
+    bool background_refcount_repair;
     uint64_t cache_clean_interval;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
@@ -1060,6 +1165,7 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         ret = -ENOMEM;
         goto fail;
     }
+    qcow2_cache_set_seqlock(r->l2_table_cache, &s->mapping_seqlock);
 
     /* New interval for cache cleanup timer */
     r->cache_clean_interval =
@@ -1157,6 +1263,9 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         goto fail;
     }
 
+    r->background_refcount_repair =
+        qemu_opt_get_bool(opts, QCOW2_OPT_BACKGROUND_REFCOUNT_REPAIR, false);
+
     switch (s->crypt_method_header) {
     case QCOW_CRYPT_NONE:
         if (encryptfmt) {
@@ -1238,6 +1347,7 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     }
 
     s->discard_no_unref = r->discard_no_unref;
+    s->background_refcount_repair = r->background_refcount_repair;
 
     if (s->cache_clean_interval != r->cache_clean_interval) {
         cache_clean_timer_del(bs);
@@ -1278,6 +1388,57 @@ qcow2_update_options(BlockDriverState *bs, QDict *options, int flags,
     return ret;
 }
 
+/*
+ * Check the compression parameters header extension against the feature
+ * bits and load the compression dictionary, if there is one.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_load_compression_dict(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    g_autofree void *dict = NULL;
+    int ret;
+
+    if (!(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION_DICT) !=
+        !s->compression_dict_size) {
+        error_setg(errp, "qcow2: Compression dictionary incompatible feature "
+                   "bit does not match the compression parameters");
+        return -EINVAL;
+    }
+
+    if (!s->compression_dict_size) {
+        return 0;
+    }
+
+    if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZSTD) {
+        error_setg(errp, "qcow2: Compression dictionaries are only supported "
+                   "with zstd compression");
+        return -EINVAL;
+    }
+
+    if (s->compression_dict_size > QCOW2_MAX_COMPRESSION_DICT_SIZE) {
+        error_setg(errp, "qcow2: Compression dictionary too large");
+        return -EFBIG;
+    }
+
+    dict = g_try_malloc(s->compression_dict_size);
+    if (!dict) {
+        error_setg(errp, "qcow2: Could not allocate compression dictionary");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_co_pread(bs->file, s->compression_dict_offset,
+                        s->compression_dict_size, dict, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "qcow2: Could not read compression "
+                         "dictionary");
+        return ret;
+    }
+
+    return qcow2_compression_dict_load(s, dict, s->compression_dict_size,
+                                       errp);
+}
+
 static int validate_compression_type(BDRVQcow2State *s, Error **errp)
 {
     switch (s->compression_type) {
@@ -1636,6 +1797,11 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    ret = qcow2_load_compression_dict(bs, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
     if (open_data_file && (flags & BDRV_O_NO_IO)) {
         /*
          * Don't open the data file for 'qemu-img info' so that it can be used
@@ -1776,6 +1942,14 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
+    ret = qcow2_read_extent_map(bs, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+    if (bdrv_is_writable(bs)) {
+        update_header |= qcow2_extent_map_mark_in_use(bs);
+    }
+
     /* Clear unknown autoclear feature bits */
     update_header |= s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK;
     update_header = update_header && bdrv_is_writable(bs);
@@ -1869,8 +2043,12 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         (s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
         BdrvCheckResult result = {0};
 
-        ret = qcow2_co_check_locked(bs, &result,
-                                    BDRV_FIX_ERRORS | BDRV_FIX_LEAKS);
+        if (s->background_refcount_repair) {
+            ret = qcow2_start_refcount_repair(bs);
+        } else {
+            ret = qcow2_co_check_locked(bs, &result,
+                                        BDRV_FIX_ERRORS | BDRV_FIX_LEAKS);
+        }
         if (ret < 0 || result.check_errors) {
             if (ret >= 0) {
                 ret = -EIO;
@@ -1888,6 +2066,7 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
 #endif
 
     qemu_co_queue_init(&s->thread_task_queue);
+    s->max_threads = MAX(QCOW2_MAX_THREADS, g_get_num_processors());
 
     return ret;
 
@@ -1915,6 +2094,8 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
     }
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
+    qcow2_compression_dict_free(s);
+    qcow2_extent_map_invalidate(s);
     return ret;
 }
 
@@ -1961,6 +2142,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    seqlock_init(&s->mapping_seqlock);
 
     assert(!qemu_in_coroutine());
     assert(qemu_get_current_aio_context() == qemu_get_aio_context());
@@ -2006,11 +2188,19 @@ qcow2_reopen_prepare(BDRVReopenState *state,BlockReopenQueue *queue,
 
     /* We need to write out any unwritten data if we reopen read-only. */
     if ((state->flags & BDRV_O_RDWR) == 0) {
+        qcow2_stop_refcount_repair(state->bs);
+
         ret = qcow2_reopen_bitmaps_ro(state->bs, errp);
         if (ret < 0) {
             goto fail;
         }
 
+        ret = qcow2_store_extent_map(state->bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to store the extent map");
+            goto fail;
+        }
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
@@ -2057,6 +2247,19 @@ static void qcow2_reopen_commit(BDRVReopenState *state)
     g_free(state->opaque);
 }
 
+static void GRAPH_RDLOCK qcow2_extent_map_reopen_rw(BlockDriverState *bs)
+{
+    int ret;
+
+    if (qcow2_extent_map_mark_in_use(bs)) {
+        ret = qcow2_update_header(bs);
+        if (ret < 0) {
+            error_report("%s: Failed to update the extent map: %s",
+                         bdrv_get_node_name(bs), strerror(-ret));
+        }
+    }
+}
+
 static void qcow2_reopen_commit_post(BDRVReopenState *state)
 {
     GRAPH_RDLOCK_GUARD_MAINLOOP();
@@ -2074,6 +2277,9 @@ static void qcow2_reopen_commit_post(BDRVReopenState *state)
                               "%s: Failed to make dirty bitmaps writable: ",
                               bdrv_get_node_name(state->bs));
         }
+
+        qcow2_extent_map_reopen_rw(state->bs);
+        qcow2_resume_refcount_repair(state->bs);
     }
 }
 
@@ -2083,6 +2289,15 @@ static void qcow2_reopen_abort(BDRVReopenState *state)
 
     GRAPH_RDLOCK_GUARD_MAINLOOP();
 
+    /*
+     * The image stays writable, so take the extent map back and continue
+     * the refcount repair
+     */
+    if (!(state->flags & BDRV_O_RDWR) && bdrv_is_writable(state->bs)) {
+        qcow2_extent_map_reopen_rw(state->bs);
+        qcow2_resume_refcount_repair(state->bs);
+    }
+
     if (!s->data_file) {
         /*
          * If we don't have an external data file, s->data_file was cleared by
@@ -2403,10 +2618,19 @@ qcow2_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
-        qemu_co_mutex_lock(&s->lock);
-        ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
-                                    &host_offset, &type);
-        qemu_co_mutex_unlock(&s->lock);
+        /*
+         * Mappings that are already in the L2 cache can be resolved without
+         * s->lock, so that requests from different queues don't serialize
+         * on it.
+         */
+        ret = qcow2_get_host_offset_nolock(bs, offset, &cur_bytes,
+                                           &host_offset, &type);
+        if (ret == -EAGAIN) {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
+                                        &host_offset, &type);
+            qemu_co_mutex_unlock(&s->lock);
+        }
         if (ret < 0) {
             goto out;
         }
@@ -2762,6 +2986,8 @@ static int GRAPH_RDLOCK qcow2_inactivate(BlockDriverState *bs)
     int ret, result = 0;
     Error *local_err = NULL;
 
+    qcow2_stop_refcount_repair(bs);
+
     qcow2_store_persistent_dirty_bitmaps(bs, true, &local_err);
     if (local_err != NULL) {
         result = -EINVAL;
@@ -2770,6 +2996,12 @@ static int GRAPH_RDLOCK qcow2_inactivate(BlockDriverState *bs)
                           bdrv_get_device_or_node_name(bs));
     }
 
+    ret = qcow2_store_extent_map(bs);
+    if (ret) {
+        result = ret;
+        error_report("Failed to store the extent map: %s", strerror(-ret));
+    }
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -2795,6 +3027,9 @@ static void coroutine_mixed_fn GRAPH_RDLOCK
 qcow2_do_close(BlockDriverState *bs, bool close_data_file)
 {
     BDRVQcow2State *s = bs->opaque;
+
+    qcow2_stop_refcount_repair(bs);
+
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
@@ -2811,6 +3046,9 @@ qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     s->crypto = NULL;
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
 
+    qcow2_compression_dict_free(s);
+    qcow2_extent_map_invalidate(s);
+
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
 
@@ -3046,6 +3284,39 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Compression parameters header extension */
+    if (s->compression_level || s->compression_dict_size) {
+        Qcow2CompressionHeaderExt compression_ext = {
+            .compression_level = cpu_to_be32(s->compression_level),
+            .dict_size = cpu_to_be32(s->compression_dict_size),
+            .dict_offset = cpu_to_be64(s->compression_dict_offset),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_COMPRESSION,
+                             &compression_ext, sizeof(compression_ext),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
+    /* Extent map header extension */
+    if (s->extent_map_offset) {
+        Qcow2ExtentMapHeaderExt extent_map_ext = {
+            .nb_extents = cpu_to_be64(s->extent_map_nb_extents),
+            .extent_map_offset = cpu_to_be64(s->extent_map_offset),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_EXTENT_MAP,
+                             &extent_map_ext, sizeof(extent_map_ext),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /*
      * Feature table.  A mere 8 feature names occupies 392 bytes, and
      * when coupled with the v3 minimum header of 104 bytes plus the
@@ -3081,6 +3352,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
                 .name = "extended L2 entries",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_COMPRESSION_DICT_BITNR,
+                .name = "compression dictionary",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -3096,6 +3372,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR,
                 .name = "raw external data",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+                .bit  = QCOW2_AUTOCLEAR_EXTENT_MAP_BITNR,
+                .name = "extent map",
+            },
         };
 
         ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -3247,6 +3528,106 @@ qcow2_set_up_encryption(BlockDriverState *bs,
     return ret;
 }
 
+/*
+ * Read the whole contents of @bs, a zstd dictionary given with the
+ * compression-dictionary create option, into a newly allocated buffer.
+ */
+static int coroutine_fn GRAPH_UNLOCKED
+qcow2_co_read_compression_dict(BlockDriverState *bs, char **dict,
+                               size_t *dict_size, Error **errp)
+{
+    BlockBackend *blk;
+    int64_t size;
+    int ret;
+
+    blk = blk_co_new_with_bs(bs, BLK_PERM_CONSISTENT_READ, BLK_PERM_ALL, errp);
+    if (!blk) {
+        return -EPERM;
+    }
+
+    size = blk_co_getlength(blk);
+    if (size < 0) {
+        error_setg_errno(errp, -size, "Could not get the size of the "
+                         "compression dictionary");
+        ret = size;
+        goto out;
+    }
+    if (size == 0 || size > QCOW2_MAX_COMPRESSION_DICT_SIZE) {
+        error_setg(errp, "Compression dictionary size must be between 1 "
+                   "and %" PRId64 " bytes",
+                   (int64_t)QCOW2_MAX_COMPRESSION_DICT_SIZE);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    *dict = g_malloc(size);
+    ret = blk_co_pread(blk, 0, size, *dict, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read compression dictionary");
+        g_free(*dict);
+        *dict = NULL;
+        goto out;
+    }
+    *dict_size = size;
+    ret = 0;
+
+out:
+    blk_co_unref(blk);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_set_up_compression(BlockDriverState *bs, int level,
+                         const char *dict, size_t dict_size, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t offset;
+    int ret;
+
+    s->compression_level = level;
+
+    if (dict) {
+        /* Make sure that zstd accepts the dictionary before storing it */
+        ret = qcow2_compression_dict_load(s, dict, dict_size, errp);
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset = qcow2_alloc_clusters(bs, dict_size);
+        if (offset < 0) {
+            error_setg_errno(errp, -offset, "Could not allocate clusters for "
+                             "the compression dictionary");
+            return offset;
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, offset, dict_size, false);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write compression "
+                             "dictionary");
+            return ret;
+        }
+
+        ret = bdrv_co_pwrite(bs->file, offset, dict_size, dict, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write compression "
+                             "dictionary");
+            return ret;
+        }
+
+        s->compression_dict_offset = offset;
+        s->compression_dict_size = dict_size;
+        s->incompatible_features |= QCOW2_INCOMPAT_COMPRESSION_DICT;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write compression parameters");
+        return ret;
+    }
+
+    return 0;
+}
+
 /**
  * Preallocates metadata structures for data clusters between @offset (in the
  * guest disk) and @new_length (which is thus generally the new guest disk
@@ -3516,6 +3897,9 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
     BlockBackend *blk = NULL;
     BlockDriverState *bs = NULL;
     BlockDriverState *data_bs = NULL;
+    BlockDriverState *dict_bs = NULL;
+    g_autofree char *dict = NULL;
+    size_t dict_size = 0;
     QCowHeader *header;
     size_t cluster_size;
     int version;
@@ -3701,6 +4085,40 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         compression_type = qcow2_opts->compression_type;
     }
 
+    if (qcow2_opts->has_compression_level) {
+        if (qcow2_opts->compression_level < 1 ||
+            qcow2_opts->compression_level > INT_MAX) {
+            error_setg(errp, "Compression level must be positive");
+            ret = -EINVAL;
+            goto out;
+        }
+        ret = qcow2_compression_check_level(compression_type,
+                                            qcow2_opts->compression_level,
+                                            errp);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    if (qcow2_opts->compression_dictionary) {
+        if (compression_type != QCOW2_COMPRESSION_TYPE_ZSTD) {
+            error_setg(errp, "Compression dictionaries are only supported "
+                       "with compression type zstd");
+            ret = -EINVAL;
+            goto out;
+        }
+        dict_bs = bdrv_co_open_blockdev_ref(qcow2_opts->compression_dictionary,
+                                            errp);
+        if (dict_bs == NULL) {
+            ret = -EIO;
+            goto out;
+        }
+        ret = qcow2_co_read_compression_dict(dict_bs, &dict, &dict_size, errp);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
     /* Create BlockBackend to write to the image */
     blk = blk_co_new_with_bs(bs, BLK_PERM_WRITE | BLK_PERM_RESIZE, BLK_PERM_ALL,
                              errp);
@@ -3821,6 +4239,21 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         goto out;
     }
 
+    /* Compression parameters need the refcount structures to be set up */
+    if (qcow2_opts->has_compression_level ||
+        qcow2_opts->compression_dictionary)
+    {
+        bdrv_graph_co_rdlock();
+        ret = qcow2_set_up_compression(blk_bs(blk),
+                                       qcow2_opts->compression_level,
+                                       dict, dict_size, errp);
+        bdrv_graph_co_rdunlock();
+
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
     /* Okay, now that we have a valid image, let's give it the right size */
     ret = blk_co_truncate(blk, qcow2_opts->size, false,
                           qcow2_opts->preallocation, 0, errp);
@@ -3889,6 +4322,7 @@ out:
     blk_co_unref(blk);
     bdrv_co_unref(bs);
     bdrv_co_unref(data_bs);
+    bdrv_co_unref(dict_bs);
     return ret;
 }
 
@@ -3901,6 +4335,7 @@ qcow2_co_create_opts(BlockDriver *drv, const char *filename, QemuOpts *opts,
     Visitor *v;
     BlockDriverState *bs = NULL;
     BlockDriverState *data_bs = NULL;
+    BlockDriverState *dict_bs = NULL;
     const char *val;
     int ret;
 
@@ -3945,6 +4380,7 @@ qcow2_co_create_opts(BlockDriver *drv, const char *filename, QemuOpts *opts,
         { BLOCK_OPT_COMPAT_LEVEL,       "version" },
         { BLOCK_OPT_DATA_FILE_RAW,      "data-file-raw" },
         { BLOCK_OPT_COMPRESSION_TYPE,   "compression-type" },
+        { BLOCK_OPT_COMPRESSION_LEVEL,  "compression-level" },
         { NULL, NULL },
     };
 
@@ -3986,6 +4422,19 @@ qcow2_co_create_opts(BlockDriver *drv, const char *filename, QemuOpts *opts,
         qdict_put_str(qdict, "data-file", data_bs->node_name);
     }
 
+    /* Open the compression dictionary (protocol layer) */
+    val = qdict_get_try_str(qdict, BLOCK_OPT_COMPRESSION_DICT);
+    if (val) {
+        dict_bs = bdrv_co_open(val, NULL, NULL, BDRV_O_PROTOCOL, errp);
+        if (dict_bs == NULL) {
+            ret = -EIO;
+            goto finish;
+        }
+
+        qdict_del(qdict, BLOCK_OPT_COMPRESSION_DICT);
+        qdict_put_str(qdict, "compression-dictionary", dict_bs->node_name);
+    }
+
     /* Set 'driver' and 'node' options */
     qdict_put_str(qdict, "driver", "qcow2");
     qdict_put_str(qdict, "file", bs->node_name);
@@ -4023,6 +4472,7 @@ finish:
     qobject_unref(qdict);
     bdrv_co_unref(bs);
     bdrv_co_unref(data_bs);
+    bdrv_co_unref(dict_bs);
     qapi_free_BlockdevCreateOptions(create_options);
     return ret;
 }
@@ -4342,6 +4792,12 @@ qcow2_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
 
     if (offset < old_length) {
         int64_t last_cluster, old_file_size;
+        if (s->refcount_repair_floor) {
+            error_setg(errp, "Can't shrink the image while its refcounts are "
+                       "being repaired");
+            ret = -EBUSY;
+            goto fail;
+        }
         if (prealloc != PREALLOC_MODE_OFF) {
             error_setg(errp,
                        "Preallocation can't be used for shrinking an image");
@@ -4671,84 +5127,140 @@ fail:
     return ret;
 }
 
-static int coroutine_fn GRAPH_RDLOCK
-qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
-                                 uint64_t offset, uint64_t bytes,
-                                 QEMUIOVector *qiov, size_t qiov_offset)
+/*
+ * Compressed writes are pipelined: the clusters of a request are compressed
+ * in parallel by a pool of tasks, each into its own slot of an array that
+ * acts as reorder buffer.  Meanwhile the request coroutine takes the
+ * clusters that are ready at the head of the array, in guest order, and
+ * allocates host space for a batch of them under one s->lock section, so
+ * that they end up packed back to back in the image and their L2 entries
+ * are updated together.  The batch is then written with as few requests as
+ * possible while the next clusters are still being compressed.
+ */
+typedef struct Qcow2CompressedCluster {
+    uint64_t offset;
+    uint64_t bytes;
+    size_t qiov_offset;
+    uint8_t *out_buf;
+    int out_len; /* -ENOMEM if the cluster is written uncompressed */
+    bool done;
+} Qcow2CompressedCluster;
+
+typedef struct Qcow2CompressTask {
+    AioTask task;
+    BlockDriverState *bs;
+    QEMUIOVector *qiov;
+    Qcow2CompressedCluster *cluster;
+    int *nb_done;
+} Qcow2CompressTask;
+
+static int coroutine_fn
+qcow2_co_compress_cluster(BlockDriverState *bs, QEMUIOVector *qiov,
+                          Qcow2CompressedCluster *cl)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret;
+    uint8_t *buf;
     ssize_t out_len;
-    uint8_t *buf, *out_buf;
-    uint64_t cluster_offset;
 
-    assert(bytes == s->cluster_size || (bytes < s->cluster_size &&
-           (offset + bytes == bs->total_sectors << BDRV_SECTOR_BITS)));
+    assert(cl->bytes == s->cluster_size || (cl->bytes < s->cluster_size &&
+           (cl->offset + cl->bytes == bs->total_sectors << BDRV_SECTOR_BITS)));
 
     buf = qemu_blockalign(bs, s->cluster_size);
-    if (bytes < s->cluster_size) {
+    if (cl->bytes < s->cluster_size) {
         /* Zero-pad last write if image size is not cluster aligned */
-        memset(buf + bytes, 0, s->cluster_size - bytes);
+        memset(buf + cl->bytes, 0, s->cluster_size - cl->bytes);
     }
-    qemu_iovec_to_buf(qiov, qiov_offset, buf, bytes);
-
-    out_buf = g_malloc(s->cluster_size);
+    qemu_iovec_to_buf(qiov, cl->qiov_offset, buf, cl->bytes);
 
-    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
+    cl->out_buf = g_malloc(s->cluster_size);
+    out_len = qcow2_co_compress(bs, cl->out_buf, s->cluster_size - 1,
                                 buf, s->cluster_size);
-    if (out_len == -ENOMEM) {
-        /* could not compress: write normal cluster */
-        ret = qcow2_co_pwritev_part(bs, offset, bytes, qiov, qiov_offset, 0);
-        if (ret < 0) {
-            goto fail;
-        }
-        goto success;
-    } else if (out_len < 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
+    qemu_vfree(buf);
 
-    qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_alloc_compressed_cluster_offset(bs, offset, out_len,
-                                                &cluster_offset);
-    if (ret < 0) {
-        qemu_co_mutex_unlock(&s->lock);
-        goto fail;
-    }
+    cl->out_len = out_len;
+    cl->done = true;
 
-    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len, true);
-    qemu_co_mutex_unlock(&s->lock);
-    if (ret < 0) {
-        goto fail;
+    /* -ENOMEM means that the cluster could not be compressed */
+    if (out_len < 0 && out_len != -ENOMEM) {
+        return -EINVAL;
     }
+    return 0;
+}
 
-    BLKDBG_CO_EVENT(s->data_file, BLKDBG_WRITE_COMPRESSED);
-    ret = bdrv_co_pwrite(s->data_file, cluster_offset, out_len, out_buf, 0);
-    if (ret < 0) {
-        goto fail;
-    }
-success:
-    ret = 0;
-fail:
-    qemu_vfree(buf);
-    g_free(out_buf);
+static int coroutine_fn qcow2_co_compress_cluster_entry(AioTask *task)
+{
+    Qcow2CompressTask *t = container_of(task, Qcow2CompressTask, task);
+    int ret;
+
+    ret = qcow2_co_compress_cluster(t->bs, t->qiov, t->cluster);
+    (*t->nb_done)++;
     return ret;
 }
 
-/*
- * This function can count as GRAPH_RDLOCK because
- * qcow2_co_pwritev_compressed_part() holds the graph lock and keeps it until
- * this coroutine has terminated.
- */
 static int coroutine_fn GRAPH_RDLOCK
-qcow2_co_pwritev_compressed_task_entry(AioTask *task)
+qcow2_co_write_compressed_clusters(BlockDriverState *bs, QEMUIOVector *qiov,
+                                   Qcow2CompressedCluster *clusters,
+                                   int nb_clusters)
 {
-    Qcow2AioTask *t = container_of(task, Qcow2AioTask, task);
+    BDRVQcow2State *s = bs->opaque;
+    g_autofree int *sizes = g_new(int, nb_clusters);
+    g_autofree uint64_t *host_offsets = g_new0(uint64_t, nb_clusters);
+    QEMUIOVector hd_qiov;
+    int i, j, ret;
 
-    assert(!t->subcluster_type && !t->l2meta);
+    for (i = 0; i < nb_clusters; i++) {
+        sizes[i] = clusters[i].out_len;
+    }
 
-    return qcow2_co_pwritev_compressed_task(t->bs, t->offset, t->bytes, t->qiov,
-                                            t->qiov_offset);
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_alloc_compressed_cluster_offsets(bs, clusters[0].offset,
+                                                 nb_clusters, sizes,
+                                                 host_offsets);
+    for (i = 0; ret == 0 && i < nb_clusters; i++) {
+        if (sizes[i] >= 0) {
+            ret = qcow2_pre_write_overlap_check(bs, 0, host_offsets[i],
+                                                sizes[i], true);
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < nb_clusters; i = j) {
+        uint64_t end;
+
+        if (sizes[i] < 0) {
+            /* could not compress: write normal cluster */
+            ret = qcow2_co_pwritev_part(bs, clusters[i].offset,
+                                        clusters[i].bytes, qiov,
+                                        clusters[i].qiov_offset, 0);
+            if (ret < 0) {
+                return ret;
+            }
+            j = i + 1;
+            continue;
+        }
+
+        /* Merge all clusters that were packed back to back */
+        qemu_iovec_init(&hd_qiov, nb_clusters - i);
+        end = host_offsets[i];
+        for (j = i; j < nb_clusters && sizes[j] >= 0 &&
+                    host_offsets[j] == end; j++) {
+            qemu_iovec_add(&hd_qiov, clusters[j].out_buf, sizes[j]);
+            end += sizes[j];
+        }
+
+        BLKDBG_CO_EVENT(s->data_file, BLKDBG_WRITE_COMPRESSED);
+        ret = bdrv_co_pwritev(s->data_file, host_offsets[i],
+                              hd_qiov.size, &hd_qiov, 0);
+        qemu_iovec_destroy(&hd_qiov);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
 }
 
 /*
@@ -4761,7 +5273,10 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
                                  QEMUIOVector *qiov, size_t qiov_offset)
 {
     BDRVQcow2State *s = bs->opaque;
-    AioTaskPool *aio = NULL;
+    Qcow2CompressedCluster *clusters;
+    AioTaskPool *aio;
+    int i, nb_clusters, max_tasks;
+    int nb_started = 0, nb_done = 0, nb_written = 0;
     int ret = 0;
 
     if (has_data_file(bs)) {
@@ -4790,30 +5305,82 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         return -EINVAL;
     }
 
-    while (bytes && aio_task_pool_status(aio) == 0) {
-        uint64_t chunk_size = MIN(bytes, s->cluster_size);
+    nb_clusters = size_to_clusters(s, bytes);
+    clusters = g_new0(Qcow2CompressedCluster, nb_clusters);
+    for (i = 0; i < nb_clusters; i++) {
+        clusters[i].offset = offset + ((uint64_t)i << s->cluster_bits);
+        clusters[i].bytes = MIN(bytes - ((uint64_t)i << s->cluster_bits),
+                                s->cluster_size);
+        clusters[i].qiov_offset = qiov_offset +
+                                  ((uint64_t)i << s->cluster_bits);
+    }
 
-        if (!aio && chunk_size != bytes) {
-            aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+    if (nb_clusters == 1) {
+        ret = qcow2_co_compress_cluster(bs, qiov, &clusters[0]);
+        if (ret == 0) {
+            ret = qcow2_co_write_compressed_clusters(bs, qiov, clusters, 1);
         }
+        goto out;
+    }
+
+    max_tasks = MAX(QCOW2_MAX_WORKERS, s->max_threads);
+    aio = aio_task_pool_new(max_tasks);
+
+    while (nb_written < nb_clusters) {
+        int n;
+
+        /* Keep the pool busy without waiting for a free slot */
+        while (nb_started < nb_clusters &&
+               nb_started - nb_done < max_tasks) {
+            Qcow2CompressTask *t = g_new(Qcow2CompressTask, 1);
 
-        ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_compressed_task_entry,
-                             0, 0, offset, chunk_size, qiov, qiov_offset, NULL);
+            *t = (Qcow2CompressTask) {
+                .task.func = qcow2_co_compress_cluster_entry,
+                .bs = bs,
+                .qiov = qiov,
+                .cluster = &clusters[nb_started++],
+                .nb_done = &nb_done,
+            };
+            aio_task_pool_start_task(aio, &t->task);
+        }
+
+        ret = aio_task_pool_status(aio);
         if (ret < 0) {
             break;
         }
-        qiov_offset += chunk_size;
-        offset += chunk_size;
-        bytes -= chunk_size;
-    }
 
-    if (aio) {
-        aio_task_pool_wait_all(aio);
-        if (ret == 0) {
-            ret = aio_task_pool_status(aio);
+        /*
+         * Write the clusters that are ready in guest order once there are
+         * enough of them for a batch, or when they are the last ones.
+         */
+        for (n = 0; nb_written + n < nb_started &&
+                    clusters[nb_written + n].done; n++) {
+            /* nothing */
         }
-        g_free(aio);
+        if (n < max_tasks && nb_written + n < nb_clusters) {
+            aio_task_pool_wait_one(aio);
+            continue;
+        }
+
+        ret = qcow2_co_write_compressed_clusters(bs, qiov,
+                                                 &clusters[nb_written], n);
+        if (ret < 0) {
+            break;
+        }
+        nb_written += n;
+    }
+
+    aio_task_pool_wait_all(aio);
+    if (ret == 0) {
+        ret = aio_task_pool_status(aio);
+    }
+    aio_task_pool_free(aio);
+
+out:
+    for (i = 0; i < nb_clusters; i++) {
+        g_free(clusters[i].out_buf);
     }
+    g_free(clusters);
 
     return ret;
 }
@@ -5024,16 +5591,17 @@ static int GRAPH_RDLOCK qcow2_make_empty(BlockDriverState *bs)
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
-        !has_data_file(bs)) {
+        !s->compression_dict_size && !s->extent_map_offset &&
+        !s->refcount_repair_floor && !has_data_file(bs)) {
         /* The following function only works for qcow2 v3 images (it
          * requires the dirty flag) and only as long as there are no
          * features that reserve extra clusters (such as snapshots,
-         * LUKS header, or persistent bitmaps), because it completely
-         * empties the image.  Furthermore, the L1 table and three
-         * additional clusters (image header, refcount table, one
-         * refcount block) have to fit inside one refcount block. It
-         * only resets the image file, i.e. does not work with an
-         * external data file. */
+         * LUKS header, compression dictionary, extent map, or persistent
+         * bitmaps), because it completely empties the image.
+         * Furthermore, the L1 table and three additional clusters (image
+         * header, refcount table, one refcount block) have to fit inside
+         * one refcount block. It only resets the image file, i.e. does
+         * not work with an external data file. */
         return make_completely_empty(bs);
     }
 
@@ -5508,6 +6076,9 @@ qcow2_downgrade(BlockDriverState *bs, int target_version,
     /* if lazy refcounts have been used, they have already been fixed through
      * clearing the dirty flag */
 
+    /* v2 images have no autoclear bits to protect the extent map with */
+    qcow2_remove_extent_map(bs);
+
     /* clearing autoclear features is trivial */
     s->autoclear_features = 0;
 
@@ -5699,6 +6270,7 @@ qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
     QemuOptDesc *desc = opts->list->desc;
     Qcow2AmendHelperCBInfo helper_cb_info;
     bool encryption_update = false;
+    int extent_map = -1;
 
     while (desc && desc->name) {
         if (!qemu_opt_find(opts, desc->name)) {
@@ -5766,6 +6338,8 @@ qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                                  "images");
                 return -EINVAL;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTENT_MAP)) {
+            extent_map = qemu_opt_get_bool(opts, BLOCK_OPT_EXTENT_MAP, false);
         } else {
             /* if this point is reached, this probably means a new option was
              * added without having it covered here */
@@ -5920,6 +6494,27 @@ qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
         }
     }
 
+    /* Build the extent map last, so that it describes the final L2 tables */
+    if (extent_map == 1) {
+        if (new_version < 3) {
+            error_setg(errp, "Extent maps are only supported with "
+                       "compatibility level 1.1 and above (use compat=1.1 "
+                       "or greater)");
+            return -EINVAL;
+        }
+        ret = qcow2_build_extent_map(bs, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    } else if (extent_map == 0 && s->extent_map_offset) {
+        qcow2_remove_extent_map(bs);
+        ret = qcow2_update_header(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to update the image header");
+            return ret;
+        }
+    }
+
     /* Downgrade last (so unsupported features can be removed before) */
     if (new_version < old_version) {
         helper_cb_info.current_operation = QCOW2_DOWNGRADING;
@@ -6113,6 +6708,18 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Compression method used for image cluster "        \
                     "compression",                                      \
             .def_value_str = "zlib"                                     \
+        },                                                              \
+        {                                                               \
+            .name = BLOCK_OPT_COMPRESSION_LEVEL,                        \
+            .type = QEMU_OPT_NUMBER,                                    \
+            .help = "Compression level used for image cluster "         \
+                    "compression",                                      \
+        },                                                              \
+        {                                                               \
+            .name = BLOCK_OPT_COMPRESSION_DICT,                         \
+            .type = QEMU_OPT_STRING,                                    \
+            .help = "File with a zstd dictionary for image cluster "    \
+                    "compression",                                      \
         },
         QCOW_COMMON_OPTIONS,
         { /* end of list */ }
@@ -6128,6 +6735,12 @@ static QemuOptsList qcow2_amend_opts = {
         BLOCK_CRYPTO_OPT_DEF_LUKS_OLD_SECRET("encrypt."),
         BLOCK_CRYPTO_OPT_DEF_LUKS_NEW_SECRET("encrypt."),
         BLOCK_CRYPTO_OPT_DEF_LUKS_ITER_TIME("encrypt."),
+        {
+            .name = BLOCK_OPT_EXTENT_MAP,
+            .type = QEMU_OPT_BOOL,
+            .help = "Store a map of contiguous guest to host ranges in "
+                    "the image to speed up cluster lookups",
+        },
         QCOW_COMMON_OPTIONS,
         { /* end of list */ }
     }
@@ -6198,6 +6811,8 @@ BlockDriver bdrv_qcow2 = {
 
     .bdrv_detach_aio_context            = qcow2_detach_aio_context,
     .bdrv_attach_aio_context            = qcow2_attach_aio_context,
+    .bdrv_drain_begin                   = qcow2_refcount_repair_drain_begin,
+    .bdrv_drain_end                     = qcow2_refcount_repair_drain_end,
 
     .bdrv_supports_persistent_dirty_bitmap =
             qcow2_supports_persistent_dirty_bitmap,
@@ -27,6 +27,7 @@
 
 #include "crypto/block.h"
 #include "qemu/coroutine.h"
+#include "qemu/seqlock.h"
 #include "qemu/units.h"
 #include "block/block_int.h"
 
@@ -57,6 +58,9 @@
  * (128 GB for 512 byte clusters, 2 EB for 2 MB clusters) */
 #define QCOW_MAX_L1_SIZE (32 * MiB)
 
+/* Compression dictionaries are read into memory as a whole */
+#define QCOW2_MAX_COMPRESSION_DICT_SIZE (16 * MiB)
+
 /* Allow for an average of 1k per snapshot table entry, should be plenty of
  * space for snapshot names and IDs */
 #define QCOW_MAX_SNAPSHOTS_SIZE (1024 * QCOW_MAX_SNAPSHOTS)
@@ -134,6 +138,7 @@
 #define QCOW2_OPT_DISCARD_SNAPSHOT "pass-discard-snapshot"
 #define QCOW2_OPT_DISCARD_OTHER "pass-discard-other"
 #define QCOW2_OPT_DISCARD_NO_UNREF "discard-no-unref"
+#define QCOW2_OPT_BACKGROUND_REFCOUNT_REPAIR "background-refcount-repair"
 #define QCOW2_OPT_OVERLAP "overlap-check"
 #define QCOW2_OPT_OVERLAP_TEMPLATE "overlap-check.template"
 #define QCOW2_OPT_OVERLAP_MAIN_HEADER "overlap-check.main-header"
@@ -145,6 +150,7 @@
 #define QCOW2_OPT_OVERLAP_INACTIVE_L1 "overlap-check.inactive-l1"
 #define QCOW2_OPT_OVERLAP_INACTIVE_L2 "overlap-check.inactive-l2"
 #define QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY "overlap-check.bitmap-directory"
+#define QCOW2_OPT_OVERLAP_COMPRESSION_DICT "overlap-check.compression-dictionary"
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
@@ -256,17 +262,20 @@ enum {
     QCOW2_INCOMPAT_DATA_FILE_BITNR  = 2,
     QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
     QCOW2_INCOMPAT_EXTL2_BITNR      = 4,
+    QCOW2_INCOMPAT_COMPRESSION_DICT_BITNR = 5,
     QCOW2_INCOMPAT_DIRTY            = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT          = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
     QCOW2_INCOMPAT_DATA_FILE        = 1 << QCOW2_INCOMPAT_DATA_FILE_BITNR,
     QCOW2_INCOMPAT_COMPRESSION      = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
     QCOW2_INCOMPAT_EXTL2            = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
+    QCOW2_INCOMPAT_COMPRESSION_DICT = 1 << QCOW2_INCOMPAT_COMPRESSION_DICT_BITNR,
 
     QCOW2_INCOMPAT_MASK             = QCOW2_INCOMPAT_DIRTY
                                     | QCOW2_INCOMPAT_CORRUPT
                                     | QCOW2_INCOMPAT_DATA_FILE
                                     | QCOW2_INCOMPAT_COMPRESSION
-                                    | QCOW2_INCOMPAT_EXTL2,
+                                    | QCOW2_INCOMPAT_EXTL2
+                                    | QCOW2_INCOMPAT_COMPRESSION_DICT,
 };
 
 /* Compatible feature bits */
@@ -281,11 +290,14 @@ enum {
 enum {
     QCOW2_AUTOCLEAR_BITMAPS_BITNR       = 0,
     QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR = 1,
+    QCOW2_AUTOCLEAR_EXTENT_MAP_BITNR    = 2,
     QCOW2_AUTOCLEAR_BITMAPS             = 1 << QCOW2_AUTOCLEAR_BITMAPS_BITNR,
     QCOW2_AUTOCLEAR_DATA_FILE_RAW       = 1 << QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR,
+    QCOW2_AUTOCLEAR_EXTENT_MAP          = 1 << QCOW2_AUTOCLEAR_EXTENT_MAP_BITNR,
 
     QCOW2_AUTOCLEAR_MASK                = QCOW2_AUTOCLEAR_BITMAPS
-                                        | QCOW2_AUTOCLEAR_DATA_FILE_RAW,
+                                        | QCOW2_AUTOCLEAR_DATA_FILE_RAW
+                                        | QCOW2_AUTOCLEAR_EXTENT_MAP,
 };
 
 enum qcow2_discard_type {
@@ -315,6 +327,27 @@ typedef uint64_t Qcow2GetRefcountFunc(const void *refcount_array,
 typedef void Qcow2SetRefcountFunc(void *refcount_array,
                                   uint64_t index, uint64_t value);
 
+typedef struct Qcow2CompressionHeaderExt {
+    int32_t compression_level;
+    uint32_t dict_size;
+    uint64_t dict_offset;
+} QEMU_PACKED Qcow2CompressionHeaderExt;
+
+typedef struct Qcow2ExtentMapHeaderExt {
+    uint64_t nb_extents;
+    uint64_t extent_map_offset;
+} QEMU_PACKED Qcow2ExtentMapHeaderExt;
+
+/* One contiguous guest range -> host range run, also the on-disk format */
+typedef struct Qcow2Extent {
+    uint64_t guest_offset;
+    uint64_t host_offset;
+    uint64_t length;
+} QEMU_PACKED Qcow2Extent;
+
+#define QCOW2_MAX_EXTENT_MAP_SIZE (64 * MiB)
+#define QCOW2_MAX_EXTENTS (QCOW2_MAX_EXTENT_MAP_SIZE / sizeof(Qcow2Extent))
+
 typedef struct Qcow2BitmapHeaderExt {
     uint32_t nb_bitmaps;
     uint32_t reserved32;
@@ -359,6 +392,14 @@ typedef struct BDRVQcow2State {
 
     CoMutex lock;
 
+    /*
+     * Protects the guest to host mapping (the in-memory L1 table and the L2
+     * slices in l2_table_cache) for qcow2_get_host_offset_nolock().  Writers
+     * must hold @lock.  The L1 table itself is freed after an RCU grace
+     * period.
+     */
+    QemuSeqLock mapping_seqlock;
+
     Qcow2CryptoHeaderExtension crypto_header; /* QCow2 header extension */
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
     QCryptoBlock *crypto; /* Disk encryption format driver */
@@ -410,6 +451,7 @@ typedef struct BDRVQcow2State {
 
     CoQueue thread_task_queue;
     int nb_threads;
+    int max_threads; /* at least QCOW2_MAX_THREADS, scaled to the host */
 
     BdrvChild *data_file;
 
@@ -422,6 +464,50 @@ typedef struct BDRVQcow2State {
      * is to convert the image with the desired compression type set.
      */
     Qcow2CompressionType compression_type;
+
+    /*
+     * Compression parameters header extension.  compression_level 0 means
+     * the default level of the compression type.  The dictionary (zstd only)
+     * is loaded at open time and prepared for reuse by every compression
+     * and decompression in zstd_cdict/zstd_ddict.
+     */
+    int compression_level;
+    uint64_t compression_dict_offset;
+    uint32_t compression_dict_size;
+    void *zstd_cdict;
+    void *zstd_ddict;
+
+    /*
+     * Extent map header extension.  extent_map is the in-memory copy of the
+     * on-disk map, sorted by guest offset, or NULL if it is not loaded or
+     * has been invalidated by a change to the L2 tables.  While the image is
+     * writable, extent_map_in_use is set and QCOW2_AUTOCLEAR_EXTENT_MAP is
+     * kept clear on disk; it is only set again when the image is closed with
+     * the map still valid.  Protected by s->lock; extent_map and
+     * extent_map_nb_extents are additionally published under
+     * mapping_seqlock and extent_map is freed with RCU, so that
+     * qcow2_get_host_offset_nolock() can use the map.
+     */
+    uint64_t extent_map_offset;
+    uint64_t extent_map_nb_extents;
+    Qcow2Extent *extent_map;
+    bool extent_map_in_use;
+
+    /*
+     * Background refcount repair of a dirty image (see qcow2-refcount.c).
+     * While refcount_repair_floor is non-zero, the refcounts of all clusters
+     * below it may be too low: no clusters are allocated or freed there, and
+     * the image is not marked clean.  refcount_repair_floor is protected by
+     * s->lock; the flags are accessed atomically because they are set
+     * outside of coroutine context.
+     */
+    bool background_refcount_repair;
+    uint64_t refcount_repair_floor;
+    Coroutine *refcount_repair_co;
+    bool refcount_repair_pause;
+    bool refcount_repair_waiting;
+    bool refcount_repair_cancel;
+    bool refcount_repair_locked;
 } BDRVQcow2State;
 
 typedef struct Qcow2COWRegion {
@@ -557,8 +643,9 @@ typedef enum QCow2MetadataOverlap {
     QCOW2_OL_INACTIVE_L1_BITNR      = 6,
     QCOW2_OL_INACTIVE_L2_BITNR      = 7,
     QCOW2_OL_BITMAP_DIRECTORY_BITNR = 8,
+    QCOW2_OL_COMPRESSION_DICT_BITNR = 9,
 
-    QCOW2_OL_MAX_BITNR              = 9,
+    QCOW2_OL_MAX_BITNR              = 10,
 
     QCOW2_OL_NONE             = 0,
     QCOW2_OL_MAIN_HEADER      = (1 << QCOW2_OL_MAIN_HEADER_BITNR),
@@ -572,12 +659,14 @@ typedef enum QCow2MetadataOverlap {
      * reads. */
     QCOW2_OL_INACTIVE_L2      = (1 << QCOW2_OL_INACTIVE_L2_BITNR),
     QCOW2_OL_BITMAP_DIRECTORY = (1 << QCOW2_OL_BITMAP_DIRECTORY_BITNR),
+    QCOW2_OL_COMPRESSION_DICT = (1 << QCOW2_OL_COMPRESSION_DICT_BITNR),
 } QCow2MetadataOverlap;
 
 /* Perform all overlap checks which can be done in constant time */
 #define QCOW2_OL_CONSTANT \
     (QCOW2_OL_MAIN_HEADER | QCOW2_OL_ACTIVE_L1 | QCOW2_OL_REFCOUNT_TABLE | \
-     QCOW2_OL_SNAPSHOT_TABLE | QCOW2_OL_BITMAP_DIRECTORY)
+     QCOW2_OL_SNAPSHOT_TABLE | QCOW2_OL_BITMAP_DIRECTORY | \
+     QCOW2_OL_COMPRESSION_DICT)
 
 /* Perform all overlap checks which don't require disk access */
 #define QCOW2_OL_CACHED \
@@ -626,11 +715,20 @@ static inline uint64_t get_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
     }
 }
 
+void qcow2_extent_map_invalidate(BDRVQcow2State *s);
+
 static inline void set_l2_entry(BDRVQcow2State *s, uint64_t *l2_slice,
                                 int idx, uint64_t entry)
 {
     idx *= l2_entry_size(s) / sizeof(uint64_t);
+    if (s->extent_map && (be64_to_cpu(l2_slice[idx]) & L2E_OFFSET_MASK) &&
+        be64_to_cpu(l2_slice[idx]) != entry) {
+        /* This cluster may be covered by an extent that is now stale */
+        qcow2_extent_map_invalidate(s);
+    }
+    seqlock_write_begin(&s->mapping_seqlock);
     l2_slice[idx] = cpu_to_be64(entry);
+    seqlock_write_end(&s->mapping_seqlock);
 }
 
 static inline void set_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
@@ -638,7 +736,12 @@ static inline void set_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
 {
     assert(has_subclusters(s));
     idx *= l2_entry_size(s) / sizeof(uint64_t);
+    if (s->extent_map && be64_to_cpu(l2_slice[idx + 1]) != bitmap) {
+        qcow2_extent_map_invalidate(s);
+    }
+    seqlock_write_begin(&s->mapping_seqlock);
     l2_slice[idx + 1] = cpu_to_be64(bitmap);
+    seqlock_write_end(&s->mapping_seqlock);
 }
 
 static inline bool GRAPH_RDLOCK has_data_file(BlockDriverState *bs)
@@ -835,6 +938,7 @@ int64_t qcow2_refcount_metadata_size(int64_t clusters, size_t cluster_size,
                                      uint64_t *refblock_count);
 
 int GRAPH_RDLOCK qcow2_mark_dirty(BlockDriverState *bs);
+int GRAPH_RDLOCK qcow2_mark_clean(BlockDriverState *bs);
 int GRAPH_RDLOCK qcow2_mark_corrupt(BlockDriverState *bs);
 int GRAPH_RDLOCK qcow2_update_header(BlockDriverState *bs);
 
@@ -916,6 +1020,12 @@ qcow2_get_last_cluster(BlockDriverState *bs, int64_t size);
 int coroutine_fn GRAPH_RDLOCK
 qcow2_detect_metadata_preallocation(BlockDriverState *bs);
 
+int coroutine_fn GRAPH_RDLOCK qcow2_start_refcount_repair(BlockDriverState *bs);
+void qcow2_resume_refcount_repair(BlockDriverState *bs);
+void GRAPH_RDLOCK qcow2_stop_refcount_repair(BlockDriverState *bs);
+void qcow2_refcount_repair_drain_begin(BlockDriverState *bs);
+void qcow2_refcount_repair_drain_end(BlockDriverState *bs);
+
 /* qcow2-cluster.c functions */
 int GRAPH_RDLOCK
 qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size, bool exact_size);
@@ -924,6 +1034,8 @@ int coroutine_fn GRAPH_RDLOCK
 qcow2_shrink_l1_table(BlockDriverState *bs, uint64_t max_size);
 
 int GRAPH_RDLOCK qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
+void qcow2_replace_l1_table(BDRVQcow2State *s, uint64_t *l1_table,
+                            int l1_size);
 int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
                           uint8_t *buf, int nb_sectors, bool enc, Error **errp);
 
@@ -931,6 +1043,10 @@ int GRAPH_RDLOCK
 qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                       unsigned int *bytes, uint64_t *host_offset,
                       QCow2SubclusterType *subcluster_type);
+int GRAPH_RDLOCK
+qcow2_get_host_offset_nolock(BlockDriverState *bs, uint64_t offset,
+                             unsigned int *bytes, uint64_t *host_offset,
+                             QCow2SubclusterType *subcluster_type);
 
 int coroutine_fn GRAPH_RDLOCK
 qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
@@ -938,8 +1054,10 @@ qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
                         QCowL2Meta **m);
 
 int coroutine_fn GRAPH_RDLOCK
-qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs, uint64_t offset,
-                                      int compressed_size, uint64_t *host_offset);
+qcow2_alloc_compressed_cluster_offsets(BlockDriverState *bs, uint64_t offset,
+                                       int nb_clusters,
+                                       const int *compressed_sizes,
+                                       uint64_t *host_offsets);
 void GRAPH_RDLOCK
 qcow2_parse_compressed_l2_entry(BlockDriverState *bs, uint64_t l2_entry,
                                 uint64_t *coffset, int *csize);
@@ -1022,6 +1140,9 @@ void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
 
+void qcow2_cache_set_seqlock(Qcow2Cache *c, QemuSeqLock *seqlock);
+void *qcow2_cache_lookup_nolock(Qcow2Cache *c, uint64_t offset);
+
 /* qcow2-bitmap.c functions */
 int coroutine_fn GRAPH_RDLOCK
 qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
@@ -1058,12 +1179,27 @@ bool qcow2_supports_persistent_dirty_bitmap(BlockDriverState *bs);
 uint64_t qcow2_get_persistent_dirty_bitmap_size(BlockDriverState *bs,
                                                 uint32_t cluster_size);
 
+/* qcow2-extent-map.c functions */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_read_extent_map(BlockDriverState *bs, Error **errp);
+bool GRAPH_RDLOCK qcow2_extent_map_mark_in_use(BlockDriverState *bs);
+int GRAPH_RDLOCK qcow2_store_extent_map(BlockDriverState *bs);
+int GRAPH_RDLOCK qcow2_build_extent_map(BlockDriverState *bs, Error **errp);
+void GRAPH_RDLOCK qcow2_remove_extent_map(BlockDriverState *bs);
+bool qcow2_extent_map_lookup(BDRVQcow2State *s, uint64_t offset,
+                             unsigned int *bytes, uint64_t *host_offset);
+
 ssize_t coroutine_fn
 qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                   const void *src, size_t src_size);
 ssize_t coroutine_fn
 qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
                     const void *src, size_t src_size);
+int qcow2_compression_check_level(Qcow2CompressionType type, int level,
+                                  Error **errp);
+int qcow2_compression_dict_load(BDRVQcow2State *s, const void *dict,
+                                size_t size, Error **errp);
+void qcow2_compression_dict_free(BDRVQcow2State *s);
 int coroutine_fn
 qcow2_co_encrypt(BlockDriverState *bs, uint64_t host_offset,
                  uint64_t guest_offset, void *buf, size_t len);
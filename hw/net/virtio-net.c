@@ -3905,6 +3905,8 @@ static const VMStateDescription vmstate_virtio_net = {
     },
     .pre_save = virtio_net_pre_save,
     .dev_unplug_pending = dev_unplug_pending,
+    /* Neither the hooks nor the transport look beyond the NIC itself */
+    .independent = true,
 };
 
 static Property virtio_net_properties[] = {
@@ -7,6 +7,7 @@
 
 #include "qemu/osdep.h"
 #include "hw/vfio/vfio-common.h"
+#include "migration/blocker.h"
 #include "migration/misc.h"
 #include "qapi/error.h"
 #include "sysemu/runstate.h"
@@ -30,10 +31,23 @@ bool vfio_cpr_register_container(VFIOContainerBase *bcontainer, Error **errp)
     migration_add_notifier_mode(&bcontainer->cpr_reboot_notifier,
                                 vfio_cpr_reboot_notifier,
                                 MIG_MODE_CPR_REBOOT);
+
+    /*
+     * The DMA mappings of the destination would keep pinning its own RAM
+     * after the RAM of the source is mapped in its place.
+     */
+    error_setg(&bcontainer->cpr_transfer_blocker,
+               "VFIO device does not support cpr-transfer");
+    if (migrate_add_blocker_modes(&bcontainer->cpr_transfer_blocker, errp,
+                                  MIG_MODE_CPR_TRANSFER, -1) < 0) {
+        migration_remove_notifier(&bcontainer->cpr_reboot_notifier);
+        return false;
+    }
     return true;
 }
 
 void vfio_cpr_unregister_container(VFIOContainerBase *bcontainer)
 {
+    migrate_del_blocker(&bcontainer->cpr_transfer_blocker);
     migration_remove_notifier(&bcontainer->cpr_reboot_notifier);
 }
@@ -117,6 +117,8 @@ static const VMStateDescription vmstate_virtio_vhost_vsock = {
     },
     .pre_save = vhost_vsock_common_pre_save,
     .post_load = vhost_vsock_common_post_load,
+    /* The backend is stopped, pre_save only checks that */
+    .independent = true,
 };
 
 static void vhost_vsock_device_realize(DeviceState *dev, Error **errp)
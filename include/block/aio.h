@@ -57,6 +57,19 @@ struct ThreadPool;
 struct LinuxAioState;
 typedef struct LuringState LuringState;
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * Completion handler for a request added with aio_add_sqe().  @cb is invoked
+ * from the AioContext's event loop with a copy of the completion in @cqe.
+ */
+typedef struct CqeHandler CqeHandler;
+struct CqeHandler {
+    void (*cb)(CqeHandler *cqe_handler);
+    struct io_uring_cqe cqe;
+    QSIMPLEQ_ENTRY(CqeHandler) next;
+};
+#endif
+
 /* Is polling disabled? */
 bool aio_poll_disabled(AioContext *ctx);
 
@@ -105,6 +118,35 @@ typedef struct {
      * Returns: true if ->wait() should be called, false otherwise.
      */
     bool (*need_wait)(AioContext *ctx);
+
+    /*
+     * dispatch:
+     * @ctx: the AioContext
+     *
+     * Run completion callbacks that ->wait() collected in addition to ready
+     * file descriptors.  Optional.
+     *
+     * Called with ctx->list_lock incremented but not locked.
+     *
+     * Returns: true if progress was made.
+     */
+    bool (*dispatch)(AioContext *ctx);
+
+#ifdef CONFIG_LINUX_IO_URING
+    /*
+     * add_sqe:
+     * @ctx: the AioContext
+     * @sqe: the request to submit
+     * @cqe_handler: the completion handler
+     *
+     * Queue a request on the ring used for file descriptor monitoring.
+     * Optional, see aio_add_sqe().
+     *
+     * Returns: true if the request was queued, false otherwise.
+     */
+    bool (*add_sqe)(AioContext *ctx, const struct io_uring_sqe *sqe,
+                    CqeHandler *cqe_handler);
+#endif
 } FDMonOps;
 
 /*
@@ -217,6 +259,17 @@ struct AioContext {
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
     AioHandlerSList submit_list;
+
+    /* Timeout of the last IORING_OP_TIMEOUT, must outlive its submission */
+    struct __kernel_timespec fdmon_io_uring_ts;
+
+    /* Requests added with aio_add_sqe() */
+    unsigned int cqe_handler_in_flight;
+    QSIMPLEQ_HEAD(, CqeHandler) cqe_handler_ready_list;
+
+    /* SQPOLL kernel thread CPU (-1 if unpinned), see fdmon_io_uring_setup() */
+    int fdmon_io_uring_sq_cpu;
+    QLIST_ENTRY(AioContext) fdmon_io_uring_sq_next;
 #endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
@@ -712,6 +765,42 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
  */
 void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch);
 
+#ifdef CONFIG_LINUX_IO_URING
+/**
+ * aio_add_sqe:
+ * @ctx: the aio context
+ * @sqe: the request to submit, user_data is ignored
+ * @cqe_handler: the completion handler, ->cb must be set
+ *
+ * Queue an io_uring request on the ring that @ctx uses for file descriptor
+ * monitoring, so that its completion is reaped by the same io_uring_enter(2)
+ * as file descriptor events.  The request is submitted by the next
+ * aio_poll() iteration and @cqe_handler->cb is called from aio_poll() once it
+ * has completed.  Must be called from the @ctx home thread.
+ *
+ * Returns: false if @ctx does not monitor file descriptors with io_uring, in
+ * which case the caller has to submit the request by other means.
+ */
+bool aio_add_sqe(AioContext *ctx, const struct io_uring_sqe *sqe,
+                 CqeHandler *cqe_handler);
+#endif
+
+/**
+ * aio_context_set_io_uring_sqpoll:
+ * @ctx: the aio context
+ * @sq_thread_cpu: CPU to pin the kernel submission queue thread to, or -1
+ * @errp: pointer to Error*, to store an error if it happens.
+ *
+ * Switch file descriptor monitoring of @ctx to an io_uring created with
+ * IORING_SETUP_SQPOLL so that submitting sqes does not require system calls.
+ * Contexts with the same @sq_thread_cpu share one kernel thread.  This must be
+ * called before @ctx is used by any thread other than the caller.
+ *
+ * Returns: true on success, false on failure
+ */
+bool aio_context_set_io_uring_sqpoll(AioContext *ctx, int sq_thread_cpu,
+                                     Error **errp);
+
 /**
  * aio_context_set_thread_pool_params:
  * @ctx: the aio context
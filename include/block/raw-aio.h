@@ -69,9 +69,17 @@ void laio_attach_aio_context(LinuxAioState *s, AioContext *new_context);
 LuringState *luring_init(Error **errp);
 void luring_cleanup(LuringState *s);
 
-/* luring_co_submit: submit I/O requests in the thread's current AioContext. */
-int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
-                                  QEMUIOVector *qiov, int type);
+/*
+ * luring_co_submit: submit I/O requests in the thread's current AioContext.
+ * @fixed_file is an index returned by luring_register_file() or -1.  Fixed
+ * buffers are only used together with a fixed file.
+ */
+int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, int fixed_file,
+                                  uint64_t offset, QEMUIOVector *qiov, int type);
+int luring_register_file(int fd);
+void luring_unregister_file(int fixed_file);
+bool luring_register_buf(void *host, size_t size, Error **errp);
+void luring_unregister_buf(void *host, size_t size);
 void luring_detach_aio_context(LuringState *s, AioContext *old_context);
 void luring_attach_aio_context(LuringState *s, AioContext *new_context);
 #endif
@@ -104,6 +104,8 @@ void qemu_ram_set_migratable(RAMBlock *rb);
 void qemu_ram_unset_migratable(RAMBlock *rb);
 bool qemu_ram_is_named_file(RAMBlock *rb);
 int qemu_ram_get_fd(RAMBlock *rb);
+bool qemu_ram_replace_fd(RAMBlock *rb, int fd, uint64_t fd_offset,
+                         Error **errp);
 
 size_t qemu_ram_pagesize(RAMBlock *block);
 size_t qemu_ram_pagesize_largest(void);
@@ -58,7 +58,9 @@ static inline void clear_bmap_set(RAMBlock *rb, uint64_t start,
 {
     uint8_t shift = rb->clear_bmap_shift;
 
-    bitmap_set(rb->clear_bmap, start >> shift, clear_bmap_size(npages, shift));
+    /* Atomic, the dirty bitmap may be synchronized by several threads */
+    bitmap_set_atomic(rb->clear_bmap, start >> shift,
+                      clear_bmap_size(npages, shift));
 }
 
 /**
@@ -74,7 +76,12 @@ static inline bool clear_bmap_test_and_clear(RAMBlock *rb, uint64_t page)
 {
     uint8_t shift = rb->clear_bmap_shift;
 
-    return bitmap_test_and_clear(rb->clear_bmap, page >> shift, 1);
+    if (!test_bit(page >> shift, rb->clear_bmap)) {
+        return false;
+    }
+
+    /* Atomic, multifd channels may send pages of the same RAMBlock */
+    return bitmap_test_and_clear_atomic(rb->clear_bmap, page >> shift, 1);
 }
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -507,6 +514,9 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                 dest[k] |= bits;
                 new_dirty &= bits;
                 num_dirty += ctpopl(new_dirty);
+                if (rb->dirty_history) {
+                    rb->dirty_history[k] |= 1;
+                }
             }
 
             if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
@@ -542,6 +552,9 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                 if (!test_and_set_bit(k, dest)) {
                     num_dirty++;
                 }
+                if (rb->dirty_history) {
+                    rb->dirty_history[BIT_WORD(k)] |= 1;
+                }
             }
         }
     }
@@ -45,6 +45,13 @@ struct RAMBlock {
     size_t page_size;
     /* dirty bitmap used during migration */
     unsigned long *bmap;
+    /*
+     * With the defer-hot-pages migration capability, one byte per word of
+     * bmap: bit N is set if the pages of the word were dirtied N periods
+     * ago, bit 0 being the current period.  Protected by the same lock as
+     * bmap.
+     */
+    uint8_t *dirty_history;
 
     /*
      * Below fields are only used by mapped-ram migration
@@ -63,7 +63,8 @@ int migrate_add_blocker_internal(Error **reasonp, Error **errp);
 void migrate_del_blocker(Error **reasonp);
 
 /**
- * @migrate_add_blocker_normal - prevent normal migration mode from proceeding
+ * @migrate_add_blocker_normal - prevent the live migration modes (normal and
+ *                               cpr-transfer) from proceeding
  *
  * @reasonp - address of an error to be returned whenever migration is attempted
  *
@@ -198,6 +198,15 @@ struct VMStateDescription {
      * a QEMU_VM_SECTION_START section.
      */
     bool early_setup;
+    /*
+     * The state can be serialized while other devices are being saved and
+     * without holding the BQL: its pre_save(), post_save() and needed()
+     * hooks only look at the device itself.  Such VMSDs are saved into a
+     * buffer on a worker thread when the VM is stopped; the sections are
+     * still written to the stream in the usual order, so this doesn't
+     * change the migration stream.
+     */
+    bool independent;
     int version_id;
     int minimum_version_id;
     MigrationPriority priority;
@@ -38,6 +38,10 @@ struct IOThread {
     int64_t poll_max_ns;
     int64_t poll_grow;
     int64_t poll_shrink;
+
+    /* io_uring SQPOLL parameters, fixed once the iothread is created */
+    bool io_uring_sqpoll;
+    int32_t io_uring_sq_thread_cpu;
 };
 typedef struct IOThread IOThread;
 
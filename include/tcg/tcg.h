@@ -759,6 +759,8 @@ void tcg_pool_reset(TCGContext *s);
 TranslationBlock *tcg_tb_alloc(TCGContext *s);
 
 void tcg_region_reset_all(void);
+size_t tcg_region_evict(size_t nr, GTraverseFunc func, gpointer user_data);
+size_t tcg_region_count(void);
 
 size_t tcg_code_size(void);
 size_t tcg_code_capacity(void);
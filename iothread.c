@@ -16,6 +16,7 @@
 #include "qom/object_interfaces.h"
 #include "qemu/module.h"
 #include "block/aio.h"
+#include "block/aio-wait.h"
 #include "block/block.h"
 #include "sysemu/event-loop-base.h"
 #include "sysemu/iothread.h"
@@ -103,6 +104,7 @@ static void iothread_instance_init(Object *obj)
     IOThread *iothread = IOTHREAD(obj);
 
     iothread->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    iothread->io_uring_sq_thread_cpu = -1;
     iothread->thread_id = -1;
     qemu_sem_init(&iothread->init_done_sem, 0);
     /* By default, we don't run gcontext */
@@ -138,16 +140,36 @@ static void iothread_instance_finalize(Object *obj)
     qemu_sem_destroy(&iothread->init_done_sem);
 }
 
-static void iothread_init_gcontext(IOThread *iothread, const char *thread_name)
+static void iothread_attach_aio_source(IOThread *iothread)
 {
     GSource *source;
-    g_autofree char *name = g_strdup_printf("%s aio-context", thread_name);
+    g_autofree char *name = g_strdup_printf("IO %s aio-context",
+            object_get_canonical_path_component(OBJECT(iothread)));
 
-    iothread->worker_context = g_main_context_new();
     source = aio_get_g_source(iothread_get_aio_context(iothread));
     g_source_set_name(source, name);
     g_source_attach(source, iothread->worker_context);
     g_source_unref(source);
+}
+
+/* Runs in iothread_run() thread */
+static void iothread_attach_aio_source_bh(void *opaque)
+{
+    iothread_attach_aio_source(opaque);
+}
+
+static void iothread_init_gcontext(IOThread *iothread)
+{
+    iothread->worker_context = g_main_context_new();
+
+    /*
+     * Running the AioContext from glib disables io_uring file descriptor
+     * monitoring.  With SQPOLL, defer that until somebody actually asks for
+     * the GMainContext, see iothread_get_g_main_context().
+     */
+    if (!iothread->io_uring_sqpoll) {
+        iothread_attach_aio_source(iothread);
+    }
     iothread->main_loop = g_main_loop_new(iothread->worker_context, TRUE);
 }
 
@@ -190,6 +212,15 @@ static void iothread_init(EventLoopBase *base, Error **errp)
         return;
     }
 
+    if (iothread->io_uring_sqpoll &&
+        !aio_context_set_io_uring_sqpoll(iothread->ctx,
+                                         iothread->io_uring_sq_thread_cpu,
+                                         errp)) {
+        aio_context_unref(iothread->ctx);
+        iothread->ctx = NULL;
+        return;
+    }
+
     thread_name = g_strdup_printf("IO %s",
                         object_get_canonical_path_component(OBJECT(base)));
 
@@ -197,7 +228,7 @@ static void iothread_init(EventLoopBase *base, Error **errp)
      * Init one GMainContext for the iothread unconditionally, even if
      * it's not used
      */
-    iothread_init_gcontext(iothread, thread_name);
+    iothread_init_gcontext(iothread);
 
     iothread_set_aio_context_params(base, &local_error);
     if (local_error) {
@@ -292,6 +323,60 @@ static void iothread_set_poll_param(Object *obj, Visitor *v,
     }
 }
 
+static bool iothread_get_io_uring_sqpoll(Object *obj, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    return iothread->io_uring_sqpoll;
+}
+
+static void iothread_set_io_uring_sqpoll(Object *obj, bool value,
+                                         Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    if (iothread->ctx) {
+        error_setg(errp, "io-uring-sqpoll cannot be changed after the "
+                   "iothread has been created");
+        return;
+    }
+
+    iothread->io_uring_sqpoll = value;
+}
+
+static void iothread_get_io_uring_sq_thread_cpu(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    visit_type_int32(v, name, &iothread->io_uring_sq_thread_cpu, errp);
+}
+
+static void iothread_set_io_uring_sq_thread_cpu(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    int32_t value;
+
+    if (iothread->ctx) {
+        error_setg(errp, "%s cannot be changed after the iothread has been "
+                   "created", name);
+        return;
+    }
+
+    if (!visit_type_int32(v, name, &value, errp)) {
+        return;
+    }
+
+    if (value < -1) {
+        error_setg(errp, "%s value must be in range [-1, %" PRId32 "]",
+                   name, INT32_MAX);
+        return;
+    }
+
+    iothread->io_uring_sq_thread_cpu = value;
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     EventLoopBaseClass *bc = EVENT_LOOP_BASE_CLASS(klass);
@@ -311,6 +396,13 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
                               iothread_get_poll_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info);
+    object_class_property_add_bool(klass, "io-uring-sqpoll",
+                                   iothread_get_io_uring_sqpoll,
+                                   iothread_set_io_uring_sqpoll);
+    object_class_property_add(klass, "io-uring-sq-thread-cpu", "int",
+                              iothread_get_io_uring_sq_thread_cpu,
+                              iothread_set_io_uring_sq_thread_cpu,
+                              NULL, NULL);
 }
 
 static const TypeInfo iothread_info = {
@@ -374,6 +466,11 @@ IOThreadInfoList *qmp_query_iothreads(Error **errp)
 
 GMainContext *iothread_get_g_main_context(IOThread *iothread)
 {
+    if (iothread->io_uring_sqpoll && !qatomic_read(&iothread->run_gcontext)) {
+        /* Give up on io_uring, this must happen in the iothread itself */
+        aio_wait_bh_oneshot(iothread->ctx, iothread_attach_aio_source_bh,
+                            iothread);
+    }
     qatomic_set(&iothread->run_gcontext, 1);
     aio_notify(iothread->ctx);
     return iothread->worker_context;
@@ -7,6 +7,8 @@
 
 #include "qemu/osdep.h"
 #include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qemu/bitops.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "qapi/error.h"
@@ -17,6 +19,7 @@
 #include "io/channel-socket.h"
 #include "io/channel-util.h"
 #include "options.h"
+#include "ram.h"
 #include "trace.h"
 
 #define OFFSET_OPTION ",offset="
@@ -25,6 +28,41 @@ static struct FileOutgoingArgs {
     char *fname;
 } outgoing_args;
 
+/* The file that the last incremental mapped-ram checkpoint went to */
+static struct FileCheckpoint {
+    char *fname;
+    dev_t dev;
+    ino_t ino;
+    uint64_t offset;
+} checkpoint_args;
+
+/*
+ * Returns true if @fd is the file that the last checkpoint was saved to,
+ * so that only the pages dirtied since need to be written.  Remember @fd
+ * as the file of the next checkpoint.
+ */
+static bool file_is_checkpoint(int fd, const char *filename, uint64_t offset)
+{
+    struct stat st;
+    bool ret;
+
+    if (!migrate_mapped_ram_incremental() || fstat(fd, &st) < 0) {
+        return false;
+    }
+
+    ret = ram_has_checkpoint() && !g_strcmp0(checkpoint_args.fname, filename) &&
+          checkpoint_args.dev == st.st_dev &&
+          checkpoint_args.ino == st.st_ino &&
+          checkpoint_args.offset == offset;
+
+    g_free(checkpoint_args.fname);
+    checkpoint_args.fname = g_strdup(filename);
+    checkpoint_args.dev = st.st_dev;
+    checkpoint_args.ino = st.st_ino;
+    checkpoint_args.offset = offset;
+    return ret;
+}
+
 /* Remove the offset option from @filespec and return it in @offsetp. */
 
 int file_parse_offset(char *filespec, uint64_t *offsetp, Error **errp)
@@ -108,12 +146,18 @@ void file_start_outgoing_migration(MigrationState *s,
         return;
     }
 
-    if (ftruncate(fioc->fd, offset)) {
-        error_setg_errno(errp, errno,
-                         "failed to truncate migration file to offset %" PRIx64,
-                         offset);
-        object_unref(OBJECT(fioc));
-        return;
+    /* An incremental checkpoint rewrites the pages of the previous one */
+    if (file_is_checkpoint(fioc->fd, filename, offset)) {
+        trace_migration_file_outgoing_incremental(filename);
+    } else {
+        ram_discard_checkpoint();
+        if (ftruncate(fioc->fd, offset)) {
+            error_setg_errno(errp, errno,
+                             "failed to truncate migration file to offset %"
+                             PRIx64, offset);
+            object_unref(OBJECT(fioc));
+            return;
+        }
     }
 
     outgoing_args.fname = g_strdup(filename);
@@ -251,19 +295,70 @@ int file_write_ramblock_iov(QIOChannel *ioc, const struct iovec *iov,
     return (ret < 0) ? ret : 0;
 }
 
-int multifd_file_recv_data(MultiFDRecvParams *p, Error **errp)
+static int multifd_file_recv_range(MultiFDRecvParams *p, void *buf,
+                                   size_t size, off_t file_offset,
+                                   Error **errp)
 {
-    MultiFDRecvData *data = p->data;
     size_t ret;
 
-    ret = qio_channel_pread(p->c, (char *) data->opaque,
-                            data->size, data->file_offset, errp);
-    if (ret != data->size) {
+    ret = qio_channel_pread(p->c, buf, size, file_offset, errp);
+    if (ret != size) {
         error_prepend(errp,
                       "multifd recv (%u): read 0x%zx, expected 0x%zx",
-                      p->id, ret, data->size);
+                      p->id, ret, size);
         return -1;
     }
 
     return 0;
 }
+
+/*
+ * Ask the kernel to start reading the pages of a range in the background,
+ * so that the whole range is in flight at once instead of being read in
+ * readahead-sized pieces by the preads that follow.  This is pointless
+ * with O_DIRECT, which bypasses the page cache.
+ */
+static void multifd_file_recv_readahead(MultiFDRecvParams *p,
+                                        off_t file_offset, size_t size)
+{
+#ifdef POSIX_FADV_WILLNEED
+    if (!migrate_direct_io()) {
+        posix_fadvise(QIO_CHANNEL_FILE(p->c)->fd, file_offset, size,
+                      POSIX_FADV_WILLNEED);
+    }
+#endif
+}
+
+int multifd_file_recv_data(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDRecvData *data = p->data;
+    size_t page_size = qemu_target_page_size();
+    unsigned long start = data->bitmap_start;
+    unsigned long end = start + data->size / page_size;
+    unsigned long set_bit_idx, clear_bit_idx;
+    size_t offset;
+
+    if (!data->bitmap) {
+        return multifd_file_recv_range(p, data->opaque, data->size,
+                                       data->file_offset, errp);
+    }
+
+    multifd_file_recv_readahead(p, data->file_offset, data->size);
+
+    /* Read each run of contiguous pages with a single pread */
+    for (set_bit_idx = find_next_bit(data->bitmap, end, start);
+         set_bit_idx < end;
+         set_bit_idx = find_next_bit(data->bitmap, end, clear_bit_idx + 1)) {
+
+        clear_bit_idx = find_next_zero_bit(data->bitmap, end, set_bit_idx + 1);
+        offset = (set_bit_idx - start) * page_size;
+
+        if (multifd_file_recv_range(p, data->opaque + offset,
+                                    (clear_bit_idx - set_bit_idx) * page_size,
+                                    data->file_offset + offset, errp)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -48,6 +48,8 @@ static void migration_global_dump(Monitor *mon)
                    ms->send_section_footer ? "on" : "off");
     monitor_printf(mon, "clear-bitmap-shift: %u\n",
                    ms->clear_bitmap_shift);
+    monitor_printf(mon, "dirty-sync-chunk-shift: %u\n",
+                   ms->dirty_sync_chunk_shift);
 }
 
 void hmp_info_migrate(Monitor *mon, const QDict *qdict)
@@ -24,6 +24,11 @@ bool migration_rate_exceeded(QEMUFile *f)
         return true;
     }
 
+    return migration_rate_used_up();
+}
+
+bool migration_rate_used_up(void)
+{
     uint64_t rate_limit_max = migration_rate_get();
     if (rate_limit_max == RATE_LIMIT_DISABLED) {
         return false;
@@ -112,6 +112,15 @@ extern MigrationAtomicStats mig_stats;
  */
 uint64_t migration_rate_get(void);
 
+/**
+ * migration_rate_used_up: Check whether the rate limit has been reached.
+ *
+ * Returns true if more than the maximum amount has been transferred in
+ * the current cycle.  Unlike migration_rate_exceeded(), it doesn't look
+ * at the migration stream, so it can be called from any thread.
+ */
+bool migration_rate_used_up(void);
+
 /**
  * migration_rate_reset: Reset the rate limit counter.
  *
@@ -75,6 +75,7 @@
 static NotifierWithReturnList migration_state_notifiers[] = {
     NOTIFIER_ELEM_INIT(migration_state_notifiers, MIG_MODE_NORMAL),
     NOTIFIER_ELEM_INIT(migration_state_notifiers, MIG_MODE_CPR_REBOOT),
+    NOTIFIER_ELEM_INIT(migration_state_notifiers, MIG_MODE_CPR_TRANSFER),
 };
 
 /* Messages sent on the return path from destination to source */
@@ -180,6 +181,24 @@ static bool transport_supports_extra_fds(MigrationAddress *addr)
     return addr->transport == MIGRATION_ADDRESS_TYPE_FILE;
 }
 
+static bool migration_needs_fd_passing(void)
+{
+    return migrate_mode() == MIG_MODE_CPR_TRANSFER;
+}
+
+static bool transport_supports_fd_passing(MigrationAddress *addr)
+{
+    if (addr->transport == MIGRATION_ADDRESS_TYPE_SOCKET) {
+        SocketAddress *saddr = &addr->u.socket;
+
+        /* fd: is accepted here, the channel feature is checked later */
+        return (saddr->type == SOCKET_ADDRESS_TYPE_UNIX ||
+                saddr->type == SOCKET_ADDRESS_TYPE_FD);
+    }
+
+    return false;
+}
+
 static bool
 migration_channels_and_transport_compatible(MigrationAddress *addr,
                                             Error **errp)
@@ -203,6 +222,13 @@ migration_channels_and_transport_compatible(MigrationAddress *addr,
         return false;
     }
 
+    if (migration_needs_fd_passing() &&
+        !transport_supports_fd_passing(addr)) {
+        error_setg(errp,
+                   "Migration requires a transport that can pass fds (e.g. unix)");
+        return false;
+    }
+
     return true;
 }
 
@@ -448,17 +474,17 @@ static int migrate_send_rp_message(MigrationIncomingState *mis,
     return qemu_fflush(mis->to_src_file);
 }
 
-/* Request one page from the source VM at the given start address.
- *   rb: the RAMBlock to request the page in
+/* Request pages from the source VM at the given start address.
+ *   rb: the RAMBlock to request the pages in
  *   Start: Address offset within the RB
  *   Len: Length in bytes required - must be a multiple of pagesize
  */
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
-                                      RAMBlock *rb, ram_addr_t start)
+                                      RAMBlock *rb, ram_addr_t start,
+                                      size_t len)
 {
     uint8_t bufc[12 + 1 + 255]; /* start (8), len (4), rbname up to 256 */
     size_t msglen = 12; /* start + len */
-    size_t len = qemu_ram_pagesize(rb);
     enum mig_rp_message_type msg_type;
     const char *rbname;
     int rbname_len;
@@ -490,8 +516,14 @@ int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
     return migrate_send_rp_message(mis, msg_type, msglen, bufc);
 }
 
+/*
+ * Request the page at @start, that the guest faulted on at @haddr, and
+ * the rest of the @len bytes from there.  Only the faulting page is
+ * tracked as requested, the rest is a prefetch.
+ */
 int migrate_send_rp_req_pages(MigrationIncomingState *mis,
-                              RAMBlock *rb, ram_addr_t start, uint64_t haddr)
+                              RAMBlock *rb, ram_addr_t start, size_t len,
+                              uint64_t haddr)
 {
     void *aligned = (void *)(uintptr_t)ROUND_DOWN(haddr, qemu_ram_pagesize(rb));
     bool received = false;
@@ -518,7 +550,7 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis,
         return 0;
     }
 
-    return migrate_send_rp_message_req_pages(mis, rb, start);
+    return migrate_send_rp_message_req_pages(mis, rb, start, len);
 }
 
 static bool migration_colo_enabled;
@@ -1802,7 +1834,8 @@ int migrate_add_blocker(Error **reasonp, Error **errp)
 
 int migrate_add_blocker_normal(Error **reasonp, Error **errp)
 {
-    return migrate_add_blocker_modes(reasonp, errp, MIG_MODE_NORMAL, -1);
+    return migrate_add_blocker_modes(reasonp, errp, MIG_MODE_NORMAL,
+                                     MIG_MODE_CPR_TRANSFER, -1);
 }
 
 int migrate_add_blocker_modes(Error **reasonp, Error **errp, MigMode mode, ...)
@@ -2042,7 +2075,7 @@ static bool migrate_prepare(MigrationState *s, bool resume, Error **errp)
         }
     }
 
-    if (migrate_mode_is_cpr(s)) {
+    if (migrate_mode_is_cpr(s) || migrate_mode() == MIG_MODE_CPR_TRANSFER) {
         const char *conflict = NULL;
 
         if (migrate_postcopy()) {
@@ -49,6 +49,16 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/*
+ * With multifd, the dirty bitmap is synchronized in chunks of
+ * GUEST_PAGE_SIZE << N.  As for the clear bitmap, the chunks must be at
+ * least 64 pages so that they never share a word of the dirty bitmap;
+ * the default gives 1G chunks when page size is 4K.
+ */
+#define DIRTY_SYNC_CHUNK_SHIFT_MIN         6
+#define DIRTY_SYNC_CHUNK_SHIFT_DEFAULT    18
+#define DIRTY_SYNC_CHUNK_SHIFT_MAX        31
+
 /* This is an abstraction of a "temp huge page" for postcopy's purpose */
 typedef struct {
     /*
@@ -112,6 +122,14 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
+    /*
+     * Pages requested for the last page fault, which are more than the
+     * faulting page while the guest faults sequentially.  Only used by the
+     * fault thread.
+     */
+    RAMBlock *fault_window_rb;
+    ram_addr_t fault_window_start;
+    size_t fault_window_len;
     /*
      * Number of postcopy channels including the default precopy channel, so
      * vanilla postcopy will only contain one channel which contain both
@@ -441,6 +459,12 @@ struct MigrationState {
      * (which is in 4M chunk).
      */
     uint8_t clear_bitmap_shift;
+    /*
+     * Size of the chunks in which the dirty bitmap is synchronized by the
+     * multifd send threads, as GUEST_PAGE_SIZE << N.  Only a test knob:
+     * small chunks let small guests use more than one thread.
+     */
+    uint8_t dirty_sync_chunk_shift;
 
     /*
      * This save hostname when out-going migration starts
@@ -493,9 +517,10 @@ void migrate_send_rp_shut(MigrationIncomingState *mis,
 void migrate_send_rp_pong(MigrationIncomingState *mis,
                           uint32_t value);
 int migrate_send_rp_req_pages(MigrationIncomingState *mis, RAMBlock *rb,
-                              ram_addr_t start, uint64_t haddr);
+                              ram_addr_t start, size_t len, uint64_t haddr);
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
-                                      RAMBlock *rb, ram_addr_t start);
+                                      RAMBlock *rb, ram_addr_t start,
+                                      size_t len);
 void migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
                                  char *block_name);
 void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value);
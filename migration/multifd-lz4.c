@@ -0,0 +1,297 @@
+/*
+ * Multifd lz4 compression implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <lz4.h>
+#include "qemu/bswap.h"
+#include "qemu/rcu.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "options.h"
+#include "multifd.h"
+
+/*
+ * Every normal page is compressed on its own, without a dictionary built
+ * from the previous pages: unlike the zlib and zstd streams, lz4 streams
+ * don't copy their input, so guest writes to a page that was already
+ * compressed could corrupt the pages that refer to it.
+ *
+ * The compressed data of a packet is a sequence of
+ *
+ *   uint32_t len (big endian)
+ *   uint8_t data[len]
+ *
+ * with one entry per normal page.  If the page doesn't compress, it is sent
+ * as is and len is the page size.
+ */
+
+struct lz4_data {
+    /* compression state, LZ4_sizeofState() bytes */
+    void *state;
+    /* compressed buffer */
+    uint8_t *zbuff;
+    /* size of compressed buffer */
+    uint32_t zbuff_len;
+};
+
+/* Multifd lz4 compression */
+
+static uint32_t lz4_buffer_size(uint32_t page_count, uint32_t page_size)
+{
+    return page_count * (sizeof(uint32_t) + LZ4_COMPRESSBOUND(page_size));
+}
+
+/**
+ * lz4_send_setup: setup send side
+ *
+ * Setup each channel with lz4 compression.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    z->state = g_try_malloc(LZ4_sizeofState());
+    /* This is the maximum size of the compressed buffer */
+    z->zbuff_len = lz4_buffer_size(p->page_count, p->page_size);
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->state || !z->zbuff) {
+        g_free(z->state);
+        g_free(z->zbuff);
+        g_free(z);
+        error_setg(errp, "multifd %u: out of memory for lz4 buffers", p->id);
+        return -1;
+    }
+    p->compress_data = z;
+
+    /* Needs 2 IOVs, one for packet header and one for compressed data */
+    p->iov = g_new0(struct iovec, 2);
+    return 0;
+}
+
+/**
+ * lz4_send_cleanup: cleanup send side
+ *
+ * Close the channel and return memory.
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static void lz4_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = p->compress_data;
+
+    g_free(z->state);
+    z->state = NULL;
+    g_free(z->zbuff);
+    z->zbuff = NULL;
+    g_free(p->compress_data);
+    p->compress_data = NULL;
+
+    g_free(p->iov);
+    p->iov = NULL;
+}
+
+/**
+ * lz4_send_prepare: prepare data to be able to send
+ *
+ * Create a compressed buffer with all the pages that we are going to
+ * send.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    struct lz4_data *z = p->compress_data;
+    uint32_t out_pos = 0;
+    uint32_t i;
+
+    if (!multifd_send_prepare_common(p)) {
+        goto out;
+    }
+
+    for (i = 0; i < pages->normal_num; i++) {
+        const char *page = (char *)pages->block->host + pages->offset[i];
+        uint8_t *len_buf = z->zbuff + out_pos;
+        char *dst = (char *)len_buf + sizeof(uint32_t);
+        uint32_t avail = z->zbuff_len - out_pos - sizeof(uint32_t);
+        int len;
+
+        /* Anything that isn't smaller than the page is sent as is */
+        len = LZ4_compress_fast_extState(z->state, page, dst, p->page_size,
+                                         MIN(avail, p->page_size - 1), 1);
+        if (len <= 0) {
+            memcpy(dst, page, p->page_size);
+            len = p->page_size;
+        }
+
+        stl_be_p(len_buf, len);
+        out_pos += sizeof(uint32_t) + len;
+    }
+
+    p->iov[p->iovs_num].iov_base = z->zbuff;
+    p->iov[p->iovs_num].iov_len = out_pos;
+    p->iovs_num++;
+    p->next_packet_size = out_pos;
+
+out:
+    p->flags |= MULTIFD_FLAG_LZ4;
+    multifd_send_fill_packet(p);
+    return 0;
+}
+
+/**
+ * lz4_recv_setup: setup receive side
+ *
+ * Create the compressed buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    z->zbuff_len = lz4_buffer_size(p->page_count, p->page_size);
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        g_free(z);
+        error_setg(errp, "multifd %u: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->compress_data = z;
+    return 0;
+}
+
+/**
+ * lz4_recv_cleanup: cleanup receive side
+ *
+ * Return the memory of the compressed buffer.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void lz4_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct lz4_data *z = p->compress_data;
+
+    g_free(z->zbuff);
+    z->zbuff = NULL;
+    g_free(p->compress_data);
+    p->compress_data = NULL;
+}
+
+/**
+ * lz4_recv: read the data from the channel into actual pages
+ *
+ * Read the compressed buffer, and uncompress it into the actual
+ * pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_recv(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    struct lz4_data *z = p->compress_data;
+    uint32_t in_pos = 0;
+    int ret;
+    int i;
+
+    if (flags != MULTIFD_FLAG_LZ4) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_LZ4);
+        return -1;
+    }
+
+    multifd_recv_zero_page_process(p);
+
+    if (!p->normal_num) {
+        assert(in_size == 0);
+        return 0;
+    }
+
+    if (in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %u: packet size %u exceeds buffer size %u",
+                   p->id, in_size, z->zbuff_len);
+        return -1;
+    }
+
+    ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        char *page = (char *)p->host + p->normal[i];
+        uint32_t len;
+
+        if (in_size - in_pos < sizeof(uint32_t)) {
+            error_setg(errp, "multifd %u: truncated lz4 packet", p->id);
+            return -1;
+        }
+        len = ldl_be_p(z->zbuff + in_pos);
+        in_pos += sizeof(uint32_t);
+        if (len > p->page_size || len > in_size - in_pos) {
+            error_setg(errp, "multifd %u: invalid compressed page size %u",
+                       p->id, len);
+            return -1;
+        }
+
+        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+        if (len == p->page_size) {
+            memcpy(page, z->zbuff + in_pos, len);
+        } else {
+            ret = LZ4_decompress_safe((char *)z->zbuff + in_pos, page, len,
+                                      p->page_size);
+            if (ret != p->page_size) {
+                error_setg(errp, "multifd %u: lz4 decompression failed (%d)",
+                           p->id, ret);
+                return -1;
+            }
+        }
+        in_pos += len;
+    }
+
+    if (in_pos != in_size) {
+        error_setg(errp, "multifd %u: packet size received %u size expected %u",
+                   p->id, in_size, in_pos);
+        return -1;
+    }
+    return 0;
+}
+
+static MultiFDMethods multifd_lz4_ops = {
+    .send_setup = lz4_send_setup,
+    .send_cleanup = lz4_send_cleanup,
+    .send_prepare = lz4_send_prepare,
+    .recv_setup = lz4_recv_setup,
+    .recv_cleanup = lz4_recv_cleanup,
+    .recv = lz4_recv
+};
+
+static void multifd_lz4_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_LZ4, &multifd_lz4_ops);
+}
+
+migration_init(multifd_lz4_register);
@@ -63,6 +63,17 @@ void multifd_send_zero_page_detect(MultiFDSendParams *p)
     while (i <= j) {
         uint64_t offset = pages->offset[i];
 
+        /*
+         * The next page to check is the next one if this one is normal, or
+         * the last one otherwise, as it is swapped in.  The pages are
+         * scattered in RAM, so get the start of both on their way while
+         * this one is checked.
+         */
+        if (i < j) {
+            __builtin_prefetch(rb->host + pages->offset[i + 1]);
+            __builtin_prefetch(rb->host + pages->offset[j]);
+        }
+
         if (!buffer_is_zero(rb->host + offset, p->page_size)) {
             i++;
             continue;
@@ -79,6 +79,26 @@ struct {
     int exiting;
     /* multifd ops */
     MultiFDMethods *ops;
+    /* Work shared with the send threads, see multifd_send_run_helpers() */
+    struct {
+        void (*fn)(void *opaque);
+        void *opaque;
+        /* Number of threads that may still be running fn */
+        int active;
+        /* Posted by the last send thread that finished running fn */
+        QemuSemaphore done;
+    } helper;
+    /* Page search done by the send threads, see multifd_send_channels_scan() */
+    struct {
+        MultiFDSendScanFn fn;
+        void *opaque;
+        /* Number of threads that may still be running fn */
+        int active;
+        /* Set if a channel failed or quit without running fn */
+        bool failed;
+        /* Posted whenever a send thread finished running fn, or failed */
+        QemuSemaphore done;
+    } scan;
 } *multifd_send_state;
 
 struct {
@@ -91,6 +111,12 @@ struct {
      * uses it to wait for recv threads to finish assigned tasks.
      */
     QemuSemaphore sem_sync;
+    /*
+     * Without packets, this is posted by the recv threads whenever they
+     * are done with a job, so that the migration thread can wait for a
+     * free channel instead of polling them.
+     */
+    QemuSemaphore channels_ready;
     /* global number of generated multifd packets */
     uint64_t packet_num;
     int exiting;
@@ -565,6 +591,7 @@ static void multifd_send_kick_main(MultiFDSendParams *p)
 {
     qemu_sem_post(&p->sem_sync);
     qemu_sem_post(&multifd_send_state->channels_ready);
+    qemu_sem_post(&multifd_send_state->scan.done);
 }
 
 /*
@@ -689,6 +716,35 @@ retry:
     return true;
 }
 
+static int multifd_send_packet(MultiFDSendParams *p, Error **errp);
+
+/*
+ * Like multifd_queue_page(), but for the pages that the send thread of @p
+ * found itself: they go to the channel's own queue, and a full queue is
+ * sent right away by the calling thread.
+ *
+ * Returns 0 on success, -1 on error.  Must be called from the send thread
+ * of @p, from multifd_send_channels_scan().
+ */
+int multifd_send_channel_queue_page(MultiFDSendParams *p, RAMBlock *block,
+                                    ram_addr_t offset, Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+
+    if (!multifd_queue_empty(pages) &&
+        (pages->block != block || multifd_queue_full(pages))) {
+        if (multifd_send_packet(p, errp) != 0) {
+            return -1;
+        }
+    }
+
+    if (multifd_queue_empty(pages)) {
+        pages->block = block;
+    }
+    multifd_enqueue(pages, offset);
+    return 0;
+}
+
 /* Multifd send side hit an error; remember it and prepare to quit */
 static void multifd_send_set_error(Error *err)
 {
@@ -806,6 +862,8 @@ static void multifd_send_cleanup_state(void)
     socket_cleanup_outgoing_migration();
     qemu_sem_destroy(&multifd_send_state->channels_created);
     qemu_sem_destroy(&multifd_send_state->channels_ready);
+    qemu_sem_destroy(&multifd_send_state->helper.done);
+    qemu_sem_destroy(&multifd_send_state->scan.done);
     g_free(multifd_send_state->params);
     multifd_send_state->params = NULL;
     multifd_pages_clear(multifd_send_state->pages);
@@ -908,6 +966,193 @@ int multifd_send_sync_main(void)
     return 0;
 }
 
+/*
+ * Run @fn(@opaque) in the migration thread and in all the multifd send
+ * threads that are idle, or become idle, before the migration thread is
+ * done with it.  @fn has to split its work dynamically between the threads
+ * that run it: it is not called at all by the channels that are busy
+ * sending pages for the whole time.  Returns when no thread is running @fn
+ * anymore.
+ *
+ * Returns false if there are no multifd send threads; @fn has not been
+ * called in that case.
+ */
+bool multifd_send_run_helpers(void (*fn)(void *opaque), void *opaque)
+{
+    int i, thread_count;
+
+    if (!migrate_multifd() || !multifd_send_state ||
+        multifd_send_should_exit()) {
+        return false;
+    }
+
+    thread_count = migrate_multifd_channels();
+    multifd_send_state->helper.fn = fn;
+    multifd_send_state->helper.opaque = opaque;
+    /* One reference for each channel, and one for us */
+    qatomic_set(&multifd_send_state->helper.active, thread_count + 1);
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        assert(!qatomic_read(&p->pending_helper));
+        qatomic_store_release(&p->pending_helper, true);
+        qemu_sem_post(&p->sem);
+    }
+
+    fn(opaque);
+
+    /*
+     * Drop the request for the channels that didn't pick it up yet, so
+     * that we don't have to wait for them to finish sending.  The others
+     * will be done soon, there is nothing left for them to do.
+     */
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        if (qatomic_xchg(&p->pending_helper, false)) {
+            qatomic_dec(&multifd_send_state->helper.active);
+        }
+    }
+
+    if (qatomic_fetch_dec(&multifd_send_state->helper.active) != 1) {
+        qemu_sem_wait(&multifd_send_state->helper.done);
+    }
+
+    return true;
+}
+
+static void multifd_send_run_helper(void)
+{
+    multifd_send_state->helper.fn(multifd_send_state->helper.opaque);
+
+    if (qatomic_fetch_dec(&multifd_send_state->helper.active) == 1) {
+        qemu_sem_post(&multifd_send_state->helper.done);
+    }
+}
+
+/*
+ * Run @fn(p, @opaque) in the send thread of every channel.  @fn finds the
+ * pages to send on its own and passes them to
+ * multifd_send_channel_queue_page(); whatever is left in the channel's
+ * queue is sent once @fn returns.  Unlike multifd_send_pages(), the
+ * migration thread isn't involved in handing out the pages, it only waits
+ * until all channels are done.
+ *
+ * Returns 0 on success, -1 if any channel failed.
+ */
+int multifd_send_channels_scan(MultiFDSendScanFn fn, void *opaque)
+{
+    int i, thread_count = migrate_multifd_channels();
+
+    if (multifd_send_should_exit()) {
+        return -1;
+    }
+
+    /* Pages queued by the migration thread go first */
+    if (multifd_send_state->pages->num && !multifd_send_pages()) {
+        return -1;
+    }
+
+    multifd_send_state->scan.fn = fn;
+    multifd_send_state->scan.opaque = opaque;
+    qatomic_set(&multifd_send_state->scan.failed, false);
+    qatomic_set(&multifd_send_state->scan.active, thread_count);
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        assert(!qatomic_read(&p->pending_scan));
+        qatomic_store_release(&p->pending_scan, true);
+        qemu_sem_post(&p->sem);
+    }
+
+    while (qatomic_load_acquire(&multifd_send_state->scan.active)) {
+        qemu_sem_wait(&multifd_send_state->scan.done);
+
+        if (multifd_send_should_exit()) {
+            /*
+             * Channels that have quit won't pick up the request anymore.
+             * The ones that already did will notice the error and return
+             * soon; they may still use @opaque until then, so wait for
+             * them.
+             */
+            for (i = 0; i < thread_count; i++) {
+                MultiFDSendParams *p = &multifd_send_state->params[i];
+
+                if (qatomic_xchg(&p->pending_scan, false)) {
+                    qatomic_dec(&multifd_send_state->scan.active);
+                }
+            }
+        }
+    }
+
+    if (qatomic_read(&multifd_send_state->scan.failed) ||
+        multifd_send_should_exit()) {
+        return -1;
+    }
+    return 0;
+}
+
+static int multifd_send_run_scan(MultiFDSendParams *p, Error **errp)
+{
+    int ret;
+
+    ret = multifd_send_state->scan.fn(p, multifd_send_state->scan.opaque,
+                                      errp);
+    if (ret == 0 && !multifd_queue_empty(p->pages)) {
+        ret = multifd_send_packet(p, errp);
+    }
+    if (ret != 0) {
+        /* The migration thread must see the error once we're done */
+        qatomic_set(&multifd_send_state->scan.failed, true);
+        multifd_send_set_error(*errp);
+    }
+
+    qatomic_dec(&multifd_send_state->scan.active);
+    qemu_sem_post(&multifd_send_state->scan.done);
+    return ret;
+}
+
+/*
+ * Send the pages of p->pages through the channel.  Called by the send
+ * thread of @p.
+ */
+static int multifd_send_packet(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    int ret;
+
+    p->iovs_num = 0;
+    assert(pages->num);
+
+    ret = multifd_send_state->ops->send_prepare(p, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (migrate_mapped_ram()) {
+        ret = file_write_ramblock_iov(p->c, p->iov, p->iovs_num,
+                                      pages->block, errp);
+    } else {
+        ret = qio_channel_writev_full_all(p->c, p->iov, p->iovs_num,
+                                          NULL, 0, p->write_flags, errp);
+    }
+
+    if (ret != 0) {
+        return ret;
+    }
+
+    stat64_add(&mig_stats.multifd_bytes,
+               p->next_packet_size + p->packet_len);
+    stat64_add(&mig_stats.normal_pages, pages->normal_num);
+    stat64_add(&mig_stats.zero_pages, pages->num - pages->normal_num);
+
+    multifd_pages_reset(pages);
+    p->next_packet_size = 0;
+    return 0;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -915,6 +1160,7 @@ static void *multifd_send_thread(void *opaque)
     Error *local_err = NULL;
     int ret = 0;
     bool use_packets = multifd_use_packets();
+    bool ready = true;
 
     thread = migration_threads_add(p->name, qemu_get_thread_id());
 
@@ -929,63 +1175,37 @@ static void *multifd_send_thread(void *opaque)
     }
 
     while (true) {
-        qemu_sem_post(&multifd_send_state->channels_ready);
+        if (ready) {
+            qemu_sem_post(&multifd_send_state->channels_ready);
+        }
         qemu_sem_wait(&p->sem);
 
         if (multifd_send_should_exit()) {
             break;
         }
+        ready = true;
 
         /*
          * Read pending_job flag before p->pages.  Pairs with the
          * qatomic_store_release() in multifd_send_pages().
          */
         if (qatomic_load_acquire(&p->pending_job)) {
-            MultiFDPages_t *pages = p->pages;
-
-            p->iovs_num = 0;
-            assert(pages->num);
-
-            ret = multifd_send_state->ops->send_prepare(p, &local_err);
-            if (ret != 0) {
-                break;
-            }
-
-            if (migrate_mapped_ram()) {
-                ret = file_write_ramblock_iov(p->c, p->iov, p->iovs_num,
-                                              p->pages->block, &local_err);
-            } else {
-                ret = qio_channel_writev_full_all(p->c, p->iov, p->iovs_num,
-                                                  NULL, 0, p->write_flags,
-                                                  &local_err);
-            }
-
+            ret = multifd_send_packet(p, &local_err);
             if (ret != 0) {
                 break;
             }
 
-            stat64_add(&mig_stats.multifd_bytes,
-                       p->next_packet_size + p->packet_len);
-            stat64_add(&mig_stats.normal_pages, pages->normal_num);
-            stat64_add(&mig_stats.zero_pages, pages->num - pages->normal_num);
-
-            multifd_pages_reset(p->pages);
-            p->next_packet_size = 0;
-
             /*
              * Making sure p->pages is published before saying "we're
              * free".  Pairs with the smp_mb_acquire() in
              * multifd_send_pages().
              */
             qatomic_store_release(&p->pending_job, false);
-        } else {
+        } else if (qatomic_read(&p->pending_sync)) {
             /*
-             * If not a normal job, must be a sync request.  Note that
-             * pending_sync is a standalone flag (unlike pending_job), so
-             * it doesn't require explicit memory barriers.
+             * Note that pending_sync is a standalone flag (unlike
+             * pending_job), so it doesn't require explicit memory barriers.
              */
-            assert(qatomic_read(&p->pending_sync));
-
             if (use_packets) {
                 p->flags = MULTIFD_FLAG_SYNC;
                 multifd_send_fill_packet(p);
@@ -1001,6 +1221,24 @@ static void *multifd_send_thread(void *opaque)
 
             qatomic_set(&p->pending_sync, false);
             qemu_sem_post(&p->sem_sync);
+        } else if (qatomic_xchg(&p->pending_scan, false)) {
+            /* Like helper requests, scans don't take channels_ready tokens */
+            ready = false;
+            ret = multifd_send_run_scan(p, &local_err);
+            if (ret != 0) {
+                break;
+            }
+        } else {
+            /*
+             * Otherwise, this is a helper request, unless the migration
+             * thread has withdrawn it already.  The migration thread
+             * didn't take a channels_ready token for it, so don't post a
+             * new one.
+             */
+            if (qatomic_xchg(&p->pending_helper, false)) {
+                multifd_send_run_helper();
+            }
+            ready = false;
         }
     }
 
@@ -1013,6 +1251,17 @@ out:
         error_free(local_err);
     }
 
+    /*
+     * Don't leave the migration thread waiting for a scan we won't run.  The
+     * error must be set first, or multifd_send_channels_scan() could see the
+     * scan finish without noticing that it failed.
+     */
+    if (qatomic_xchg(&p->pending_scan, false)) {
+        qatomic_set(&multifd_send_state->scan.failed, true);
+        qatomic_dec(&multifd_send_state->scan.active);
+        qemu_sem_post(&multifd_send_state->scan.done);
+    }
+
     rcu_unregister_thread();
     migration_threads_remove(thread);
     trace_multifd_send_thread_end(p->id, p->packets_sent, p->total_normal_pages,
@@ -1172,6 +1421,8 @@ bool multifd_send_setup(void)
     multifd_send_state->pages = multifd_pages_init(page_count);
     qemu_sem_init(&multifd_send_state->channels_created, 0);
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    qemu_sem_init(&multifd_send_state->helper.done, 0);
+    qemu_sem_init(&multifd_send_state->scan.done, 0);
     qatomic_set(&multifd_send_state->exiting, 0);
     multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
 
@@ -1242,6 +1493,9 @@ bool multifd_recv(void)
      * limit is lower now.
      */
     next_recv_channel %= migrate_multifd_channels();
+
+    /* Sleep until a channel finished its job, there's one free after that */
+    qemu_sem_wait(&multifd_recv_state->channels_ready);
     for (i = next_recv_channel;; i = (i + 1) % migrate_multifd_channels()) {
         if (multifd_recv_should_exit()) {
             return false;
@@ -1336,6 +1590,9 @@ static void multifd_recv_terminate_threads(Error *err)
             qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
         }
     }
+
+    /* Wake up the migration thread if it is waiting for a channel */
+    qemu_sem_post(&multifd_recv_state->channels_ready);
 }
 
 void multifd_recv_shutdown(void)
@@ -1368,6 +1625,7 @@ static void multifd_recv_cleanup_channel(MultiFDRecvParams *p)
 static void multifd_recv_cleanup_state(void)
 {
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    qemu_sem_destroy(&multifd_recv_state->channels_ready);
     g_free(multifd_recv_state->params);
     multifd_recv_state->params = NULL;
     g_free(multifd_recv_state->data);
@@ -1544,6 +1802,7 @@ static void *multifd_recv_thread(void *opaque)
              * multifd_recv().
              */
             qatomic_store_release(&p->pending_job, false);
+            qemu_sem_post(&multifd_recv_state->channels_ready);
         }
     }
 
@@ -1585,6 +1844,7 @@ int multifd_recv_setup(Error **errp)
     qatomic_set(&multifd_recv_state->count, 0);
     qatomic_set(&multifd_recv_state->exiting, 0);
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    qemu_sem_init(&multifd_recv_state->channels_ready, thread_count);
     multifd_recv_state->ops = multifd_ops[migrate_multifd_compression()];
 
     for (i = 0; i < thread_count; i++) {
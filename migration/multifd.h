@@ -27,6 +27,7 @@ bool multifd_recv_all_channels_created(void);
 void multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
 void multifd_recv_sync_main(void);
 int multifd_send_sync_main(void);
+bool multifd_send_run_helpers(void (*fn)(void *opaque), void *opaque);
 bool multifd_queue_page(RAMBlock *block, ram_addr_t offset);
 bool multifd_recv(void);
 MultiFDRecvData *multifd_get_recv_data(void);
@@ -42,6 +43,7 @@ MultiFDRecvData *multifd_get_recv_data(void);
 #define MULTIFD_FLAG_ZSTD (2 << 1)
 #define MULTIFD_FLAG_QPL (4 << 1)
 #define MULTIFD_FLAG_UADK (8 << 1)
+#define MULTIFD_FLAG_LZ4 (3 << 1)
 
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
@@ -87,6 +89,12 @@ struct MultiFDRecvData {
     size_t size;
     /* for preadv */
     off_t file_offset;
+    /*
+     * If set, only the target pages of the range whose bit is set are
+     * read.  Bit @bitmap_start describes the first page of the range.
+     */
+    const unsigned long *bitmap;
+    unsigned long bitmap_start;
 };
 
 typedef struct {
@@ -123,14 +131,22 @@ typedef struct {
     /*
      * The sender thread has work to do if either of below boolean is set.
      *
-     * @pending_job:  a job is pending
-     * @pending_sync: a sync request is pending
+     * @pending_job:    a job is pending
+     * @pending_sync:   a sync request is pending
+     * @pending_helper: a request to help the migration thread is pending,
+     *                  see multifd_send_run_helpers()
+     * @pending_scan:   a request to look for dirty pages is pending, see
+     *                  multifd_send_channels_scan()
      *
-     * For both of these fields, they're only set by the requesters, and
-     * cleared by the multifd sender threads.
+     * For the first two fields, they're only set by the requesters, and
+     * cleared by the multifd sender threads.  @pending_helper and
+     * @pending_scan may also be cleared by the requester, if it doesn't
+     * need the sender threads anymore.
      */
     bool pending_job;
     bool pending_sync;
+    bool pending_helper;
+    bool pending_scan;
     /* array of pages to sent.
      * The owner of 'pages' depends of 'pending_job' value:
      * pending_job == 0 -> migration_thread can use it.
@@ -245,6 +261,12 @@ bool multifd_send_prepare_common(MultiFDSendParams *p);
 void multifd_send_zero_page_detect(MultiFDSendParams *p);
 void multifd_recv_zero_page_process(MultiFDRecvParams *p);
 
+typedef int (*MultiFDSendScanFn)(MultiFDSendParams *p, void *opaque,
+                                 Error **errp);
+int multifd_send_channels_scan(MultiFDSendScanFn fn, void *opaque);
+int multifd_send_channel_queue_page(MultiFDSendParams *p, RAMBlock *block,
+                                    ram_addr_t offset, Error **errp);
+
 static inline void multifd_send_prepare_header(MultiFDSendParams *p)
 {
     p->iov[0].iov_len = p->packet_len;
@@ -89,6 +89,8 @@ Property migration_properties[] = {
                       multifd_flush_after_each_section, false),
     DEFINE_PROP_UINT8("x-clear-bitmap-shift", MigrationState,
                       clear_bitmap_shift, CLEAR_BITMAP_SHIFT_DEFAULT),
+    DEFINE_PROP_UINT8("x-dirty-sync-chunk-shift", MigrationState,
+                      dirty_sync_chunk_shift, DIRTY_SYNC_CHUNK_SHIFT_DEFAULT),
     DEFINE_PROP_BOOL("x-preempt-pre-7-2", MigrationState,
                      preempt_pre_7_2, false),
 
@@ -186,6 +188,12 @@ Property migration_properties[] = {
                         MIGRATION_CAPABILITY_SWITCHOVER_ACK),
     DEFINE_PROP_MIG_CAP("x-dirty-limit", MIGRATION_CAPABILITY_DIRTY_LIMIT),
     DEFINE_PROP_MIG_CAP("mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("multifd-page-ownership",
+                        MIGRATION_CAPABILITY_MULTIFD_PAGE_OWNERSHIP),
+    DEFINE_PROP_MIG_CAP("mapped-ram-incremental",
+                        MIGRATION_CAPABILITY_MAPPED_RAM_INCREMENTAL),
+    DEFINE_PROP_MIG_CAP("defer-hot-pages",
+                        MIGRATION_CAPABILITY_DEFER_HOT_PAGES),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -210,6 +218,13 @@ bool migrate_colo(void)
     return s->capabilities[MIGRATION_CAPABILITY_X_COLO];
 }
 
+bool migrate_defer_hot_pages(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_DEFER_HOT_PAGES];
+}
+
 bool migrate_dirty_bitmaps(void)
 {
     MigrationState *s = migrate_get_current();
@@ -238,6 +253,13 @@ bool migrate_mapped_ram(void)
     return s->capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
 }
 
+bool migrate_mapped_ram_incremental(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_MAPPED_RAM_INCREMENTAL];
+}
+
 bool migrate_ignore_shared(void)
 {
     MigrationState *s = migrate_get_current();
@@ -259,6 +281,13 @@ bool migrate_multifd(void)
     return s->capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_multifd_page_ownership(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_MULTIFD_PAGE_OWNERSHIP];
+}
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s = migrate_get_current();
@@ -426,7 +455,8 @@ INITIALIZE_MIGRATE_CAPS_SET(check_caps_background_snapshot,
     MIGRATION_CAPABILITY_XBZRLE,
     MIGRATION_CAPABILITY_X_COLO,
     MIGRATION_CAPABILITY_VALIDATE_UUID,
-    MIGRATION_CAPABILITY_ZERO_COPY_SEND);
+    MIGRATION_CAPABILITY_ZERO_COPY_SEND,
+    MIGRATION_CAPABILITY_DEFER_HOT_PAGES);
 
 static bool migrate_incoming_started(void)
 {
@@ -578,6 +608,13 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
         }
     }
 
+    if (new_caps[MIGRATION_CAPABILITY_MULTIFD_PAGE_OWNERSHIP] &&
+        !new_caps[MIGRATION_CAPABILITY_MULTIFD]) {
+        error_setg(errp, "Capability 'multifd-page-ownership' requires "
+                   "capability 'multifd'");
+        return false;
+    }
+
     if (new_caps[MIGRATION_CAPABILITY_MAPPED_RAM]) {
         if (new_caps[MIGRATION_CAPABILITY_XBZRLE]) {
             error_setg(errp,
@@ -592,6 +629,20 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
         }
     }
 
+    if (new_caps[MIGRATION_CAPABILITY_MAPPED_RAM_INCREMENTAL]) {
+        if (!new_caps[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+            error_setg(errp, "Capability 'mapped-ram-incremental' requires "
+                       "capability 'mapped-ram'");
+            return false;
+        }
+
+        if (new_caps[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
+            error_setg(errp, "Incremental mapped-ram migration is "
+                       "incompatible with background snapshot");
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -656,6 +707,11 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     for (cap = params; cap; cap = cap->next) {
         s->capabilities[cap->value->capability] = cap->value->state;
     }
+
+    /* Stop tracking dirty pages for a checkpoint that won't be used */
+    if (!migrate_mapped_ram_incremental()) {
+        ram_discard_checkpoint();
+    }
 }
 
 /* parameters */
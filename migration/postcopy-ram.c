@@ -18,6 +18,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/madvise.h"
+#include "qemu/units.h"
 #include "exec/target_page.h"
 #include "migration.h"
 #include "qemu-file.h"
@@ -760,6 +761,50 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd,
     return ret;
 }
 
+/*
+ * When the guest faults on the page right after the ones requested for its
+ * previous fault, it is likely to go on sequentially: request twice as many
+ * pages each time, up to POSTCOPY_FAULT_WINDOW_MAX bytes.  Any other fault
+ * starts over with a single page.
+ */
+#define POSTCOPY_FAULT_WINDOW_MAX (512 * KiB)
+
+static size_t postcopy_fault_window(MigrationIncomingState *mis,
+                                    RAMBlock *rb, ram_addr_t start)
+{
+    size_t page_size = qemu_ram_pagesize(rb);
+    size_t len = page_size;
+    ram_addr_t end;
+
+    if (rb == mis->fault_window_rb && start > mis->fault_window_start) {
+        if (start < mis->fault_window_start + mis->fault_window_len) {
+            /* Requested already, the guest got there before the page */
+            return page_size;
+        }
+        if (start == mis->fault_window_start + mis->fault_window_len) {
+            len = MAX(MIN(mis->fault_window_len * 2,
+                          POSTCOPY_FAULT_WINDOW_MAX), page_size);
+        }
+    }
+
+    /* Stop at the end of the RAMBlock or at the first page already here */
+    len = MIN(len, rb->postcopy_length - start);
+    for (end = start + page_size; end < start + len; end += page_size) {
+        if (ramblock_recv_bitmap_test_byte_offset(rb, end)) {
+            break;
+        }
+    }
+    len = end - start;
+    if (len > page_size) {
+        trace_postcopy_fault_window(qemu_ram_get_idstr(rb), start, len);
+    }
+
+    mis->fault_window_rb = rb;
+    mis->fault_window_start = start;
+    mis->fault_window_len = len;
+    return len;
+}
+
 static int postcopy_request_page(MigrationIncomingState *mis, RAMBlock *rb,
                                  ram_addr_t start, uint64_t haddr)
 {
@@ -780,7 +825,9 @@ static int postcopy_request_page(MigrationIncomingState *mis, RAMBlock *rb,
         return received ? 0 : postcopy_place_page_zero(mis, aligned, rb);
     }
 
-    return migrate_send_rp_req_pages(mis, rb, start, haddr);
+    return migrate_send_rp_req_pages(mis, rb, start,
+                                     postcopy_fault_window(mis, rb, start),
+                                     haddr);
 }
 
 /*
@@ -972,6 +1019,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
     trace_postcopy_ram_fault_thread_entry();
     rcu_register_thread();
     mis->last_rb = NULL; /* last RAMBlock we sent part of */
+    mis->fault_window_rb = NULL;
     qemu_sem_post(&mis->thread_sync_sem);
 
     struct pollfd *pfd;
@@ -37,9 +37,18 @@
 #define IO_BUF_SIZE 32768
 #define MAX_IOV_SIZE MIN_CONST(IOV_MAX, 64)
 
+typedef struct FdEntry {
+    QTAILQ_ENTRY(FdEntry) entry;
+    int fd;
+} FdEntry;
+
 struct QEMUFile {
     QIOChannel *ioc;
     bool is_writable;
+    /* The channel can transfer file descriptors (SCM_RIGHTS) */
+    bool can_pass_fd;
+    /* File descriptors received along with the data in buf */
+    QTAILQ_HEAD(, FdEntry) fds;
 
     int buf_index;
     int buf_size; /* 0 when writing */
@@ -51,6 +60,10 @@ struct QEMUFile {
 
     int last_error;
     Error *last_error_obj;
+
+    /* The data is staged, and only accounted once it is really sent */
+    bool is_staging;
+    uint64_t staged;
 };
 
 /*
@@ -109,6 +122,8 @@ static QEMUFile *qemu_file_new_impl(QIOChannel *ioc, bool is_writable)
     object_ref(ioc);
     f->ioc = ioc;
     f->is_writable = is_writable;
+    f->can_pass_fd = qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_FD_PASS);
+    QTAILQ_INIT(&f->fds);
 
     return f;
 }
@@ -132,6 +147,28 @@ QEMUFile *qemu_file_new_input(QIOChannel *ioc)
     return qemu_file_new_impl(ioc, false);
 }
 
+/*
+ * Result: QEMUFile* for data that is copied to the migration stream later.
+ *         The bytes written to it don't count as transferred, and
+ *         qemu_file_transferred() only reports the bytes written to it.
+ */
+QEMUFile *qemu_file_new_staging(QIOChannel *ioc)
+{
+    QEMUFile *f = qemu_file_new_impl(ioc, true);
+
+    f->is_staging = true;
+    return f;
+}
+
+static void qemu_file_account(QEMUFile *f, uint64_t size)
+{
+    if (f->is_staging) {
+        f->staged += size;
+    } else {
+        stat64_add(&mig_stats.qemu_file_transferred, size);
+    }
+}
+
 /*
  * Get last error for stream f with optional Error*
  *
@@ -285,8 +322,7 @@ int qemu_fflush(QEMUFile *f)
                                    &local_error) < 0) {
             qemu_file_set_error_obj(f, -EIO, local_error);
         } else {
-            uint64_t size = iov_size(f->iov, f->iovcnt);
-            stat64_add(&mig_stats.qemu_file_transferred, size);
+            qemu_file_account(f, iov_size(f->iov, f->iovcnt));
         }
 
         qemu_iovec_release_ram(f);
@@ -310,6 +346,9 @@ static ssize_t coroutine_mixed_fn qemu_fill_buffer(QEMUFile *f)
     int len;
     int pending;
     Error *local_error = NULL;
+    g_autofree int *fds = NULL;
+    size_t nfds = 0;
+    struct iovec iov;
 
     assert(!qemu_file_is_writable(f));
 
@@ -325,10 +364,12 @@ static ssize_t coroutine_mixed_fn qemu_fill_buffer(QEMUFile *f)
     }
 
     do {
-        len = qio_channel_read(f->ioc,
-                               (char *)f->buf + pending,
-                               IO_BUF_SIZE - pending,
-                               &local_error);
+        iov.iov_base = f->buf + pending;
+        iov.iov_len = IO_BUF_SIZE - pending;
+        len = qio_channel_readv_full(f->ioc, &iov, 1,
+                                     f->can_pass_fd ? &fds : NULL,
+                                     f->can_pass_fd ? &nfds : NULL,
+                                     0, &local_error);
         if (len == QIO_CHANNEL_ERR_BLOCK) {
             if (qemu_in_coroutine()) {
                 qio_channel_yield(f->ioc, G_IO_IN);
@@ -340,6 +381,13 @@ static ssize_t coroutine_mixed_fn qemu_fill_buffer(QEMUFile *f)
         }
     } while (len == QIO_CHANNEL_ERR_BLOCK);
 
+    for (size_t i = 0; i < nfds; i++) {
+        FdEntry *fde = g_new0(FdEntry, 1);
+
+        fde->fd = fds[i];
+        QTAILQ_INSERT_TAIL(&f->fds, fde, entry);
+    }
+
     if (len > 0) {
         f->buf_size += len;
     } else if (len == 0) {
@@ -361,11 +409,18 @@ static ssize_t coroutine_mixed_fn qemu_fill_buffer(QEMUFile *f)
  */
 int qemu_fclose(QEMUFile *f)
 {
+    FdEntry *fde, *next;
     int ret = qemu_fflush(f);
     int ret2 = qio_channel_close(f->ioc, NULL);
     if (ret >= 0) {
         ret = ret2;
     }
+    QTAILQ_FOREACH_SAFE(fde, &f->fds, entry, next) {
+        warn_report("qemu_fclose: received fd %d was never consumed", fde->fd);
+        close(fde->fd);
+        QTAILQ_REMOVE(&f->fds, fde, entry);
+        g_free(fde);
+    }
     g_clear_pointer(&f->ioc, object_unref);
     error_free(f->last_error_obj);
     g_free(f);
@@ -484,7 +539,7 @@ void qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t buflen,
         return;
     }
 
-    stat64_add(&mig_stats.qemu_file_transferred, buflen);
+    qemu_file_account(f, buflen);
 
     return;
 }
@@ -719,11 +774,17 @@ int coroutine_mixed_fn qemu_get_byte(QEMUFile *f)
 
 uint64_t qemu_file_transferred(QEMUFile *f)
 {
-    uint64_t ret = stat64_get(&mig_stats.qemu_file_transferred);
+    uint64_t ret;
     int i;
 
     g_assert(qemu_file_is_writable(f));
 
+    if (f->is_staging) {
+        ret = f->staged;
+    } else {
+        ret = stat64_get(&mig_stats.qemu_file_transferred);
+    }
+
     for (i = 0; i < f->iovcnt; i++) {
         ret += f->iov[i].iov_len;
     }
@@ -831,6 +892,71 @@ QIOChannel *qemu_file_get_ioc(QEMUFile *file)
     return file->ioc;
 }
 
+/*
+ * Send a file descriptor to the peer.  The descriptor travels as ancillary
+ * data of a single placeholder byte, so that the receiver can tell where in
+ * the stream it belongs.
+ *
+ * Returns 0 on success, or a negative error value.
+ */
+int qemu_file_put_fd(QEMUFile *f, int fd)
+{
+    Error *local_error = NULL;
+    struct iovec iov = { .iov_base = (char *)" ", .iov_len = 1 };
+    int ret;
+
+    if (!f->can_pass_fd) {
+        error_setg(&local_error, "Migration channel cannot pass fds");
+        qemu_file_set_error_obj(f, -EINVAL, local_error);
+        return -EINVAL;
+    }
+
+    ret = qemu_fflush(f);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (qio_channel_writev_full_all(f->ioc, &iov, 1, &fd, 1, 0,
+                                    &local_error) < 0) {
+        qemu_file_set_error_obj(f, -EIO, local_error);
+        return -EIO;
+    }
+    qemu_file_account(f, iov.iov_len);
+    trace_qemu_file_put_fd(fd);
+    return 0;
+}
+
+/*
+ * Receive a file descriptor sent with qemu_file_put_fd().  The caller owns
+ * the returned descriptor.
+ *
+ * Returns the file descriptor, or a negative error value.
+ */
+int qemu_file_get_fd(QEMUFile *f)
+{
+    FdEntry *fde;
+    int fd;
+
+    /* Make sure the placeholder byte, and the fd with it, was received */
+    qemu_peek_byte(f, 0);
+    if (qemu_file_get_error(f)) {
+        return qemu_file_get_error(f);
+    }
+
+    fde = QTAILQ_FIRST(&f->fds);
+    if (!fde) {
+        qemu_file_set_error(f, -EINVAL);
+        return -EINVAL;
+    }
+    QTAILQ_REMOVE(&f->fds, fde, entry);
+    fd = fde->fd;
+    g_free(fde);
+
+    qemu_file_skip(f, 1);
+    trace_qemu_file_get_fd(fd);
+    return fd;
+}
+
 /*
  * Read size bytes from QEMUFile f and write them to fd.
  */
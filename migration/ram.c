@@ -110,6 +110,13 @@
  */
 #define MAPPED_RAM_LOAD_BUF_SIZE 0x100000
 
+/*
+ * When loading mapped-ram with multifd, the pages region of a RAMBlock is
+ * split in chunks of this size.  Each chunk is a single job for a multifd
+ * channel, which reads every run of contiguous pages in it at once.
+ */
+#define MAPPED_RAM_LOAD_CHUNK_SIZE 0x4000000
+
 XBZRLECacheStats xbzrle_counters;
 
 /* used by the search for pages to send */
@@ -214,11 +221,22 @@ static bool postcopy_preempt_active(void)
     return migrate_postcopy_preempt() && migration_in_postcopy();
 }
 
+/*
+ * In cpr-transfer mode, RAM backed by a shared fd is handed over to the
+ * destination by passing the fd, so its contents don't need to be sent.
+ */
+static bool migrate_ram_is_fd_passed(RAMBlock *block)
+{
+    return migrate_mode() == MIG_MODE_CPR_TRANSFER &&
+           qemu_ram_is_shared(block) && qemu_ram_get_fd(block) >= 0;
+}
+
 bool migrate_ram_is_ignored(RAMBlock *block)
 {
     return !qemu_ram_is_migratable(block) ||
            (migrate_ignore_shared() && qemu_ram_is_shared(block)
-                                    && qemu_ram_is_named_file(block));
+                                    && qemu_ram_is_named_file(block)) ||
+           migrate_ram_is_fd_passed(block);
 }
 
 #undef RAMBLOCK_FOREACH
@@ -351,6 +369,12 @@ struct RAMSrcPageRequest {
     QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
 };
 
+/* Search position of a multifd channel in its part of RAM */
+typedef struct {
+    RAMBlock *block;
+    unsigned long page;
+} RAMChannelScan;
+
 /* State of RAM for migration */
 struct RAMState {
     /*
@@ -387,6 +411,8 @@ struct RAMState {
     bool xbzrle_started;
     /* Are we on the last stage of migration */
     bool last_stage;
+    /* Whether hot pages are sent until the next bitmap sync */
+    bool hot_pages_released;
 
     /* total handled target pages at the beginning of period */
     uint64_t target_page_count_prev;
@@ -401,6 +427,19 @@ struct RAMState {
      * - pss structures
      */
     QemuMutex bitmap_mutex;
+    /*
+     * With multifd-page-ownership, where each multifd channel is in its
+     * search for dirty pages.  Protected by the bitmap_mutex, but only
+     * used by the send thread of the channel while it is searching.
+     */
+    RAMChannelScan *channel_scan;
+    /*
+     * Serializes clearing the remote dirty bitmap between the channels,
+     * whose parts of RAM are smaller than a clear bitmap chunk
+     */
+    QemuMutex channel_scan_clear_mutex;
+    /* Only saving the pages dirtied since the last mapped-ram checkpoint */
+    bool incremental;
     /* The RAMBlock used in the last src_page_requests */
     RAMBlock *last_req_rb;
     /* Queue of outstanding page requests from the destination */
@@ -698,6 +737,113 @@ static int save_xbzrle_page(RAMState *rs, PageSearchStatus *pss,
     return 1;
 }
 
+/*
+ * With defer-hot-pages, the pages of a word of the dirty bitmap are hot if
+ * they were dirtied in at least RAM_HOT_PERIODS of the last RAM_HOT_HISTORY
+ * complete periods.  The current period doesn't count as it might have just
+ * started.
+ */
+#define RAM_HOT_HISTORY 4
+#define RAM_HOT_PERIODS 3
+
+static inline bool ramblock_word_is_hot(RAMBlock *rb, unsigned long word)
+{
+    uint8_t history = rb->dirty_history[word] >> 1;
+
+    return ctpop8(history & MAKE_64BIT_MASK(0, RAM_HOT_HISTORY)) >=
+        RAM_HOT_PERIODS;
+}
+
+/*
+ * Whether the dirty pages of hot words are left until there's nothing else
+ * to send.  On the last stage and in postcopy, all pages are sent.
+ */
+static bool ram_defer_hot_pages(RAMState *rs)
+{
+    return migrate_defer_hot_pages() && !rs->hot_pages_released &&
+           !rs->last_stage && !migration_in_postcopy() &&
+           !migration_in_colo_state();
+}
+
+/*
+ * Find the first dirty page of @rb from @start, below @size, skipping hot
+ * pages while they are deferred.
+ */
+static unsigned long ramblock_find_next_dirty(RAMState *rs, RAMBlock *rb,
+                                              unsigned long size,
+                                              unsigned long start)
+{
+    unsigned long page = find_next_bit(rb->bmap, size, start);
+
+    if (!rb->dirty_history || !ram_defer_hot_pages(rs)) {
+        return page;
+    }
+
+    while (page < size && ramblock_word_is_hot(rb, BIT_WORD(page))) {
+        page = find_next_bit(rb->bmap, size,
+                             QEMU_ALIGN_UP(page + 1, BITS_PER_LONG));
+    }
+
+    return page;
+}
+
+/*
+ * ram_release_hot_pages: called when a round over RAM found nothing to send
+ * but hot pages
+ *
+ * If the remaining RAM fits in the downtime limit, the hot pages are left
+ * for the switchover.  Otherwise they can't be avoided anymore and are sent
+ * until the next bitmap sync, and postcopy is started if it is enabled.
+ *
+ * Returns true if the hot pages are to be sent now.
+ *
+ * @rs: current RAM state
+ */
+static bool ram_release_hot_pages(RAMState *rs)
+{
+    MigrationState *s = migrate_get_current();
+    uint64_t remaining = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
+
+    if (!ram_defer_hot_pages(rs) || remaining < s->threshold_size) {
+        return false;
+    }
+
+    trace_ram_release_hot_pages(remaining, s->threshold_size);
+    if (migrate_postcopy_ram() && !qatomic_read(&s->start_postcopy)) {
+        trace_ram_release_hot_pages_postcopy();
+        qatomic_set(&s->start_postcopy, true);
+    }
+
+    rs->hot_pages_released = true;
+    return true;
+}
+
+/*
+ * Age the dirty history of RAM at the end of a period, with the
+ * bitmap_mutex held.
+ */
+static void ram_dirty_history_next_period(RAMState *rs)
+{
+    uint64_t hot_words = 0;
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        unsigned long i, words;
+
+        if (!block->dirty_history) {
+            continue;
+        }
+
+        words = BITS_TO_LONGS(block->used_length >> TARGET_PAGE_BITS);
+        for (i = 0; i < words; i++) {
+            block->dirty_history[i] <<= 1;
+            hot_words += ramblock_word_is_hot(block, i);
+        }
+    }
+
+    trace_ram_dirty_history_next_period(hot_words * BITS_PER_LONG);
+}
+
 /**
  * pss_find_next_dirty: find the next dirty page of current ramblock
  *
@@ -723,14 +869,16 @@ static void pss_find_next_dirty(PageSearchStatus *pss)
 
     /*
      * If during sending a host page, only look for dirty pages within the
-     * current host page being send.
+     * current host page being send, hot or not.
      */
     if (pss->host_page_sending) {
         assert(pss->host_page_end);
         size = MIN(size, pss->host_page_end);
+        pss->page = find_next_bit(bitmap, size, pss->page);
+        return;
     }
 
-    pss->page = find_next_bit(bitmap, size, pss->page);
+    pss->page = ramblock_find_next_dirty(ram_state, rb, size, pss->page);
 }
 
 static void migration_clear_memory_region_dirty_bitmap(RAMBlock *rb,
@@ -857,6 +1005,10 @@ static void dirty_bitmap_clear_section(MemoryRegionSection *section,
     }
     *cleared_bits += bitmap_count_one_with_offset(rb->bmap, start, npages);
     bitmap_clear(rb->bmap, start, npages);
+    /* A previous checkpoint may still hold the contents of the range */
+    if (rb->file_bmap) {
+        bitmap_clear(rb->file_bmap, start, npages);
+    }
 }
 
 /*
@@ -922,6 +1074,98 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+/*
+ * With multifd, the dirty bitmap is synchronized in chunks that the multifd
+ * send threads pick up together with the migration thread.  The chunk size
+ * is a multiple of the bitmap words, so the chunks of a RAMBlock never share
+ * a bitmap word.
+ */
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} DirtySyncChunk;
+
+typedef struct {
+    GArray *chunks;
+    /* Index of the next chunk to synchronize */
+    unsigned int next;
+    Stat64 new_dirty_pages;
+} DirtySyncJob;
+
+static void ramblock_sync_dirty_bitmap_chunks(void *opaque)
+{
+    DirtySyncJob *job = opaque;
+    uint64_t new_dirty_pages = 0;
+    unsigned int i;
+
+    RCU_READ_LOCK_GUARD();
+
+    while ((i = qatomic_fetch_inc(&job->next)) < job->chunks->len) {
+        DirtySyncChunk *c = &g_array_index(job->chunks, DirtySyncChunk, i);
+
+        new_dirty_pages += cpu_physical_memory_sync_dirty_bitmap(c->block,
+                                                                 c->start,
+                                                                 c->length);
+    }
+
+    stat64_add(&job->new_dirty_pages, new_dirty_pages);
+}
+
+/*
+ * Synchronize the dirty bitmap of all RAMBlocks with the help of the
+ * multifd send threads.  Returns false if the caller has to do it on its
+ * own.
+ *
+ * Called with RCU critical section and bitmap_mutex held
+ */
+static bool migration_bitmap_sync_multifd(RAMState *rs)
+{
+    g_autoptr(GArray) chunks = NULL;
+    DirtySyncJob job = { };
+    uint64_t new_dirty_pages;
+    ram_addr_t chunk_size;
+    RAMBlock *block;
+    uint8_t shift;
+
+    if (!migrate_multifd()) {
+        return false;
+    }
+
+    shift = migrate_get_current()->dirty_sync_chunk_shift;
+    shift = MIN(MAX(shift, DIRTY_SYNC_CHUNK_SHIFT_MIN),
+                DIRTY_SYNC_CHUNK_SHIFT_MAX);
+    chunk_size = (ram_addr_t)1 << (shift + TARGET_PAGE_BITS);
+
+    chunks = g_array_new(false, false, sizeof(DirtySyncChunk));
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t start;
+
+        for (start = 0; start < block->used_length; start += chunk_size) {
+            DirtySyncChunk c = {
+                .block = block,
+                .start = start,
+                .length = MIN(block->used_length - start, chunk_size),
+            };
+            g_array_append_val(chunks, c);
+        }
+    }
+
+    if (chunks->len < 2) {
+        return false;
+    }
+
+    job.chunks = chunks;
+    if (!multifd_send_run_helpers(ramblock_sync_dirty_bitmap_chunks, &job)) {
+        return false;
+    }
+
+    new_dirty_pages = stat64_get(&job.new_dirty_pages);
+    rs->migration_dirty_pages += new_dirty_pages;
+    rs->num_dirty_pages_period += new_dirty_pages;
+    return true;
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1057,11 +1301,15 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 
     WITH_QEMU_LOCK_GUARD(&rs->bitmap_mutex) {
         WITH_RCU_READ_LOCK_GUARD() {
-            RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-                ramblock_sync_dirty_bitmap(rs, block);
+            if (!migration_bitmap_sync_multifd(rs)) {
+                RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+                    ramblock_sync_dirty_bitmap(rs, block);
+                }
             }
             stat64_set(&mig_stats.dirty_bytes_last_sync, ram_bytes_remaining());
         }
+        /* Hot pages are left for later again */
+        rs->hot_pages_released = false;
     }
 
     memory_global_after_dirty_log_sync();
@@ -1073,6 +1321,14 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
     if (end_time > rs->time_last_bitmap_sync + 1000) {
         migration_trigger_throttle(rs);
 
+        if (migrate_defer_hot_pages()) {
+            WITH_QEMU_LOCK_GUARD(&rs->bitmap_mutex) {
+                WITH_RCU_READ_LOCK_GUARD() {
+                    ram_dirty_history_next_period(rs);
+                }
+            }
+        }
+
         migration_update_rates(rs, end_time);
 
         rs->target_page_count_prev = rs->target_page_count;
@@ -1884,6 +2140,7 @@ static void migration_page_queue_free(RAMState *rs)
 int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len,
                          Error **errp)
 {
+    struct RAMSrcPageRequest *new_entry, *last;
     RAMBlock *ramblock;
     RAMState *rs = ram_state;
 
@@ -1926,14 +2183,14 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len,
      * rp-return thread.
      */
     if (postcopy_preempt_active()) {
-        ram_addr_t page_start = start >> TARGET_PAGE_BITS;
         size_t page_size = qemu_ram_pagesize(ramblock);
         PageSearchStatus *pss = &ram_state->pss[RAM_CHANNEL_POSTCOPY];
+        ram_addr_t offset;
         int ret = 0;
 
         qemu_mutex_lock(&rs->bitmap_mutex);
 
-        pss_init(pss, ramblock, page_start);
+        pss_init(pss, ramblock, start >> TARGET_PAGE_BITS);
         /*
          * Always use the preempt channel, and make sure it's there.  It's
          * safe to access without lock, because when rp-thread is running
@@ -1947,38 +2204,48 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len,
          * assert; if something wrong we're mostly split brain anyway.
          */
         assert(len % page_size == 0);
-        while (len) {
+        for (offset = start; offset < start + len; offset += page_size) {
+            /*
+             * The destination asks for more than one host page when the
+             * guest faults sequentially.  ram_save_host_page_urgent() only
+             * moves pss->page to the next host page if it sent this one,
+             * so set it for each of them.
+             */
+            pss->page = offset >> TARGET_PAGE_BITS;
             if (ram_save_host_page_urgent(pss)) {
                 error_setg(errp, "ram_save_host_page_urgent() failed: "
                            "ramblock=%s, start_addr=0x"RAM_ADDR_FMT,
-                           ramblock->idstr, start);
+                           ramblock->idstr, offset);
                 ret = -1;
                 break;
             }
-            /*
-             * NOTE: after ram_save_host_page_urgent() succeeded, pss->page
-             * will automatically be moved and point to the next host page
-             * we're going to send, so no need to update here.
-             *
-             * Normally QEMU never sends >1 host page in requests, so
-             * logically we don't even need that as the loop should only
-             * run once, but just to be consistent.
-             */
-            len -= page_size;
-        };
+        }
         qemu_mutex_unlock(&rs->bitmap_mutex);
 
         return ret;
     }
 
-    struct RAMSrcPageRequest *new_entry =
-        g_new0(struct RAMSrcPageRequest, 1);
+    qemu_mutex_lock(&rs->src_page_req_mutex);
+
+    /*
+     * Requests for sequential faults usually follow each other: make them
+     * one burst instead of queueing one request per fault.
+     */
+    last = QSIMPLEQ_LAST(&rs->src_page_requests, RAMSrcPageRequest, next_req);
+    if (last && last->rb == ramblock && last->offset + last->len == start) {
+        trace_ram_save_queue_pages_merge(ramblock->idstr, last->offset,
+                                         last->len, len);
+        last->len += len;
+        qemu_mutex_unlock(&rs->src_page_req_mutex);
+        return 0;
+    }
+
+    new_entry = g_new0(struct RAMSrcPageRequest, 1);
     new_entry->rb = ramblock;
     new_entry->offset = start;
     new_entry->len = len;
 
     memory_region_ref(ramblock->mr);
-    qemu_mutex_lock(&rs->src_page_req_mutex);
     QSIMPLEQ_INSERT_TAIL(&rs->src_page_requests, new_entry, next_req);
     migration_make_urgent_request();
     qemu_mutex_unlock(&rs->src_page_req_mutex);
@@ -2266,6 +2533,11 @@ static int ram_find_and_save_block(RAMState *rs)
             int res = find_dirty_block(rs, pss);
             if (res != PAGE_DIRTY_FOUND) {
                 if (res == PAGE_ALL_CLEAN) {
+                    if (ram_release_hot_pages(rs)) {
+                        /* Go around once more for the hot pages */
+                        pss->complete_round = false;
+                        continue;
+                    }
                     break;
                 } else if (res == PAGE_TRY_AGAIN) {
                     continue;
@@ -2287,6 +2559,194 @@ static int ram_find_and_save_block(RAMState *rs)
     return pages;
 }
 
+typedef struct {
+    RAMState *rs;
+    /* QEMU_CLOCK_REALTIME time at which to stop, or 0 for no limit */
+    int64_t deadline;
+    /* Whether to stop when the rate limit is reached */
+    bool rate_limit;
+    /* Number of dirty pages that have been queued */
+    Stat64 pages;
+    /* Number of channels that have been once around their part of RAM */
+    int complete_rounds;
+} RAMChannelScanJob;
+
+static bool ram_channel_scan_should_stop(RAMChannelScanJob *job)
+{
+    if (job->deadline &&
+        qemu_clock_get_ns(QEMU_CLOCK_REALTIME) >= job->deadline) {
+        return true;
+    }
+
+    return job->rate_limit && migration_rate_used_up();
+}
+
+/*
+ * RAM is dealt out to the multifd channels in chunks of this many target
+ * pages (2 MiB with 4 KiB pages).  This is independent of the clear bitmap
+ * chunk size, which is 1 GiB by default and would leave most channels idle
+ * on small guests.  Chunks must cover whole words of the dirty bitmap.
+ */
+#define RAM_CHANNEL_CHUNK_SHIFT 9
+
+/*
+ * Clear the remote dirty bitmap of the clear bitmap chunk containing @page
+ * before the page is sent.  A clear bitmap chunk is shared by several
+ * channels, so a channel that finds the chunk cleared already must also
+ * know that the clearing channel is done with it.
+ */
+static void ram_channel_clear_dirty_bitmap(RAMState *rs, RAMBlock *rb,
+                                           unsigned long page)
+{
+    if (!rb->clear_bmap) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&rs->channel_scan_clear_mutex) {
+        migration_clear_memory_region_dirty_bitmap(rb, page);
+    }
+}
+
+/*
+ * ram_channel_scan: find and queue the dirty pages owned by a channel
+ *
+ * Called in the send thread of @p.  RAM is split in chunks of
+ * 1 << RAM_CHANNEL_CHUNK_SHIFT pages, numbered from the offset of their
+ * RAMBlock in the ram_addr_t space so that the numbering doesn't restart in
+ * every RAMBlock, and the chunks are dealt out to the channels in turn.
+ * This way each page is always sent through the same channel and can't be
+ * overtaken by an older copy of itself.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int ram_channel_scan(MultiFDSendParams *p, void *opaque, Error **errp)
+{
+    RAMChannelScanJob *job = opaque;
+    RAMChannelScan *scan = &job->rs->channel_scan[p->id];
+    unsigned int nr_channels = migrate_multifd_channels();
+    unsigned int shift = RAM_CHANNEL_CHUNK_SHIFT;
+    bool complete_round = false;
+    RAMBlock *start_block;
+    unsigned long start_page;
+    uint64_t pages = 0;
+    int ret = 0;
+
+    RCU_READ_LOCK_GUARD();
+
+    if (!scan->block) {
+        scan->block = QLIST_FIRST_RCU(&ram_list.blocks);
+        scan->page = 0;
+    }
+    start_block = scan->block;
+    start_page = scan->page;
+
+    while (true) {
+        RAMBlock *rb = scan->block;
+        unsigned long size = rb->used_length >> TARGET_PAGE_BITS;
+        unsigned long base = rb->offset >> (TARGET_PAGE_BITS + shift);
+        unsigned long chunk, end;
+
+        if (complete_round && rb == start_block && scan->page >= start_page) {
+            /* Nothing left to send until the next bitmap sync */
+            qatomic_inc(&job->complete_rounds);
+            break;
+        }
+
+        if (migrate_ram_is_ignored(rb) || scan->page >= size) {
+            scan->page = 0;
+            scan->block = QLIST_NEXT_RCU(rb, next);
+            if (!scan->block) {
+                scan->block = QLIST_FIRST_RCU(&ram_list.blocks);
+                complete_round = true;
+            }
+            continue;
+        }
+
+        chunk = scan->page >> shift;
+        if ((base + chunk) % nr_channels != p->id) {
+            /* Skip to the next chunk that belongs to this channel */
+            chunk += (p->id + nr_channels - (base + chunk) % nr_channels) %
+                     nr_channels;
+            scan->page = chunk << shift;
+            continue;
+        }
+
+        end = MIN(size, (chunk + 1) << shift);
+        scan->page = ramblock_find_next_dirty(job->rs, rb, end, scan->page);
+        if (scan->page >= end) {
+            continue;
+        }
+
+        /* Checking the clock is a bit expensive, don't do it every time */
+        if ((pages & 63) == 0 && ram_channel_scan_should_stop(job)) {
+            break;
+        }
+
+        ram_channel_clear_dirty_bitmap(job->rs, rb, scan->page);
+        clear_bit(scan->page, rb->bmap);
+        pages++;
+
+        ret = multifd_send_channel_queue_page(p, rb,
+                                              (ram_addr_t)scan->page <<
+                                              TARGET_PAGE_BITS, errp);
+        if (ret < 0) {
+            break;
+        }
+        scan->page++;
+    }
+
+    stat64_add(&job->pages, pages);
+    return ret;
+}
+
+/**
+ * ram_save_channels_scan: let the multifd channels send the dirty pages
+ *
+ * Used instead of ram_find_and_save_block() with multifd-page-ownership.
+ * Each channel searches its own part of RAM, until @deadline (unless it
+ * is zero) or, if @rate_limit is true, until the rate limit is reached.
+ *
+ * Returns 1 if all dirty pages have been queued, 0 if some are left, or
+ * negative on error.
+ *
+ * Called within an RCU critical section, with the bitmap_mutex held, so
+ * that the bitmaps don't change under the channels' feet.
+ *
+ * @rs: current RAM state
+ * @deadline: QEMU_CLOCK_REALTIME time at which to stop, or 0
+ * @rate_limit: whether to stop when the rate limit is reached
+ */
+static int ram_save_channels_scan(RAMState *rs, int64_t deadline,
+                                  bool rate_limit)
+{
+    RAMChannelScanJob job = {
+        .rs = rs,
+        .deadline = deadline,
+        .rate_limit = rate_limit,
+    };
+    uint64_t pages;
+
+    /* No dirty page as there is zero RAM */
+    if (!rs->ram_bytes_total) {
+        return 1;
+    }
+
+    if (multifd_send_channels_scan(ram_channel_scan, &job) < 0) {
+        return -1;
+    }
+
+    pages = stat64_get(&job.pages);
+    rs->migration_dirty_pages -= pages;
+    rs->target_page_count += pages;
+    trace_ram_save_channels_scan(pages, job.complete_rounds);
+
+    if (job.complete_rounds == migrate_multifd_channels()) {
+        /* With hot pages to send now, the channels go around once more */
+        return !ram_release_hot_pages(rs);
+    }
+    return 0;
+}
+
 static uint64_t ram_bytes_total_with_ignored(void)
 {
     RAMBlock *block;
@@ -2329,7 +2789,9 @@ static void ram_state_cleanup(RAMState **rsp)
     if (*rsp) {
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
+        qemu_mutex_destroy(&(*rsp)->channel_scan_clear_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
+        g_free((*rsp)->channel_scan);
         g_free(*rsp);
         *rsp = NULL;
     }
@@ -2351,6 +2813,75 @@ static void xbzrle_cleanup(void)
     XBZRLE_cache_unlock();
 }
 
+/*
+ * Incremental mapped-ram checkpoints: after a successful migration to a
+ * file, dirty logging for migration is left running and the bitmaps of
+ * the pages present in the file (file_bmap) are kept.  The next migration
+ * to the same file then starts from the pages dirtied since, instead of
+ * from all of RAM.
+ */
+static struct {
+    bool valid;
+    /* ram_list.version when the checkpoint was taken */
+    uint32_t ram_list_version;
+} ram_checkpoint;
+
+bool ram_has_checkpoint(void)
+{
+    return ram_checkpoint.valid;
+}
+
+/* Forget the last checkpoint; the next migration saves all of RAM. */
+void ram_discard_checkpoint(void)
+{
+    RAMBlock *block;
+
+    if (!ram_checkpoint.valid) {
+        return;
+    }
+    ram_checkpoint.valid = false;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            g_free(block->file_bmap);
+            block->file_bmap = NULL;
+        }
+    }
+
+    if (global_dirty_tracking & GLOBAL_DIRTY_MIGRATION) {
+        memory_global_dirty_log_stop(GLOBAL_DIRTY_MIGRATION);
+    }
+}
+
+/*
+ * Returns true if the migration being set up can start from the last
+ * checkpoint.  The checkpoint is consumed either way.
+ */
+static bool ram_checkpoint_begin(void)
+{
+    RAMBlock *block;
+
+    if (!ram_checkpoint.valid) {
+        return false;
+    }
+
+    if (!migrate_mapped_ram_incremental() ||
+        ram_checkpoint.ram_list_version != ram_list.version) {
+        ram_discard_checkpoint();
+        return false;
+    }
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (!block->file_bmap) {
+            ram_discard_checkpoint();
+            return false;
+        }
+    }
+
+    ram_checkpoint.valid = false;
+    return true;
+}
+
 static void ram_bitmaps_destroy(void)
 {
     RAMBlock *block;
@@ -2360,8 +2891,12 @@ static void ram_bitmaps_destroy(void)
         block->clear_bmap = NULL;
         g_free(block->bmap);
         block->bmap = NULL;
-        g_free(block->file_bmap);
-        block->file_bmap = NULL;
+        g_free(block->dirty_history);
+        block->dirty_history = NULL;
+        if (!ram_checkpoint.valid) {
+            g_free(block->file_bmap);
+            block->file_bmap = NULL;
+        }
     }
 }
 
@@ -2369,8 +2904,17 @@ static void ram_save_cleanup(void *opaque)
 {
     RAMState **rsp = opaque;
 
-    /* We don't use dirty log with background snapshots */
-    if (!migrate_background_snapshot()) {
+    if (migrate_mapped_ram_incremental() &&
+        migrate_get_current()->state == MIGRATION_STATUS_COMPLETED) {
+        ram_checkpoint.valid = true;
+        ram_checkpoint.ram_list_version = ram_list.version;
+    }
+
+    /*
+     * We don't use dirty log with background snapshots, and keep it
+     * running after a checkpoint.
+     */
+    if (!migrate_background_snapshot() && !ram_checkpoint.valid) {
         /* caller have hold BQL or is in a bh, so there is
          * no writing race against the migration bitmap
          */
@@ -2402,6 +2946,10 @@ static void ram_state_reset(RAMState *rs)
 
     rs->last_seen_block = NULL;
     rs->last_page = 0;
+    if (rs->channel_scan) {
+        memset(rs->channel_scan, 0,
+               sizeof(RAMChannelScan) * migrate_multifd_channels());
+    }
     rs->last_version = ram_list.version;
     rs->xbzrle_started = false;
 }
@@ -2699,6 +3247,7 @@ static bool ram_state_init(RAMState **rsp, Error **errp)
     }
 
     qemu_mutex_init(&(*rsp)->bitmap_mutex);
+    qemu_mutex_init(&(*rsp)->channel_scan_clear_mutex);
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
     (*rsp)->ram_bytes_total = ram_bytes_total();
@@ -2709,12 +3258,16 @@ static bool ram_state_init(RAMState **rsp, Error **errp)
      * This must match with the initial values of dirty bitmap.
      */
     (*rsp)->migration_dirty_pages = (*rsp)->ram_bytes_total >> TARGET_PAGE_BITS;
+    if (migrate_multifd_page_ownership()) {
+        (*rsp)->channel_scan = g_new0(RAMChannelScan,
+                                      migrate_multifd_channels());
+    }
     ram_state_reset(*rsp);
 
     return true;
 }
 
-static void ram_list_init_bitmaps(void)
+static void ram_list_init_bitmaps(bool incremental)
 {
     MigrationState *ms = migrate_get_current();
     RAMBlock *block;
@@ -2744,11 +3297,19 @@ static void ram_list_init_bitmaps(void)
              * new migration after a failed migration, ram_list.
              * dirty_memory[DIRTY_MEMORY_MIGRATION] don't include the whole
              * guest memory.
+             * An incremental checkpoint only starts with the pages that
+             * were dirtied since the previous one, which the first sync
+             * collects, and keeps the file_bmap of the previous one.
              */
             block->bmap = bitmap_new(pages);
-            bitmap_set(block->bmap, 0, pages);
-            if (migrate_mapped_ram()) {
-                block->file_bmap = bitmap_new(pages);
+            if (migrate_defer_hot_pages()) {
+                block->dirty_history = g_new0(uint8_t, BITS_TO_LONGS(pages));
+            }
+            if (!incremental) {
+                bitmap_set(block->bmap, 0, pages);
+                if (migrate_mapped_ram()) {
+                    block->file_bmap = bitmap_new(pages);
+                }
             }
             block->clear_bmap_shift = shift;
             block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
@@ -2772,11 +3333,18 @@ static void migration_bitmap_clear_discarded_pages(RAMState *rs)
 static bool ram_init_bitmaps(RAMState *rs, Error **errp)
 {
     bool ret = true;
+    bool incremental;
 
     qemu_mutex_lock_ramlist();
 
     WITH_RCU_READ_LOCK_GUARD() {
-        ram_list_init_bitmaps();
+        incremental = ram_checkpoint_begin();
+        ram_list_init_bitmaps(incremental);
+        if (incremental) {
+            rs->migration_dirty_pages = 0;
+        }
+        rs->incremental = incremental;
+        trace_ram_init_bitmaps(incremental);
         /* We don't use dirty log with background snapshots */
         if (!migrate_background_snapshot()) {
             ret = memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION, errp);
@@ -2921,10 +3489,15 @@ struct MappedRamHeader {
 } QEMU_PACKED;
 typedef struct MappedRamHeader MappedRamHeader;
 
-static void mapped_ram_setup_ramblock(QEMUFile *file, RAMBlock *block)
+/*
+ * Returns false if the pages of @block moved in the file since the
+ * previous checkpoint.
+ */
+static bool mapped_ram_setup_ramblock(QEMUFile *file, RAMBlock *block)
 {
     g_autofree MappedRamHeader *header = NULL;
     size_t header_size, bitmap_size;
+    uint64_t old_pages_offset = block->pages_offset;
     long num_pages;
 
     header = g_new0(MappedRamHeader, 1);
@@ -2952,6 +3525,97 @@ static void mapped_ram_setup_ramblock(QEMUFile *file, RAMBlock *block)
 
     /* prepare offset for next ramblock */
     qemu_set_offset(file, block->pages_offset + block->used_length, SEEK_SET);
+
+    return block->pages_offset == old_pages_offset;
+}
+
+/*
+ * The pages of @block can't be taken from the previous checkpoint, e.g.
+ * because the size of the sections before them changed: save all of them.
+ */
+static void mapped_ram_checkpoint_reset_ramblock(RAMState *rs,
+                                                 RAMBlock *block)
+{
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+
+    QEMU_LOCK_GUARD(&rs->bitmap_mutex);
+    rs->migration_dirty_pages -= bitmap_count_one(block->bmap, pages);
+    bitmap_set(block->bmap, 0, pages);
+    rs->migration_dirty_pages += pages;
+    bitmap_clear(block->file_bmap, 0, pages);
+}
+
+/*
+ * For cpr-transfer, every RAMBlock in the setup section is followed by a
+ * flag telling whether its backing fd is passed.  If it is, the fd comes
+ * next, followed by its offset, the page size and the maximum length of
+ * the block.
+ */
+static int cpr_transfer_save_ramblock(QEMUFile *f, RAMBlock *block,
+                                      Error **errp)
+{
+    int ret;
+
+    if (!migrate_ram_is_fd_passed(block)) {
+        qemu_put_byte(f, 0);
+        return 0;
+    }
+
+    qemu_put_byte(f, 1);
+    ret = qemu_file_put_fd(f, block->fd);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to pass fd of RAM block %s",
+                         block->idstr);
+        return ret;
+    }
+    qemu_put_be64(f, block->fd_offset);
+    qemu_put_be64(f, block->page_size);
+    qemu_put_be64(f, block->max_length);
+    return 0;
+}
+
+static int cpr_transfer_load_ramblock(QEMUFile *f, RAMBlock *block,
+                                      Error **errp)
+{
+    bool has_fd = qemu_get_byte(f);
+    uint64_t fd_offset, page_size, max_length;
+    int fd;
+
+    if (has_fd != migrate_ram_is_fd_passed(block)) {
+        error_setg(errp, "RAM block %s is %sbacked by a shared fd on the "
+                   "source but %sbacked by one on the destination",
+                   block->idstr, has_fd ? "" : "not ", has_fd ? "not " : "");
+        return -EINVAL;
+    }
+    if (!has_fd) {
+        return 0;
+    }
+
+    fd = qemu_file_get_fd(f);
+    if (fd < 0) {
+        error_setg_errno(errp, -fd, "Failed to receive fd of RAM block %s",
+                         block->idstr);
+        return fd;
+    }
+    fd_offset = qemu_get_be64(f);
+    page_size = qemu_get_be64(f);
+    max_length = qemu_get_be64(f);
+
+    if (page_size != block->page_size || max_length != block->max_length) {
+        error_setg(errp, "Mismatched RAM block %s: page size %" PRIu64
+                   " (local %zu), max length %" PRIu64 " (local "
+                   RAM_ADDR_FMT ")", block->idstr, page_size,
+                   block->page_size, max_length, block->max_length);
+        close(fd);
+        return -EINVAL;
+    }
+
+    if (!qemu_ram_replace_fd(block, fd, fd_offset, errp)) {
+        close(fd);
+        return -EINVAL;
+    }
+    trace_cpr_transfer_load_ramblock(block->idstr, fd, fd_offset);
+    return 0;
 }
 
 static bool mapped_ram_read_header(QEMUFile *file, MappedRamHeader *header,
@@ -3034,9 +3698,17 @@ static int ram_save_setup(QEMUFile *f, void *opaque, Error **errp)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_mode() == MIG_MODE_CPR_TRANSFER) {
+                ret = cpr_transfer_save_ramblock(f, block, errp);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
 
-            if (migrate_mapped_ram()) {
-                mapped_ram_setup_ramblock(f, block);
+            if (migrate_mapped_ram() &&
+                !mapped_ram_setup_ramblock(f, block) &&
+                (*rsp)->incremental && !migrate_ram_is_ignored(block)) {
+                mapped_ram_checkpoint_reset_ramblock(*rsp, block);
             }
         }
     }
@@ -3099,10 +3771,13 @@ static void ram_save_file_bmap(QEMUFile *f)
         /*
          * Free the bitmap here to catch any synchronization issues
          * with multifd channels. No channels should be sending pages
-         * after we've written the bitmap to file.
+         * after we've written the bitmap to file.  It is the base of
+         * the next checkpoint when saving incrementally.
          */
-        g_free(block->file_bmap);
-        block->file_bmap = NULL;
+        if (!migrate_mapped_ram_incremental()) {
+            g_free(block->file_bmap);
+            block->file_bmap = NULL;
+        }
     }
 }
 
@@ -3164,6 +3839,18 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
                     break;
                 }
 
+                if (migrate_multifd_page_ownership()) {
+                    ret = ram_save_channels_scan(rs,
+                                                 t0 + MAX_WAIT * SCALE_MS,
+                                                 true);
+                    if (ret < 0) {
+                        qemu_file_set_error(f, ret);
+                    } else {
+                        done = ret;
+                    }
+                    break;
+                }
+
                 pages = ram_find_and_save_block(rs);
                 /* no more pages to sent */
                 if (pages == 0) {
@@ -3264,10 +3951,18 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         while (true) {
             int pages;
 
-            pages = ram_find_and_save_block(rs);
-            /* no more blocks to sent */
-            if (pages == 0) {
-                break;
+            if (migrate_multifd_page_ownership()) {
+                /* Without a deadline, the channels send everything */
+                pages = ram_save_channels_scan(rs, 0, false);
+                if (pages >= 0) {
+                    break;
+                }
+            } else {
+                pages = ram_find_and_save_block(rs);
+                /* no more blocks to sent */
+                if (pages == 0) {
+                    break;
+                }
             }
             if (pages < 0) {
                 qemu_mutex_unlock(&rs->bitmap_mutex);
@@ -3890,20 +4585,56 @@ void colo_flush_ram_cache(void)
     trace_colo_flush_ram_cache_end();
 }
 
-static size_t ram_load_multifd_pages(void *host_addr, size_t size,
-                                     uint64_t offset)
+static bool ram_load_multifd_pages(RAMBlock *block, unsigned long *bitmap,
+                                   unsigned long start, unsigned long end)
 {
     MultiFDRecvData *data = multifd_get_recv_data();
+    ram_addr_t offset = start << TARGET_PAGE_BITS;
 
-    data->opaque = host_addr;
-    data->file_offset = offset;
-    data->size = size;
+    data->opaque = host_from_ram_block_offset(block, offset);
+    data->file_offset = block->pages_offset + offset;
+    data->size = (end - start) << TARGET_PAGE_BITS;
+    data->bitmap = bitmap;
+    data->bitmap_start = start;
 
-    if (!multifd_recv()) {
-        return 0;
+    return multifd_recv();
+}
+
+/*
+ * The multifd channels read whole chunks of the RAMBlock, so the bitmap
+ * has to stay around until they are synchronized.  It is kept in the
+ * file_bmap of the block until then.
+ */
+static bool read_ramblock_mapped_ram_multifd(RAMBlock *block, long num_pages,
+                                             unsigned long *bitmap,
+                                             Error **errp)
+{
+    unsigned long chunk_pages = MAPPED_RAM_LOAD_CHUNK_SIZE >> TARGET_PAGE_BITS;
+    unsigned long nr = num_pages;
+    unsigned long start, end;
+
+    if (nr && !offset_in_ramblock(block,
+                                  ((ram_addr_t)nr << TARGET_PAGE_BITS) - 1)) {
+        error_setg(errp, "page outside of ramblock %s range", block->idstr);
+        return false;
     }
 
-    return size;
+    for (start = 0; start < nr; start = end) {
+        end = MIN(start + chunk_pages, nr);
+
+        if (find_next_bit(bitmap, end, start) >= end) {
+            continue;
+        }
+
+        if (!ram_load_multifd_pages(block, bitmap, start, end)) {
+            error_setg(errp, "(%s) failed to queue pages at " RAM_ADDR_FMT
+                       " for loading", block->idstr,
+                       (ram_addr_t)start << TARGET_PAGE_BITS);
+            return false;
+        }
+    }
+
+    return true;
 }
 
 static bool read_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
@@ -3934,15 +4665,8 @@ static bool read_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
             }
 
             size = MIN(unread, MAPPED_RAM_LOAD_BUF_SIZE);
-
-            if (migrate_multifd()) {
-                read = ram_load_multifd_pages(host, size,
-                                              block->pages_offset + offset);
-            } else {
-                read = qemu_get_buffer_at(f, host, size,
-                                          block->pages_offset + offset);
-            }
-
+            read = qemu_get_buffer_at(f, host, size,
+                                      block->pages_offset + offset);
             if (!read) {
                 goto err;
             }
@@ -3961,6 +4685,16 @@ err:
     return false;
 }
 
+static void mapped_ram_load_cleanup(void)
+{
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+    }
+}
+
 static void parse_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
                                       ram_addr_t length, Error **errp)
 {
@@ -3998,7 +4732,14 @@ static void parse_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
         return;
     }
 
-    if (!read_ramblock_mapped_ram(f, block, num_pages, bitmap, errp)) {
+    if (migrate_multifd()) {
+        g_free(block->file_bmap);
+        block->file_bmap = g_steal_pointer(&bitmap);
+        if (!read_ramblock_mapped_ram_multifd(block, num_pages,
+                                              block->file_bmap, errp)) {
+            return;
+        }
+    } else if (!read_ramblock_mapped_ram(f, block, num_pages, bitmap, errp)) {
         return;
     }
 
@@ -4067,6 +4808,13 @@ static int parse_ramblock(QEMUFile *f, RAMBlock *block, ram_addr_t length)
             return -EINVAL;
         }
     }
+    if (migrate_mode() == MIG_MODE_CPR_TRANSFER) {
+        ret = cpr_transfer_load_ramblock(f, block, &local_err);
+        if (ret < 0) {
+            error_report_err(local_err);
+            return ret;
+        }
+    }
     ret = rdma_block_notification_handle(f, block->idstr);
     if (ret < 0) {
         qemu_file_set_error(f, ret);
@@ -4207,10 +4955,12 @@ static int ram_load_precopy(QEMUFile *f)
              * once and for all here to make sure all tasks we queued to
              * multifd threads are completed, so that all the ramblocks
              * (including all the guest memory pages within) are fully
-             * loaded after this sync returns.
+             * loaded after this sync returns.  The bitmaps the threads
+             * were loading from can go away after that.
              */
             if (migrate_mapped_ram()) {
                 multifd_recv_sync_main();
+                mapped_ram_load_cleanup();
             }
             break;
 
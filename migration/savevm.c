@@ -1047,6 +1047,175 @@ static int vmstate_save(QEMUFile *f, SaveStateEntry *se, JSONWriter *vmdesc,
     }
     return 0;
 }
+
+/*
+ * Devices whose VMSD is marked independent are saved concurrently by up to
+ * SAVEVM_PARALLEL_THREADS worker threads, each section into its own buffer.
+ * The caller walks the handlers as usual and copies the buffers into the
+ * stream when it reaches the corresponding entries, so the sections end up
+ * in the same order as if they had been saved sequentially.
+ */
+#define SAVEVM_PARALLEL_THREADS 8
+
+typedef struct SaveStateJob {
+    SaveStateEntry *se;
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    JSONWriter *vmdesc;
+    Error *err;
+    int ret;
+    int64_t duration;
+    QemuSemaphore done;
+} SaveStateJob;
+
+typedef struct SaveStateJobs {
+    SaveStateJob *job;
+    unsigned int nr;
+    /* next job to run, shared by the workers */
+    unsigned int next;
+    /* next job to write to the stream */
+    unsigned int put;
+    QemuThread *threads;
+    unsigned int nr_threads;
+} SaveStateJobs;
+
+static void *savevm_parallel_save_thread(void *opaque)
+{
+    SaveStateJobs *jobs = opaque;
+    unsigned int i;
+
+    rcu_register_thread();
+
+    while ((i = qatomic_fetch_inc(&jobs->next)) < jobs->nr) {
+        SaveStateJob *job = &jobs->job[i];
+        int64_t start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
+        job->ret = vmstate_save(job->f, job->se, job->vmdesc, &job->err);
+        if (!job->ret) {
+            job->ret = qemu_fflush(job->f);
+            if (job->ret) {
+                error_setg_errno(&job->err, -job->ret,
+                                 "%s: failed to buffer state", job->se->idstr);
+            }
+        }
+        job->duration = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
+        qemu_sem_post(&job->done);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Start saving the independent devices in the background.  Entries with
+ * early_setup are left to the caller, as they are normally sent in the
+ * setup phase.
+ *
+ * Returns NULL if there is nothing to save in parallel.
+ */
+static SaveStateJobs *savevm_parallel_save_start(bool with_vmdesc)
+{
+    SaveStateJobs *jobs;
+    SaveStateEntry *se;
+    unsigned int i = 0;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (se->vmsd && se->vmsd->independent && !se->vmsd->early_setup) {
+            i++;
+        }
+    }
+    if (!i) {
+        return NULL;
+    }
+
+    jobs = g_new0(SaveStateJobs, 1);
+    jobs->job = g_new0(SaveStateJob, i);
+    jobs->nr = i;
+
+    i = 0;
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        SaveStateJob *job;
+
+        if (!se->vmsd || !se->vmsd->independent || se->vmsd->early_setup) {
+            continue;
+        }
+
+        job = &jobs->job[i++];
+        job->se = se;
+        job->bioc = qio_channel_buffer_new(4096);
+        qio_channel_set_name(QIO_CHANNEL(job->bioc), "migration-savevm-buffer");
+        job->f = qemu_file_new_staging(QIO_CHANNEL(job->bioc));
+        job->vmdesc = with_vmdesc ? json_writer_new(false) : NULL;
+        qemu_sem_init(&job->done, 0);
+    }
+
+    jobs->nr_threads = MIN(jobs->nr, SAVEVM_PARALLEL_THREADS);
+    jobs->threads = g_new0(QemuThread, jobs->nr_threads);
+    for (i = 0; i < jobs->nr_threads; i++) {
+        qemu_thread_create(&jobs->threads[i], "mig/src/vmstate",
+                           savevm_parallel_save_thread, jobs,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    return jobs;
+}
+
+static bool savevm_parallel_save_owns(SaveStateJobs *jobs, SaveStateEntry *se)
+{
+    return jobs && jobs->put < jobs->nr && jobs->job[jobs->put].se == se;
+}
+
+/*
+ * Wait for the next parallel job, which belongs to the entry that is being
+ * saved, and write its section to @f.
+ */
+static int savevm_parallel_save_put(SaveStateJobs *jobs, QEMUFile *f,
+                                    JSONWriter *vmdesc, Error **errp)
+{
+    SaveStateJob *job = &jobs->job[jobs->put++];
+
+    qemu_sem_wait(&job->done);
+    if (job->ret) {
+        error_propagate(errp, g_steal_pointer(&job->err));
+        return job->ret;
+    }
+
+    qemu_put_buffer(f, job->bioc->data, job->bioc->usage);
+    if (vmdesc && *json_writer_get(job->vmdesc)) {
+        json_writer_append(vmdesc, NULL, job->vmdesc);
+    }
+    trace_vmstate_downtime_save("parallel", job->se->idstr,
+                                job->se->instance_id, job->duration);
+    return 0;
+}
+
+static void savevm_parallel_save_finish(SaveStateJobs *jobs)
+{
+    unsigned int i;
+
+    if (!jobs) {
+        return;
+    }
+
+    for (i = 0; i < jobs->nr_threads; i++) {
+        qemu_thread_join(&jobs->threads[i]);
+    }
+
+    for (i = 0; i < jobs->nr; i++) {
+        SaveStateJob *job = &jobs->job[i];
+
+        qemu_fclose(job->f);
+        object_unref(OBJECT(job->bioc));
+        json_writer_free(job->vmdesc);
+        error_free(job->err);
+        qemu_sem_destroy(&job->done);
+    }
+
+    g_free(jobs->threads);
+    g_free(jobs->job);
+    g_free(jobs);
+}
+
 /**
  * qemu_savevm_command_send: Send a 'QEMU_VM_COMMAND' type element with the
  *                           command and associated data.
@@ -1539,23 +1708,31 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
     JSONWriter *vmdesc = ms->vmdesc;
     int vmdesc_len;
     SaveStateEntry *se;
+    SaveStateJobs *jobs;
     Error *local_err = NULL;
     int ret;
 
+    jobs = savevm_parallel_save_start(vmdesc != NULL);
+
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (se->vmsd && se->vmsd->early_setup) {
             /* Already saved during qemu_savevm_state_setup(). */
             continue;
         }
 
+        if (savevm_parallel_save_owns(jobs, se)) {
+            ret = savevm_parallel_save_put(jobs, f, vmdesc, &local_err);
+            if (ret) {
+                goto fail;
+            }
+            continue;
+        }
+
         start_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
         ret = vmstate_save(f, se, vmdesc, &local_err);
         if (ret) {
-            migrate_set_error(ms, local_err);
-            error_report_err(local_err);
-            qemu_file_set_error(f, ret);
-            return ret;
+            goto fail;
         }
 
         end_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
@@ -1563,6 +1740,8 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                     end_ts_each - start_ts_each);
     }
 
+    savevm_parallel_save_finish(jobs);
+
     if (inactivate_disks) {
         /* Inactivate before sending QEMU_VM_EOF so that the
          * bdrv_activate_all() on the other end won't fail. */
@@ -1598,6 +1777,13 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
     trace_vmstate_downtime_checkpoint("src-non-iterable-saved");
 
     return 0;
+
+fail:
+    savevm_parallel_save_finish(jobs);
+    migrate_set_error(ms, local_err);
+    error_report_err(local_err);
+    qemu_file_set_error(f, ret);
+    return ret;
 }
 
 int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
@@ -1765,6 +1951,7 @@ int qemu_save_device_state(QEMUFile *f)
     MigrationState *ms = migrate_get_current();
     Error *local_err = NULL;
     SaveStateEntry *se;
+    SaveStateJobs *jobs;
 
     if (!migration_in_colo_state()) {
         qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
@@ -1772,20 +1959,29 @@ int qemu_save_device_state(QEMUFile *f)
     }
     cpu_synchronize_all_states();
 
+    jobs = savevm_parallel_save_start(false);
+
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         int ret;
 
         if (se->is_ram) {
             continue;
         }
-        ret = vmstate_save(f, se, NULL, &local_err);
+        if (savevm_parallel_save_owns(jobs, se)) {
+            ret = savevm_parallel_save_put(jobs, f, NULL, &local_err);
+        } else {
+            ret = vmstate_save(f, se, NULL, &local_err);
+        }
         if (ret) {
+            savevm_parallel_save_finish(jobs);
             migrate_set_error(ms, local_err);
             error_report_err(local_err);
             return ret;
         }
     }
 
+    savevm_parallel_save_finish(jobs);
+
     qemu_put_byte(f, QEMU_VM_EOF);
 
     return qemu_file_get_error(f);
@@ -2223,7 +2419,8 @@ static gboolean postcopy_sync_page_req(gpointer key, gpointer value,
         return FALSE;
     }
 
-    ret = migrate_send_rp_message_req_pages(mis, rb, rb_offset);
+    ret = migrate_send_rp_message_req_pages(mis, rb, rb_offset,
+                                            qemu_ram_pagesize(rb));
     if (ret) {
         /* Please refer to above comment. */
         error_report("%s: send rp message failed for addr %p",
@@ -15,141 +15,153 @@
 #include "qemu/host-utils.h"
 #include "xbzrle.h"
 
-#if defined(CONFIG_AVX512BW_OPT)
+#if defined(CONFIG_AVX512BW_OPT) || defined(CONFIG_AVX2_OPT)
 #include <immintrin.h>
 #include "host/cpuinfo.h"
+#define XBZRLE_ACCEL
+#elif defined(__aarch64__) && defined(__ARM_NEON) && !HOST_BIG_ENDIAN
+#include <arm_neon.h>
+#include "host/cpuinfo.h"
+#define XBZRLE_ACCEL
+#endif
 
-static int __attribute__((target("avx512bw")))
-xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                            uint8_t *dst, int dlen)
+#ifdef XBZRLE_ACCEL
+/* Tail of the buffers, shorter than a full vector */
+static inline uint64_t xbzrle_cmp_bytes(uint8_t *old_buf, uint8_t *new_buf,
+                                        int len)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0, num = 0;
-    uint8_t *nzrun_start = NULL;
-    /* add 1 to include residual part in main loop */
-    uint32_t count512s = (slen >> 6) + 1;
-    /* countResidual is tail of data, i.e., countResidual = slen % 64 */
-    uint32_t count_residual = slen & 0b111111;
-    bool never_same = true;
-    uint64_t mask_residual = 1;
-    mask_residual <<= count_residual;
-    mask_residual -= 1;
+    uint64_t comp = 0;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        comp |= (uint64_t)(old_buf[i] == new_buf[i]) << i;
+    }
+    return comp;
+}
+#endif
+
+#ifdef CONFIG_AVX512BW_OPT
+static inline uint64_t __attribute__((target("avx512bw")))
+xbzrle_cmp64_avx512(uint8_t *old_buf, uint8_t *new_buf, int len)
+{
+    uint64_t mask = len == 64 ? -1ULL : (1ULL << len) - 1;
     __m512i r = _mm512_set1_epi32(0);
+    __m512i old_data = _mm512_mask_loadu_epi8(r, mask, old_buf);
+    __m512i new_data = _mm512_mask_loadu_epi8(r, mask, new_buf);
 
-    while (count512s) {
-        int bytes_to_check = 64;
-        uint64_t mask = 0xffffffffffffffff;
-        if (count512s == 1) {
-            bytes_to_check = count_residual;
-            mask = mask_residual;
-        }
-        __m512i old_data = _mm512_mask_loadu_epi8(r,
-                                                  mask, old_buf + i);
-        __m512i new_data = _mm512_mask_loadu_epi8(r,
-                                                  mask, new_buf + i);
-        uint64_t comp = _mm512_cmpeq_epi8_mask(old_data, new_data);
-        count512s--;
-
-        bool is_same = (comp & 0x1);
-        while (bytes_to_check) {
-            if (d + 2 > dlen) {
-                return -1;
-            }
-            if (is_same) {
-                if (nzrun_len) {
-                    d += uleb128_encode_small(dst + d, nzrun_len);
-                    if (d + nzrun_len > dlen) {
-                        return -1;
-                    }
-                    nzrun_start = new_buf + i - nzrun_len;
-                    memcpy(dst + d, nzrun_start, nzrun_len);
-                    d += nzrun_len;
-                    nzrun_len = 0;
-                }
-                /* 64 data at a time for speed */
-                if (count512s && (comp == 0xffffffffffffffff)) {
-                    i += 64;
-                    zrun_len += 64;
-                    break;
-                }
-                never_same = false;
-                num = ctz64(~comp);
-                num = (num < bytes_to_check) ? num : bytes_to_check;
-                zrun_len += num;
-                bytes_to_check -= num;
-                comp >>= num;
-                i += num;
-                if (bytes_to_check) {
-                    /* still has different data after same data */
-                    d += uleb128_encode_small(dst + d, zrun_len);
-                    zrun_len = 0;
-                } else {
-                    break;
-                }
-            }
-            if (never_same || zrun_len) {
-                /*
-                 * never_same only acts if
-                 * data begins with diff in first count512s
-                 */
-                d += uleb128_encode_small(dst + d, zrun_len);
-                zrun_len = 0;
-                never_same = false;
-            }
-            /* has diff, 64 data at a time for speed */
-            if ((bytes_to_check == 64) && (comp == 0x0)) {
-                i += 64;
-                nzrun_len += 64;
-                break;
-            }
-            num = ctz64(comp);
-            num = (num < bytes_to_check) ? num : bytes_to_check;
-            nzrun_len += num;
-            bytes_to_check -= num;
-            comp >>= num;
-            i += num;
-            if (bytes_to_check) {
-                /* mask like 111000 */
-                d += uleb128_encode_small(dst + d, nzrun_len);
-                /* overflow */
-                if (d + nzrun_len > dlen) {
-                    return -1;
-                }
-                nzrun_start = new_buf + i - nzrun_len;
-                memcpy(dst + d, nzrun_start, nzrun_len);
-                d += nzrun_len;
-                nzrun_len = 0;
-                is_same = true;
-            }
-        }
+    return _mm512_cmpeq_epi8_mask(old_data, new_data);
+}
+
+#define XBZRLE_ENCODE xbzrle_encode_buffer_avx512
+#define XBZRLE_TARGET __attribute__((target("avx512bw")))
+#define XBZRLE_CMP64 xbzrle_cmp64_avx512
+#include "xbzrle-encode.c.inc"
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+static inline uint64_t __attribute__((target("avx2")))
+xbzrle_cmp64_avx2(uint8_t *old_buf, uint8_t *new_buf, int len)
+{
+    __m256i old_lo, old_hi, new_lo, new_hi;
+    uint32_t lo, hi;
+
+    if (len < 64) {
+        return xbzrle_cmp_bytes(old_buf, new_buf, len);
     }
 
-    if (nzrun_len != 0) {
-        d += uleb128_encode_small(dst + d, nzrun_len);
-        /* overflow */
-        if (d + nzrun_len > dlen) {
-            return -1;
-        }
-        nzrun_start = new_buf + i - nzrun_len;
-        memcpy(dst + d, nzrun_start, nzrun_len);
-        d += nzrun_len;
+    old_lo = _mm256_loadu_si256((__m256i_u *)old_buf);
+    old_hi = _mm256_loadu_si256((__m256i_u *)(old_buf + 32));
+    new_lo = _mm256_loadu_si256((__m256i_u *)new_buf);
+    new_hi = _mm256_loadu_si256((__m256i_u *)(new_buf + 32));
+    lo = _mm256_movemask_epi8(_mm256_cmpeq_epi8(old_lo, new_lo));
+    hi = _mm256_movemask_epi8(_mm256_cmpeq_epi8(old_hi, new_hi));
+
+    return ((uint64_t)hi << 32) | lo;
+}
+
+#define XBZRLE_ENCODE xbzrle_encode_buffer_avx2
+#define XBZRLE_TARGET __attribute__((target("avx2")))
+#define XBZRLE_CMP64 xbzrle_cmp64_avx2
+#include "xbzrle-encode.c.inc"
+#endif
+
+#if defined(__aarch64__) && defined(XBZRLE_ACCEL)
+static inline uint64_t
+xbzrle_cmp64_neon(uint8_t *old_buf, uint8_t *new_buf, int len)
+{
+    static const uint8_t bit[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+    };
+    uint8x16_t b, c0, c1, c2, c3;
+
+    if (len < 64) {
+        return xbzrle_cmp_bytes(old_buf, new_buf, len);
     }
-    return d;
+
+    b = vld1q_u8(bit);
+    c0 = vceqq_u8(vld1q_u8(old_buf), vld1q_u8(new_buf)) & b;
+    c1 = vceqq_u8(vld1q_u8(old_buf + 16), vld1q_u8(new_buf + 16)) & b;
+    c2 = vceqq_u8(vld1q_u8(old_buf + 32), vld1q_u8(new_buf + 32)) & b;
+    c3 = vceqq_u8(vld1q_u8(old_buf + 48), vld1q_u8(new_buf + 48)) & b;
+
+    /* Add up the bits of each group of 8 bytes into one byte of the mask */
+    c0 = vpaddq_u8(vpaddq_u8(c0, c1), vpaddq_u8(c2, c3));
+    c0 = vpaddq_u8(c0, c0);
+
+    return vgetq_lane_u64(vreinterpretq_u64_u8(c0), 0);
 }
 
+#define XBZRLE_ENCODE xbzrle_encode_buffer_neon
+#define XBZRLE_TARGET
+#define XBZRLE_CMP64 xbzrle_cmp64_neon
+#include "xbzrle-encode.c.inc"
+#endif
+
+#ifdef XBZRLE_ACCEL
 static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
                                     int slen, uint8_t *dst, int dlen);
 
-static int (*accel_func)(uint8_t *, uint8_t *, int, uint8_t *, int);
+typedef int (*xbzrle_encode_fn)(uint8_t *, uint8_t *, int, uint8_t *, int);
 
-static void __attribute__((constructor)) init_accel(void)
+/* From the slowest to the fastest */
+static const struct {
+    xbzrle_encode_fn fn;
+    unsigned cpuinfo;
+} accel_table[] = {
+    { xbzrle_encode_buffer_int, CPUINFO_ALWAYS },
+#if defined(__aarch64__)
+    { xbzrle_encode_buffer_neon, CPUINFO_ALWAYS },
+#endif
+#ifdef CONFIG_AVX2_OPT
+    { xbzrle_encode_buffer_avx2, CPUINFO_AVX2 },
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    { xbzrle_encode_buffer_avx512, CPUINFO_AVX512BW },
+#endif
+};
+
+static xbzrle_encode_fn accel_func;
+static unsigned accel_index;
+
+bool test_xbzrle_next_accel(void)
 {
     unsigned info = cpuinfo_init();
-    if (info & CPUINFO_AVX512BW) {
-        accel_func = xbzrle_encode_buffer_avx512;
-    } else {
-        accel_func = xbzrle_encode_buffer_int;
+
+    while (accel_index != 0) {
+        accel_index--;
+        if ((info & accel_table[accel_index].cpuinfo) ==
+            accel_table[accel_index].cpuinfo) {
+            accel_func = accel_table[accel_index].fn;
+            return true;
+        }
     }
+    return false;
+}
+
+static void __attribute__((constructor)) init_accel(void)
+{
+    accel_index = ARRAY_SIZE(accel_table);
+    test_xbzrle_next_accel();
 }
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
@@ -159,6 +171,11 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 }
 
 #define xbzrle_encode_buffer xbzrle_encode_buffer_int
+#else
+bool test_xbzrle_next_accel(void)
+{
+    return false;
+}
 #endif
 
 /*
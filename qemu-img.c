@@ -1273,6 +1273,32 @@ static int is_allocated_sectors_min(const uint8_t *buf, int n, int *pnum,
     return 1;
 }
 
+/*
+ * Returns true if the first cluster of the buffer contains non-zero data.
+ * Sets *pnum to the number of sectors at the start of the buffer that belong
+ * to clusters with the same status.  Compressed images can only skip whole
+ * zero clusters, so this is the counterpart of is_allocated_sectors_min() for
+ * them.
+ */
+static bool is_allocated_clusters(const uint8_t *buf, int n, int *pnum,
+                                  int cluster_sectors)
+{
+    bool is_zero;
+    int i;
+
+    is_zero = buffer_is_zero(buf, MIN(n, cluster_sectors) * BDRV_SECTOR_SIZE);
+    for (i = cluster_sectors; i < n; i += cluster_sectors) {
+        if (buffer_is_zero(buf + i * BDRV_SECTOR_SIZE,
+                           MIN(n - i, cluster_sectors) * BDRV_SECTOR_SIZE)
+            != is_zero) {
+            break;
+        }
+    }
+
+    *pnum = MIN(i, n);
+    return !is_zero;
+}
+
 /*
  * Compares two buffers chunk by chunk, where @chsize is the chunk size.
  * If @chsize is 0, default chunk size of BDRV_SECTOR_SIZE is used.
@@ -1897,14 +1923,14 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
              * is real non-zero data, we must write it. Otherwise we can treat
              * it as zero sectors.
              * Compressed clusters need to be written as a whole, so in that
-             * case we can only save the write if the buffer is completely
-             * zeroed. */
+             * case we can only save the write for completely zeroed
+             * clusters. */
             if (!s->min_sparse ||
                 (!s->compressed &&
                  is_allocated_sectors_min(buf, n, &n, s->min_sparse,
                                           sector_num, s->alignment)) ||
                 (s->compressed &&
-                 !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
+                 is_allocated_clusters(buf, n, &n, s->cluster_sectors)))
             {
                 ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
                                     n << BDRV_SECTOR_BITS, buf, flags);
@@ -2105,14 +2131,23 @@ static int convert_do_copy(ImgConvertState *s)
         bdrv_graph_rdunlock_main_loop();
     }
 
-    /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+    /* Allocate buffer for copied data. For compressed images, requests must
+     * consist of whole clusters. Drivers that can compress several clusters
+     * per request do so in parallel, so give them as many as fit into the
+     * buffer; the others get only one cluster at a time. */
     if (s->compressed) {
+        BlockDriver *drv = blk_bs(s->target)->drv;
+
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
             return -EINVAL;
         }
-        s->buf_sectors = s->cluster_sectors;
+        if (drv->bdrv_co_pwritev_compressed_part) {
+            s->buf_sectors = QEMU_ALIGN_DOWN(s->buf_sectors,
+                                             s->cluster_sectors);
+        } else {
+            s->buf_sectors = s->cluster_sectors;
+        }
     }
 
     while (sector_num < s->total_sectors) {
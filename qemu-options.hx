@@ -5840,7 +5840,7 @@ SRST
 
             CN=laptop.example.com,O=Example Home,L=London,ST=London,C=GB
 
-    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink,aio-max-batch=aio-max-batch``
+    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink,aio-max-batch=aio-max-batch,io-uring-sqpoll=on|off,io-uring-sq-thread-cpu=cpu``
         Creates a dedicated event loop thread that devices can be
         assigned to. This is known as an IOThread. By default device
         emulation happens in vCPU threads or the main event loop thread.
@@ -5880,7 +5880,15 @@ SRST
         in a batch for the AIO engine, 0 means that the engine will use
         its default.
 
-        The IOThread parameters can be modified at run-time using the
+        The ``io-uring-sqpoll`` parameter makes the IOThread monitor file
+        descriptors with an io_uring whose submission queue is polled by
+        a kernel thread, avoiding system calls on the submission side.
+        ``io-uring-sq-thread-cpu`` pins that kernel thread to a host CPU.
+        IOThreads with the same ``io-uring-sq-thread-cpu`` value share
+        one kernel thread. These two parameters cannot be changed at
+        run-time.
+
+        The other IOThread parameters can be modified at run-time using the
         ``qom-set`` command (where ``iothread1`` is the IOThread's
         ``id``):
 
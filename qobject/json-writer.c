@@ -245,3 +245,16 @@ void json_writer_str(JSONWriter *writer, const char *name, const char *str)
     maybe_comma_name(writer, name);
     quoted_str(writer, str);
 }
+
+/*
+ * Append the complete JSON value written to @src, as member @name of the
+ * current object or as the next element of the current array.  When
+ * pretty printing, @src must have been created with the same setting; its
+ * lines are not indented any further.
+ */
+void json_writer_append(JSONWriter *writer, const char *name,
+                        JSONWriter *src)
+{
+    maybe_comma_name(writer, name);
+    g_string_append(writer->contents, json_writer_get(src));
+}
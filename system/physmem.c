@@ -2188,6 +2188,49 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
         }
     }
 }
+
+/*
+ * Replace the memory of a shared, fd-backed RAMBlock with the file @fd at
+ * @fd_offset, keeping the host address of the block.  The current contents
+ * of the block are dropped.  On success the block takes ownership of @fd.
+ */
+bool qemu_ram_replace_fd(RAMBlock *rb, int fd, uint64_t fd_offset,
+                         Error **errp)
+{
+    void *area;
+    int flags, prot;
+
+    if (xen_enabled() || rb->fd < 0 || !(rb->flags & RAM_SHARED)) {
+        error_setg(errp, "RAM block %s is not backed by a shared file",
+                   rb->idstr);
+        return false;
+    }
+
+    flags = MAP_FIXED | MAP_SHARED;
+    flags |= rb->flags & RAM_NORESERVE ? MAP_NORESERVE : 0;
+    prot = PROT_READ;
+    prot |= rb->flags & RAM_READONLY ? 0 : PROT_WRITE;
+    area = mmap(rb->host, rb->max_length, prot, flags, fd, fd_offset);
+    if (area != rb->host) {
+        error_setg_errno(errp, errno, "Could not map fd %d over RAM block %s",
+                         fd, rb->idstr);
+        return false;
+    }
+    memory_try_enable_merging(rb->host, rb->max_length);
+    qemu_ram_setup_dump(rb->host, rb->max_length);
+
+    close(rb->fd);
+    rb->fd = fd;
+    rb->fd_offset = fd_offset;
+    return true;
+}
+#else
+bool qemu_ram_replace_fd(RAMBlock *rb, int fd, uint64_t fd_offset,
+                         Error **errp)
+{
+    error_setg(errp, "Replacing the fd of a RAM block is not supported");
+    return false;
+}
 #endif /* !_WIN32 */
 
 /*
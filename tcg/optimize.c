@@ -2702,6 +2702,144 @@ static bool fold_xor(OptContext *ctx, TCGOp *op)
     return fold_masks(ctx, op);
 }
 
+/*
+ * Stores to env that are overwritten by a later store to the same bytes,
+ * before anything could read them.  Only a few of them are tracked, and
+ * any op that could observe env (calls, guest memory accesses that may
+ * fault, the end of the basic block) makes them all live.
+ */
+#define MAX_DEAD_STORES 16
+
+typedef struct EnvStore {
+    TCGOp *op;
+    intptr_t start, last;
+} EnvStore;
+
+typedef struct DeadStoreContext {
+    EnvStore st[MAX_DEAD_STORES];
+    int nb;
+} DeadStoreContext;
+
+/* Forget the pending stores that overlap [start, last], as they are read. */
+static void env_stores_read(DeadStoreContext *ds, intptr_t start,
+                            intptr_t last)
+{
+    int i = 0;
+
+    while (i < ds->nb) {
+        if (ds->st[i].start <= last && start <= ds->st[i].last) {
+            ds->st[i] = ds->st[--ds->nb];
+        } else {
+            i++;
+        }
+    }
+}
+
+static void env_stores_write(TCGContext *s, DeadStoreContext *ds, TCGOp *op,
+                             intptr_t start, intptr_t last)
+{
+    int i = 0;
+
+    while (i < ds->nb) {
+        if (start <= ds->st[i].start && ds->st[i].last <= last) {
+            tcg_op_remove(s, ds->st[i].op);
+            ds->st[i] = ds->st[--ds->nb];
+        } else {
+            i++;
+        }
+    }
+
+    if (ds->nb == MAX_DEAD_STORES) {
+        /* Keep the oldest stores and give up on this one. */
+        return;
+    }
+    ds->st[ds->nb++] = (EnvStore) { .op = op, .start = start, .last = last };
+}
+
+static int env_access_size(TCGOp *op)
+{
+    switch (op->opc) {
+    CASE_OP_32_64(ld8u):
+    CASE_OP_32_64(ld8s):
+    CASE_OP_32_64(st8):
+        return 1;
+    CASE_OP_32_64(ld16u):
+    CASE_OP_32_64(ld16s):
+    CASE_OP_32_64(st16):
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_st_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+    case INDEX_op_ld_vec:
+    case INDEX_op_st_vec:
+        return tcg_type_size(TCG_TYPE_V64 + TCGOP_VECL(op));
+    default:
+        return 0;
+    }
+}
+
+static void remove_dead_env_stores(TCGContext *s)
+{
+    TCGTemp *env = tcgv_ptr_temp(tcg_env);
+    DeadStoreContext ds = { };
+    TCGOp *op, *op_next;
+
+    QTAILQ_FOREACH_SAFE(op, &s->ops, link, op_next) {
+        const TCGOpDef *def = &tcg_op_defs[op->opc];
+        int i, size;
+
+        if (op->opc == INDEX_op_call ||
+            op->opc == INDEX_op_plugin_cb ||
+            op->opc == INDEX_op_plugin_mem_cb ||
+            op->opc == INDEX_op_mb ||
+            op->opc == INDEX_op_dupm_vec ||
+            (def->flags & (TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS |
+                           TCG_OPF_CALL_CLOBBER))) {
+            ds.nb = 0;
+            continue;
+        }
+
+        /* Globals are loaded from env by the register allocator. */
+        for (i = def->nb_oargs; i < def->nb_oargs + def->nb_iargs; i++) {
+            TCGTemp *ts = arg_temp(op->args[i]);
+
+            if (ts->kind != TEMP_GLOBAL) {
+                continue;
+            }
+            if (ts->mem_base != env) {
+                ds.nb = 0;
+                break;
+            }
+            env_stores_read(&ds, ts->mem_offset,
+                            ts->mem_offset + tcg_type_size(ts->type) - 1);
+        }
+
+        size = env_access_size(op);
+        if (!size) {
+            continue;
+        }
+        if (arg_temp(op->args[1]) != env) {
+            /* A pointer other than env could point into it. */
+            if (def->nb_oargs) {
+                ds.nb = 0;
+            }
+            continue;
+        }
+
+        if (def->nb_oargs) {
+            env_stores_read(&ds, op->args[2], op->args[2] + size - 1);
+        } else {
+            env_stores_write(s, &ds, op, op->args[2], op->args[2] + size - 1);
+        }
+    }
+}
+
 /* Propagate constants and copies, fold constant expressions. */
 void tcg_optimize(TCGContext *s)
 {
@@ -2946,4 +3084,6 @@ void tcg_optimize(TCGContext *s)
             finish_folding(&ctx, op);
         }
     }
+
+    remove_dead_env_stores(s);
 }
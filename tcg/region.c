@@ -72,6 +72,15 @@ struct tcg_region_state {
     /* fields protected by the lock */
     size_t current; /* current region index */
     size_t agg_size_full; /* aggregate size of full regions */
+    uint64_t seq; /* number of region allocations */
+    struct tcg_region_info *info; /* per-region state, for eviction */
+};
+
+struct tcg_region_info {
+    /* allocation number when last handed out, 0 if the region is empty */
+    uint64_t seq;
+    /* contribution to agg_size_full, 0 while the region is in use */
+    size_t size_full;
 };
 
 static struct tcg_region_state region;
@@ -191,10 +200,24 @@ static void tcg_region_trees_init(void)
     }
 }
 
-static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
+/* Return the index of the region for a pointer in the rw buffer */
+static size_t tcg_region_index(const void *p)
 {
-    size_t region_idx;
+    ptrdiff_t offset;
+
+    if (p < region.start_aligned) {
+        return 0;
+    }
+
+    offset = p - region.start_aligned;
+    if (offset > region.stride * (region.n - 1)) {
+        return region.n - 1;
+    }
+    return offset / region.stride;
+}
 
+static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
+{
     /*
      * Like tcg_splitwx_to_rw, with no assert.  The pc may come from
      * a signal handler over which the caller has no control.
@@ -206,18 +229,7 @@ static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
         }
     }
 
-    if (p < region.start_aligned) {
-        region_idx = 0;
-    } else {
-        ptrdiff_t offset = p - region.start_aligned;
-
-        if (offset > region.stride * (region.n - 1)) {
-            region_idx = region.n - 1;
-        } else {
-            region_idx = offset / region.stride;
-        }
-    }
-    return region_trees + region_idx * tree_size;
+    return region_trees + tcg_region_index(p) * tree_size;
 }
 
 void tcg_tb_insert(TranslationBlock *tb)
@@ -359,11 +371,23 @@ static void tcg_region_assign(TCGContext *s, size_t curr_region)
 
 static bool tcg_region_alloc__locked(TCGContext *s)
 {
-    if (region.current == region.n) {
-        return true;
+    size_t i;
+
+    if (region.current < region.n) {
+        i = region.current++;
+    } else {
+        /* Reuse a region that was emptied by tcg_region_evict() */
+        for (i = 0; i < region.n; i++) {
+            if (!region.info[i].seq) {
+                break;
+            }
+        }
+        if (i == region.n) {
+            return true;
+        }
     }
-    tcg_region_assign(s, region.current);
-    region.current++;
+    tcg_region_assign(s, i);
+    region.info[i].seq = ++region.seq;
     return false;
 }
 
@@ -376,11 +400,13 @@ bool tcg_region_alloc(TCGContext *s)
     bool err;
     /* read the region size now; alloc__locked will overwrite it on success */
     size_t size_full = s->code_gen_buffer_size;
+    size_t full = tcg_region_index(s->code_gen_buffer);
 
     qemu_mutex_lock(&region.lock);
     err = tcg_region_alloc__locked(s);
     if (!err) {
         region.agg_size_full += size_full - TCG_HIGHWATER;
+        region.info[full].size_full = size_full - TCG_HIGHWATER;
     }
     qemu_mutex_unlock(&region.lock);
     return err;
@@ -412,6 +438,8 @@ void tcg_region_reset_all(void)
     qemu_mutex_lock(&region.lock);
     region.current = 0;
     region.agg_size_full = 0;
+    region.seq = 0;
+    memset(region.info, 0, region.n * sizeof(*region.info));
 
     for (i = 0; i < n_ctxs; i++) {
         TCGContext *s = qatomic_read(&tcg_ctxs[i]);
@@ -422,6 +450,78 @@ void tcg_region_reset_all(void)
     tcg_region_tree_reset_all();
 }
 
+/*
+ * Empty up to @nr of the full regions, oldest first, so that they can be
+ * handed out again.  @func is called for each TB of these regions before
+ * it is dropped; it must make sure that the TB cannot be reached anymore.
+ * Regions in use by a context are never evicted, so nothing can be done
+ * unless there are more regions than contexts; see tcg_n_regions().
+ *
+ * Call from a safe-work context.  Returns the number of evicted regions.
+ */
+size_t tcg_region_evict(size_t nr, GTraverseFunc func, gpointer user_data)
+{
+    unsigned int n_ctxs = qatomic_read(&tcg_cur_ctxs);
+    g_autofree bool *in_use = g_new0(bool, region.n);
+    g_autofree size_t *victims = g_new(size_t, nr);
+    size_t nr_victims = 0;
+    size_t i, j;
+
+    qemu_mutex_lock(&region.lock);
+    for (i = 0; i < n_ctxs; i++) {
+        const TCGContext *s = qatomic_read(&tcg_ctxs[i]);
+
+        in_use[tcg_region_index(s->code_gen_buffer)] = true;
+    }
+
+    while (nr_victims < nr) {
+        size_t oldest = region.n;
+
+        for (i = 0; i < region.n; i++) {
+            if (region.info[i].seq && !in_use[i] &&
+                (oldest == region.n ||
+                 region.info[i].seq < region.info[oldest].seq)) {
+                oldest = i;
+            }
+        }
+        if (oldest == region.n) {
+            break;
+        }
+        victims[nr_victims++] = oldest;
+        in_use[oldest] = true;
+    }
+    qemu_mutex_unlock(&region.lock);
+
+    for (j = 0; j < nr_victims; j++) {
+        struct tcg_region_tree *rt = region_trees + victims[j] * tree_size;
+
+        qemu_mutex_lock(&rt->lock);
+        q_tree_foreach(rt->tree, func, user_data);
+        /* Increment the refcount first so that destroy acts as a reset */
+        q_tree_ref(rt->tree);
+        q_tree_destroy(rt->tree);
+        qemu_mutex_unlock(&rt->lock);
+    }
+
+    qemu_mutex_lock(&region.lock);
+    for (j = 0; j < nr_victims; j++) {
+        struct tcg_region_info *info = &region.info[victims[j]];
+
+        region.agg_size_full -= info->size_full;
+        info->size_full = 0;
+        info->seq = 0;
+    }
+    qemu_mutex_unlock(&region.lock);
+
+    return nr_victims;
+}
+
+/* Returns the number of regions the code buffer is split into. */
+size_t tcg_region_count(void)
+{
+    return region.n;
+}
+
 static size_t tcg_n_regions(size_t tb_size, unsigned max_cpus)
 {
 #ifdef CONFIG_USER_ONLY
@@ -851,6 +951,7 @@ void tcg_region_init(size_t tb_size, int splitwx, unsigned max_cpus)
     }
 
     tcg_region_trees_init();
+    region.info = g_new0(struct tcg_region_info, region.n);
 
     /*
      * Leave the initial context initialized to the first region.
@@ -0,0 +1,746 @@
+/*
+ * Block layer benchmark
+ *
+ * Drives a BlockBackend in-process with fio-like workloads and reports
+ * IOPS, bandwidth, latency percentiles and CPU time per request.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <getopt.h>
+#include <sys/resource.h>
+#include "block/block.h"
+#include "crypto/secret.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qjson.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "qemu/timer.h"
+#include "sysemu/block-backend.h"
+#include "../unit/iothread.h"
+
+typedef enum BenchRW {
+    BENCH_READ,
+    BENCH_WRITE,
+    BENCH_RW,
+    BENCH_RANDREAD,
+    BENCH_RANDWRITE,
+    BENCH_RANDRW,
+    BENCH_RW__MAX,
+} BenchRW;
+
+static const char *const bench_rw_names[BENCH_RW__MAX] = {
+    [BENCH_READ]      = "read",
+    [BENCH_WRITE]     = "write",
+    [BENCH_RW]        = "rw",
+    [BENCH_RANDREAD]  = "randread",
+    [BENCH_RANDWRITE] = "randwrite",
+    [BENCH_RANDRW]    = "randrw",
+};
+
+typedef struct BenchJob {
+    IOThread *iothread; /* NULL if the job runs in the main loop */
+    AioContext *ctx;
+
+    /* Region of the image this job works on */
+    uint64_t start;
+    uint64_t length;
+    uint64_t seq_offset;
+
+    /* Only accessed from ctx */
+    GArray *latencies;
+    uint64_t read_ios;
+    uint64_t write_ios;
+    unsigned int running;
+} QEMU_ALIGNED(64) BenchJob; /* avoid false sharing among threads */
+
+typedef struct BenchWorker {
+    BenchJob *job;
+    uint64_t rng;
+    void *buf;
+} BenchWorker;
+
+static BenchRW rw = BENCH_RANDREAD;
+static const char *format = "raw";
+static const char *protocol = "file";
+static char *filename;
+static char *create_opts;
+static uint64_t img_size = 1 * GiB;
+static uint64_t block_size = 4 * KiB;
+static unsigned int iodepth = 32;
+static unsigned int n_iothreads;
+static unsigned int rwmix_read = 50;
+static unsigned int duration = 10;
+static unsigned int ramp_time;
+static uint64_t seed = 1;
+static bool compress;
+static bool encrypt;
+static bool nocache;
+static bool prefill = true;
+static bool json;
+
+static BlockBackend *blk;
+static BenchJob *jobs;
+static unsigned int n_jobs;
+static unsigned int n_running_jobs;
+static bool measuring;
+static bool stop;
+static int bench_ret;
+
+static int64_t start_ns, end_ns;
+static struct rusage start_usage, end_usage;
+
+static const char commands_string[] =
+    " -w, --rw=MODE           read, write, rw, randread, randwrite or randrw\n"
+    "                         (default: randread)\n"
+    " -M, --rwmix-read=PCT    percentage of reads for rw and randrw\n"
+    "                         (default: 50)\n"
+    " -b, --bs=SIZE           request size (default: 4k)\n"
+    " -q, --iodepth=N         requests in flight per job (default: 32)\n"
+    " -t, --iothreads=N       run one job in each of N iothreads; 0 runs a\n"
+    "                         single job in the main loop (default: 0)\n"
+    " -d, --duration=SECS     measurement time (default: 10)\n"
+    " -r, --ramp=SECS         run before measuring (default: 0)\n"
+    " -f, --format=FMT        raw or qcow2 (default: raw)\n"
+    " -p, --protocol=PROTO    file or null; null only works with raw\n"
+    "                         (default: file)\n"
+    " -F, --filename=PATH     image to create and use (default: a temporary\n"
+    "                         file that is removed afterwards)\n"
+    " -s, --size=SIZE         image size (default: 1G)\n"
+    " -o, --options=OPTS      image creation options, e.g. extended_l2=on\n"
+    " -c, --compress          write compressed clusters (qcow2 only)\n"
+    " -e, --encrypt           use LUKS encryption (qcow2 only)\n"
+    " -n, --nocache           bypass the host page cache\n"
+    " -N, --no-prefill        don't write the image before reading from it\n"
+    " -S, --seed=N            seed for random offsets (default: 1)\n"
+    " -j, --json              print the results as JSON\n";
+
+static void usage_complete(int argc, char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s", commands_string);
+    exit(-1);
+}
+
+static bool rw_is_random(void)
+{
+    return rw == BENCH_RANDREAD || rw == BENCH_RANDWRITE || rw == BENCH_RANDRW;
+}
+
+static bool rw_does_read(void)
+{
+    return rw != BENCH_WRITE && rw != BENCH_RANDWRITE;
+}
+
+/* xorshift64* */
+static uint64_t bench_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+/* splitmix64, to derive independent non-zero seeds for each worker */
+static uint64_t bench_seed(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x ?: 1;
+}
+
+static uint64_t bench_next_offset(BenchWorker *w)
+{
+    BenchJob *job = w->job;
+    uint64_t offset;
+
+    if (rw_is_random()) {
+        offset = (bench_rand(&w->rng) % (job->length / block_size)) *
+                 block_size;
+    } else {
+        offset = job->seq_offset;
+        job->seq_offset += block_size;
+        if (job->seq_offset + block_size > job->length) {
+            job->seq_offset = 0;
+        }
+    }
+
+    return job->start + offset;
+}
+
+static bool bench_next_is_write(BenchWorker *w)
+{
+    switch (rw) {
+    case BENCH_READ:
+    case BENCH_RANDREAD:
+        return false;
+    case BENCH_WRITE:
+    case BENCH_RANDWRITE:
+        return true;
+    default:
+        return bench_rand(&w->rng) % 100 >= rwmix_read;
+    }
+}
+
+static void coroutine_fn bench_worker(void *opaque)
+{
+    BenchWorker *w = opaque;
+    BenchJob *job = w->job;
+    BdrvRequestFlags write_flags = compress ? BDRV_REQ_WRITE_COMPRESSED : 0;
+    QEMUIOVector qiov;
+    int ret;
+
+    qemu_iovec_init_buf(&qiov, w->buf, block_size);
+
+    while (!qatomic_read(&stop)) {
+        uint64_t offset = bench_next_offset(w);
+        bool is_write = bench_next_is_write(w);
+        int64_t t0, lat;
+
+        t0 = get_clock();
+        if (is_write) {
+            ret = blk_co_pwritev(blk, offset, block_size, &qiov, write_flags);
+        } else {
+            ret = blk_co_preadv(blk, offset, block_size, &qiov, 0);
+        }
+        lat = get_clock() - t0;
+
+        if (ret < 0) {
+            error_report("%s at offset %" PRIu64 " failed: %s",
+                         is_write ? "Write" : "Read", offset, strerror(-ret));
+            qatomic_set(&bench_ret, ret);
+            qatomic_set(&stop, true);
+            break;
+        }
+
+        if (qatomic_read(&measuring)) {
+            g_array_append_val(job->latencies, lat);
+            if (is_write) {
+                job->write_ios++;
+            } else {
+                job->read_ios++;
+            }
+        }
+    }
+
+    qemu_vfree(w->buf);
+    g_free(w);
+
+    if (--job->running == 0) {
+        qatomic_dec(&n_running_jobs);
+        aio_wait_kick();
+    }
+}
+
+static void bench_start_measuring(void *opaque)
+{
+    getrusage(RUSAGE_SELF, &start_usage);
+    start_ns = get_clock();
+    qatomic_set(&measuring, true);
+}
+
+static void bench_stop(void *opaque)
+{
+    qatomic_set(&measuring, false);
+    end_ns = get_clock();
+    getrusage(RUSAGE_SELF, &end_usage);
+    qatomic_set(&stop, true);
+}
+
+static Object *bench_create_secret(void)
+{
+    return object_new_with_props(TYPE_QCRYPTO_SECRET,
+                                 object_get_objects_root(),
+                                 "sec0",
+                                 &error_fatal,
+                                 "data", "block-bench",
+                                 NULL);
+}
+
+static void bench_create_image(void)
+{
+    g_autoptr(GString) opts = g_string_new(create_opts);
+    Error *local_err = NULL;
+
+    if (encrypt) {
+        g_string_append_printf(opts, "%sencrypt.format=luks,"
+                               "encrypt.key-secret=sec0,encrypt.iter-time=10",
+                               opts->len ? "," : "");
+    }
+
+    bdrv_img_create(filename, format, NULL, NULL, opts->str, img_size, 0,
+                    true, &local_err);
+    if (local_err) {
+        error_report_err(local_err);
+        exit(1);
+    }
+}
+
+static void bench_open(void)
+{
+    QDict *options = qdict_new();
+    int flags = BDRV_O_RDWR | (nocache ? BDRV_O_NOCACHE : 0);
+    Error *local_err = NULL;
+
+    qdict_put_str(options, "driver", format);
+    if (!strcmp(protocol, "null")) {
+        qdict_put_str(options, "file.driver", "null-co");
+        qdict_put_int(options, "file.size", img_size);
+        qdict_put_str(options, "file.read-zeroes", "on");
+    } else {
+        qdict_put_str(options, "file.driver", "file");
+        qdict_put_str(options, "file.filename", filename);
+    }
+    if (encrypt) {
+        qdict_put_str(options, "encrypt.key-secret", "sec0");
+    }
+
+    blk = blk_new_open(NULL, NULL, options, flags, &local_err);
+    if (!blk) {
+        error_report_err(local_err);
+        exit(1);
+    }
+    blk_set_disable_request_queuing(blk, true);
+}
+
+/*
+ * Write the whole image once so that reads hit allocated clusters and the
+ * benchmark doesn't just measure reading holes.
+ */
+static void bench_prefill(void)
+{
+    uint64_t chunk = MAX(block_size, 1 * MiB);
+    BdrvRequestFlags flags = compress ? BDRV_REQ_WRITE_COMPRESSED : 0;
+    void *buf = blk_blockalign(blk, chunk);
+    uint64_t offset;
+    int ret;
+
+    memset(buf, 0xa5, chunk);
+    for (offset = 0; offset < img_size; offset += chunk) {
+        ret = blk_pwrite(blk, offset, MIN(chunk, img_size - offset), buf,
+                         flags);
+        if (ret < 0) {
+            error_report("Prefilling the image failed: %s", strerror(-ret));
+            exit(1);
+        }
+    }
+    qemu_vfree(buf);
+}
+
+static void bench_run(void)
+{
+    QEMUTimer *ramp_timer = NULL;
+    QEMUTimer *stop_timer;
+    uint64_t region;
+    unsigned int i, j;
+
+    n_jobs = MAX(n_iothreads, 1);
+    jobs = g_new0(BenchJob, n_jobs);
+    region = QEMU_ALIGN_DOWN(img_size / n_jobs, block_size);
+
+    for (i = 0; i < n_jobs; i++) {
+        BenchJob *job = &jobs[i];
+
+        if (n_iothreads) {
+            job->iothread = iothread_new();
+            job->ctx = iothread_get_aio_context(job->iothread);
+        } else {
+            job->ctx = qemu_get_aio_context();
+        }
+        job->start = i * region;
+        job->length = region;
+        job->latencies = g_array_new(false, false, sizeof(int64_t));
+        job->running = iodepth;
+    }
+
+    if (ramp_time) {
+        ramp_timer = aio_timer_new(qemu_get_aio_context(), QEMU_CLOCK_REALTIME,
+                                   SCALE_MS, bench_start_measuring, NULL);
+        timer_mod(ramp_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + ramp_time * 1000);
+    } else {
+        bench_start_measuring(NULL);
+    }
+    stop_timer = aio_timer_new(qemu_get_aio_context(), QEMU_CLOCK_REALTIME,
+                               SCALE_MS, bench_stop, NULL);
+    timer_mod(stop_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                          (ramp_time + duration) * 1000);
+
+    n_running_jobs = n_jobs;
+    for (i = 0; i < n_jobs; i++) {
+        for (j = 0; j < iodepth; j++) {
+            BenchWorker *w = g_new0(BenchWorker, 1);
+
+            w->job = &jobs[i];
+            w->rng = bench_seed(seed ^ ((uint64_t)i << 32 | j));
+            w->buf = blk_blockalign(blk, block_size);
+            memset(w->buf, 0x5a, block_size);
+            aio_co_enter(jobs[i].ctx, qemu_coroutine_create(bench_worker, w));
+        }
+    }
+
+    AIO_WAIT_WHILE_UNLOCKED(NULL, qatomic_read(&n_running_jobs) > 0);
+
+    /* A failed request stops the benchmark before the timer fires */
+    if (!end_ns) {
+        bench_stop(NULL);
+    }
+
+    if (ramp_timer) {
+        timer_free(ramp_timer);
+    }
+    timer_free(stop_timer);
+
+    for (i = 0; i < n_jobs; i++) {
+        if (jobs[i].iothread) {
+            iothread_join(jobs[i].iothread);
+        }
+    }
+}
+
+static gint cmp_latency(gconstpointer a, gconstpointer b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int64_t percentile(GArray *lat, double p)
+{
+    uint64_t i = lat->len * p / 100;
+
+    return g_array_index(lat, int64_t, MIN(i, lat->len - 1));
+}
+
+static int64_t rusage_ns(struct timeval *end, struct timeval *start)
+{
+    return (end->tv_sec - start->tv_sec) * NANOSECONDS_PER_SECOND +
+           (end->tv_usec - start->tv_usec) * 1000;
+}
+
+static void bench_report(void)
+{
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+    g_autoptr(GArray) lat = g_array_new(false, false, sizeof(int64_t));
+    QDict *config = qdict_new();
+    QDict *results = qdict_new();
+    QDict *latency = qdict_new();
+    QDict *report = qdict_new();
+    uint64_t read_ios = 0, write_ios = 0, ios;
+    int64_t elapsed = MAX(end_ns - start_ns, 1);
+    int64_t usr_ns, sys_ns, sum = 0;
+    double secs = (double)elapsed / NANOSECONDS_PER_SECOND;
+    unsigned int i;
+
+    for (i = 0; i < n_jobs; i++) {
+        read_ios += jobs[i].read_ios;
+        write_ios += jobs[i].write_ios;
+        g_array_append_vals(lat, jobs[i].latencies->data,
+                            jobs[i].latencies->len);
+        g_array_free(jobs[i].latencies, true);
+    }
+    ios = read_ios + write_ios;
+    g_array_sort(lat, cmp_latency);
+    for (i = 0; i < lat->len; i++) {
+        sum += g_array_index(lat, int64_t, i);
+    }
+
+    usr_ns = rusage_ns(&end_usage.ru_utime, &start_usage.ru_utime);
+    sys_ns = rusage_ns(&end_usage.ru_stime, &start_usage.ru_stime);
+
+    qdict_put_str(config, "rw", bench_rw_names[rw]);
+    qdict_put_int(config, "rwmix-read", rwmix_read);
+    qdict_put_int(config, "bs", block_size);
+    qdict_put_int(config, "iodepth", iodepth);
+    qdict_put_int(config, "iothreads", n_iothreads);
+    qdict_put_str(config, "format", format);
+    qdict_put_str(config, "protocol", protocol);
+    qdict_put_str(config, "options", create_opts ?: "");
+    qdict_put_bool(config, "compress", compress);
+    qdict_put_bool(config, "encrypt", encrypt);
+    qdict_put_bool(config, "nocache", nocache);
+    qdict_put_int(config, "size", img_size);
+    qdict_put_int(config, "duration", duration);
+    qdict_put_int(config, "seed", seed);
+
+    if (lat->len) {
+        qdict_put_int(latency, "min", g_array_index(lat, int64_t, 0));
+        qdict_put_int(latency, "mean", sum / lat->len);
+        for (i = 0; i < ARRAY_SIZE(percentiles); i++) {
+            g_autofree char *name = g_strdup_printf("p%g", percentiles[i]);
+            qdict_put_int(latency, name, percentile(lat, percentiles[i]));
+        }
+        qdict_put_int(latency, "max",
+                      g_array_index(lat, int64_t, lat->len - 1));
+    }
+
+    qdict_put_int(results, "read-ios", read_ios);
+    qdict_put_int(results, "write-ios", write_ios);
+    qdict_put_int(results, "elapsed-ns", elapsed);
+    qdict_put_int(results, "iops", ios / secs);
+    qdict_put_int(results, "bytes-per-sec", ios * block_size / secs);
+    qdict_put(results, "latency-ns", latency);
+    qdict_put_int(results, "cpu-usr-ns", usr_ns);
+    qdict_put_int(results, "cpu-sys-ns", sys_ns);
+    qdict_put_int(results, "cpu-ns-per-io", ios ? (usr_ns + sys_ns) / ios : 0);
+
+    qdict_put(report, "config", config);
+    qdict_put(report, "results", results);
+
+    if (json) {
+        g_autoptr(GString) str = qobject_to_json(QOBJECT(report));
+        printf("%s\n", str->str);
+    } else {
+        printf("%s: bs=%" PRIu64 " iodepth=%u iothreads=%u format=%s "
+               "protocol=%s%s%s%s%s\n",
+               bench_rw_names[rw], block_size, iodepth, n_iothreads, format,
+               protocol, create_opts ? " options=" : "", create_opts ?: "",
+               compress ? " compress" : "", encrypt ? " encrypt" : "");
+        printf("  ios: read=%" PRIu64 " write=%" PRIu64 " in %.2fs\n",
+               read_ios, write_ios, secs);
+        printf("  iops=%.0f bw=%.2f MiB/s\n",
+               ios / secs, ios * block_size / secs / MiB);
+        if (lat->len) {
+            printf("  lat (us): min=%.1f mean=%.1f",
+                   g_array_index(lat, int64_t, 0) / 1000.0,
+                   sum / lat->len / 1000.0);
+            for (i = 0; i < ARRAY_SIZE(percentiles); i++) {
+                printf(" p%g=%.1f", percentiles[i],
+                       percentile(lat, percentiles[i]) / 1000.0);
+            }
+            printf(" max=%.1f\n",
+                   g_array_index(lat, int64_t, lat->len - 1) / 1000.0);
+        }
+        printf("  cpu: usr=%.2fs sys=%.2fs, %" PRId64 " ns per I/O\n",
+               (double)usr_ns / NANOSECONDS_PER_SECOND,
+               (double)sys_ns / NANOSECONDS_PER_SECOND,
+               ios ? (usr_ns + sys_ns) / (int64_t)ios : 0);
+    }
+
+    qobject_unref(report);
+}
+
+static uint64_t parse_size(const char *arg, const char *name)
+{
+    uint64_t val;
+
+    if (qemu_strtosz(arg, NULL, &val) < 0 || !val) {
+        error_report("Invalid %s '%s'", name, arg);
+        exit(1);
+    }
+    return val;
+}
+
+static unsigned int parse_uint(const char *arg, const char *name)
+{
+    unsigned int val;
+
+    if (qemu_strtoui(arg, NULL, 0, &val) < 0) {
+        error_report("Invalid %s '%s'", name, arg);
+        exit(1);
+    }
+    return val;
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        { "rw", required_argument, NULL, 'w' },
+        { "rwmix-read", required_argument, NULL, 'M' },
+        { "bs", required_argument, NULL, 'b' },
+        { "iodepth", required_argument, NULL, 'q' },
+        { "iothreads", required_argument, NULL, 't' },
+        { "duration", required_argument, NULL, 'd' },
+        { "ramp", required_argument, NULL, 'r' },
+        { "format", required_argument, NULL, 'f' },
+        { "protocol", required_argument, NULL, 'p' },
+        { "filename", required_argument, NULL, 'F' },
+        { "size", required_argument, NULL, 's' },
+        { "options", required_argument, NULL, 'o' },
+        { "compress", no_argument, NULL, 'c' },
+        { "encrypt", no_argument, NULL, 'e' },
+        { "nocache", no_argument, NULL, 'n' },
+        { "no-prefill", no_argument, NULL, 'N' },
+        { "seed", required_argument, NULL, 'S' },
+        { "json", no_argument, NULL, 'j' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c, i;
+
+    for (;;) {
+        c = getopt_long(argc, argv, "w:M:b:q:t:d:r:f:p:F:s:o:ceNnS:jh",
+                        long_options, NULL);
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'w':
+            for (i = 0; i < BENCH_RW__MAX; i++) {
+                if (!strcmp(optarg, bench_rw_names[i])) {
+                    break;
+                }
+            }
+            if (i == BENCH_RW__MAX) {
+                error_report("Invalid workload '%s'", optarg);
+                exit(1);
+            }
+            rw = i;
+            break;
+        case 'M':
+            rwmix_read = parse_uint(optarg, "read percentage");
+            if (rwmix_read > 100) {
+                error_report("Read percentage must be at most 100");
+                exit(1);
+            }
+            break;
+        case 'b':
+            block_size = parse_size(optarg, "request size");
+            break;
+        case 'q':
+            iodepth = parse_uint(optarg, "queue depth");
+            break;
+        case 't':
+            n_iothreads = parse_uint(optarg, "number of iothreads");
+            break;
+        case 'd':
+            duration = parse_uint(optarg, "duration");
+            break;
+        case 'r':
+            ramp_time = parse_uint(optarg, "ramp time");
+            break;
+        case 'f':
+            format = optarg;
+            break;
+        case 'p':
+            protocol = optarg;
+            break;
+        case 'F':
+            filename = g_strdup(optarg);
+            break;
+        case 's':
+            img_size = parse_size(optarg, "image size");
+            break;
+        case 'o':
+            create_opts = optarg;
+            break;
+        case 'c':
+            compress = true;
+            break;
+        case 'e':
+            encrypt = true;
+            break;
+        case 'n':
+            nocache = true;
+            break;
+        case 'N':
+            prefill = false;
+            break;
+        case 'S':
+            if (qemu_strtou64(optarg, NULL, 0, &seed) < 0) {
+                error_report("Invalid seed '%s'", optarg);
+                exit(1);
+            }
+            break;
+        case 'j':
+            json = true;
+            break;
+        case 'h':
+        default:
+            usage_complete(argc, argv);
+        }
+    }
+
+    if (strcmp(format, "raw") && strcmp(format, "qcow2")) {
+        error_report("Unsupported format '%s'", format);
+        exit(1);
+    }
+    if (strcmp(protocol, "file") && strcmp(protocol, "null")) {
+        error_report("Unsupported protocol '%s'", protocol);
+        exit(1);
+    }
+    if (!strcmp(protocol, "null") &&
+        (strcmp(format, "raw") || create_opts || filename)) {
+        error_report("The null protocol only works with raw and without an "
+                     "image file");
+        exit(1);
+    }
+    if ((compress || encrypt) && strcmp(format, "qcow2")) {
+        error_report("Compression and encryption need the qcow2 format");
+        exit(1);
+    }
+    if (!iodepth || !duration) {
+        error_report("Queue depth and duration must not be 0");
+        exit(1);
+    }
+    if (img_size / MAX(n_iothreads, 1) < block_size) {
+        error_report("The image is too small for the request size");
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    bool remove_image = false;
+    Object *secret = NULL;
+
+    parse_args(argc, argv);
+
+    module_call_init(MODULE_INIT_QOM);
+    bdrv_init();
+    qemu_init_main_loop(&error_fatal);
+
+    if (encrypt) {
+        secret = bench_create_secret();
+    }
+
+    if (!strcmp(protocol, "file")) {
+        if (!filename) {
+            int fd = g_file_open_tmp("block-bench-XXXXXX", &filename, NULL);
+
+            if (fd < 0) {
+                error_report("Could not create a temporary image file");
+                exit(1);
+            }
+            close(fd);
+            remove_image = true;
+        }
+        bench_create_image();
+    }
+
+    bench_open();
+    if (prefill && rw_does_read() && !strcmp(protocol, "file")) {
+        bench_prefill();
+    }
+
+    bench_run();
+    /* A request that failed during ramp-up leaves nothing to report */
+    if (start_ns) {
+        bench_report();
+    } else {
+        error_report("The benchmark failed before measuring started");
+    }
+
+    blk_unref(blk);
+    if (remove_image) {
+        unlink(filename);
+    }
+    if (secret) {
+        object_unparent(secret);
+    }
+    g_free(filename);
+    g_free(jobs);
+
+    return bench_ret < 0 ? 1 : 0;
+}
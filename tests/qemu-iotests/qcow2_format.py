@@ -282,7 +282,9 @@ class Magic(Enum):
             0x6803f857: 'Feature table',
             0x0537be77: 'Crypto header',
             QCOW2_EXT_MAGIC_BITMAPS: 'Bitmaps',
-            0x44415441: 'Data file'
+            0x44415441: 'Data file',
+            0x636d7072: 'Compression parameters',
+            0x6578746d: 'Extent map'
         }
 
         def to_json(self):
@@ -14,6 +14,7 @@
 
 #include "libqtest.h"
 #include "qapi/qmp/qdict.h"
+#include "qemu/memfd.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
@@ -598,6 +599,8 @@ typedef struct {
      */
     bool hide_stderr;
     bool use_shmem;
+    /* Like use_shmem, but with a memfd instead of a file in /dev/shm */
+    bool use_memfd;
     /* only launch the target process */
     bool only_target;
     /* Use dirty ring if true; dirty logging otherwise */
@@ -731,6 +734,10 @@ static int test_migrate_start(QTestState **from, QTestState **to,
             return -1;
         }
     }
+    if (args->use_memfd && !qemu_memfd_check(0)) {
+        g_test_skip("memfd is not supported");
+        return -1;
+    }
 
     dst_state = (QTestMigrationState) { };
     src_state = (QTestMigrationState) { };
@@ -797,6 +804,10 @@ static int test_migrate_start(QTestState **from, QTestState **to,
             "-object memory-backend-file,id=mem0,size=%s"
             ",mem-path=%s,share=on -numa node,memdev=mem0",
             memory_size, shmem_path);
+    } else if (args->use_memfd) {
+        shmem_opts = g_strdup_printf(
+            "-object memory-backend-memfd,id=mem0,size=%s,share=on "
+            "-numa node,memdev=mem0", memory_size);
     }
 
     if (args->use_dirty_ring) {
@@ -1993,6 +2004,35 @@ static void test_precopy_unix_plain(void)
     test_precopy_common(&args);
 }
 
+static void test_precopy_unix_independent_devices(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    g_autofree char *opts = NULL;
+    const char *dev = g_str_equal(qtest_get_arch(), "s390x") ?
+                      "virtio-net-ccw" : "virtio-net-pci";
+    MigrateCommon args = {
+        .listen_uri = uri,
+        .connect_uri = uri,
+        .live = true,
+    };
+
+    if (!qtest_has_device(dev)) {
+        g_test_skip("virtio-net not available");
+        return;
+    }
+
+    /*
+     * virtio-net is marked independent, so with several NICs their state
+     * is saved in parallel by the worker threads.
+     */
+    opts = g_strdup_printf("-device %s,id=nic0 -device %s,id=nic1 "
+                           "-device %s,id=nic2", dev, dev, dev);
+    args.start.opts_source = opts;
+    args.start.opts_target = opts;
+
+    test_precopy_common(&args);
+}
+
 static void test_precopy_unix_suspend_live(void)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -2253,6 +2293,34 @@ static void *test_mode_reboot_start(QTestState *from, QTestState *to)
     return NULL;
 }
 
+static void *test_mode_transfer_start(QTestState *from, QTestState *to)
+{
+    migrate_set_parameter_str(from, "mode", "cpr-transfer");
+    migrate_set_parameter_str(to, "mode", "cpr-transfer");
+
+    return NULL;
+}
+
+static void test_mode_transfer(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        /*
+         * The destination gets the RAM fds from the source, so unlike for
+         * cpr-reboot, the guest RAM doesn't need to be in a file that both
+         * can open.  A memfd doesn't depend on the size of /dev/shm, which
+         * is what makes the shmem tests fail in CI.
+         */
+        .start.use_memfd = true,
+        .listen_uri = uri,
+        .connect_uri = uri,
+        .start_hook = test_mode_transfer_start,
+        .live = true,
+    };
+
+    test_precopy_common(&args);
+}
+
 static void *migrate_mapped_ram_start(QTestState *from, QTestState *to)
 {
     migrate_set_capability(from, "mapped-ram", true);
@@ -2301,6 +2369,36 @@ static void test_precopy_file_mapped_ram(void)
     test_file_common(&args, true);
 }
 
+static void *migrate_mapped_ram_incremental_start(QTestState *from,
+                                                  QTestState *to)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+
+    migrate_mapped_ram_start(from, to);
+    migrate_set_capability(from, "mapped-ram-incremental", true);
+
+    /* Take a first checkpoint, the test then only saves what changed */
+    migrate_qmp(from, to, uri, NULL, "{}");
+    wait_for_migration_complete(from);
+    qtest_qmp_assert_success(from, "{ 'execute' : 'cont'}");
+
+    return NULL;
+}
+
+static void test_precopy_file_mapped_ram_incremental(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = migrate_mapped_ram_incremental_start,
+    };
+
+    test_file_common(&args, false);
+}
+
 static void *migrate_multifd_mapped_ram_start(QTestState *from, QTestState *to)
 {
     migrate_mapped_ram_start(from, to);
@@ -2489,6 +2587,26 @@ static void test_precopy_tcp_switchover_ack(void)
     test_precopy_common(&args);
 }
 
+static void *test_migrate_defer_hot_pages_start(QTestState *from,
+                                                QTestState *to)
+{
+    migrate_set_capability(from, "defer-hot-pages", true);
+
+    return NULL;
+}
+
+static void test_precopy_tcp_defer_hot_pages(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "tcp:127.0.0.1:0",
+        .start_hook = test_migrate_defer_hot_pages_start,
+        /* The guest has to dirty its RAM for pages to get hot */
+        .live = true,
+    };
+
+    test_precopy_common(&args);
+}
+
 #ifdef CONFIG_GNUTLS
 static void test_precopy_tcp_tls_psk_match(void)
 {
@@ -2966,6 +3084,15 @@ test_migration_precopy_tcp_multifd_start_no_zero_page(QTestState *from,
     return NULL;
 }
 
+static void *
+test_migrate_precopy_tcp_multifd_page_ownership_start(QTestState *from,
+                                                      QTestState *to)
+{
+    test_migrate_precopy_tcp_multifd_start_common(from, to, "none");
+    migrate_set_capability(from, "multifd-page-ownership", true);
+    return NULL;
+}
+
 static void *
 test_migrate_precopy_tcp_multifd_zlib_start(QTestState *from,
                                             QTestState *to)
@@ -2992,6 +3119,15 @@ test_migrate_precopy_tcp_multifd_zstd_start(QTestState *from,
 }
 #endif /* CONFIG_ZSTD */
 
+#ifdef CONFIG_LZ4
+static void *
+test_migrate_precopy_tcp_multifd_lz4_start(QTestState *from,
+                                           QTestState *to)
+{
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "lz4");
+}
+#endif /* CONFIG_LZ4 */
+
 #ifdef CONFIG_QPL
 static void *
 test_migrate_precopy_tcp_multifd_qpl_start(QTestState *from,
@@ -3054,6 +3190,39 @@ static void test_multifd_tcp_no_zero_page(void)
     test_precopy_common(&args);
 }
 
+static void test_multifd_tcp_page_ownership(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_page_ownership_start,
+        /*
+         * With the default clear bitmap shift, each clear bitmap chunk is
+         * shared by all channels, and the few MB of guest RAM that the
+         * test dirties are still spread over all of them.
+         */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
+static void test_multifd_tcp_dirty_sync_chunks(void)
+{
+    MigrateCommon args = {
+        .start = {
+            /*
+             * The dirty bitmap is synchronized by the multifd threads only
+             * if there is more than one chunk.  The default chunk is 1G,
+             * more than the guest has, so use 256K chunks.
+             */
+            .opts_source = "-global migration.x-dirty-sync-chunk-shift=6",
+        },
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_start,
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
 static void test_multifd_tcp_channels_none(void)
 {
     MigrateCommon args = {
@@ -3089,6 +3258,17 @@ static void test_multifd_tcp_zstd(void)
 }
 #endif
 
+#ifdef CONFIG_LZ4
+static void test_multifd_tcp_lz4(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_lz4_start,
+    };
+    test_precopy_common(&args);
+}
+#endif
+
 #ifdef CONFIG_QPL
 static void test_multifd_tcp_qpl(void)
 {
@@ -3850,6 +4030,8 @@ int main(int argc, char **argv)
 
     migration_test_add("/migration/precopy/unix/plain",
                        test_precopy_unix_plain);
+    migration_test_add("/migration/precopy/unix/independent-devices",
+                       test_precopy_unix_independent_devices);
     migration_test_add("/migration/precopy/unix/xbzrle",
                        test_precopy_unix_xbzrle);
     migration_test_add("/migration/precopy/file",
@@ -3870,11 +4052,14 @@ int main(int argc, char **argv)
     if (getenv("QEMU_TEST_FLAKY_TESTS")) {
         migration_test_add("/migration/mode/reboot", test_mode_reboot);
     }
+    migration_test_add("/migration/mode/transfer", test_mode_transfer);
 
     migration_test_add("/migration/precopy/file/mapped-ram",
                        test_precopy_file_mapped_ram);
     migration_test_add("/migration/precopy/file/mapped-ram/live",
                        test_precopy_file_mapped_ram_live);
+    migration_test_add("/migration/precopy/file/mapped-ram/incremental",
+                       test_precopy_file_mapped_ram_incremental);
 
     migration_test_add("/migration/multifd/file/mapped-ram",
                        test_multifd_file_mapped_ram);
@@ -3922,6 +4107,8 @@ int main(int argc, char **argv)
 
     migration_test_add("/migration/precopy/tcp/plain/switchover-ack",
                        test_precopy_tcp_switchover_ack);
+    migration_test_add("/migration/precopy/tcp/plain/defer-hot-pages",
+                       test_precopy_tcp_defer_hot_pages);
 
 #ifdef CONFIG_GNUTLS
     migration_test_add("/migration/precopy/tcp/tls/psk/match",
@@ -3984,6 +4171,10 @@ int main(int argc, char **argv)
                        test_multifd_tcp_zero_page_legacy);
     migration_test_add("/migration/multifd/tcp/plain/zero-page/none",
                        test_multifd_tcp_no_zero_page);
+    migration_test_add("/migration/multifd/tcp/plain/page-ownership",
+                       test_multifd_tcp_page_ownership);
+    migration_test_add("/migration/multifd/tcp/plain/dirty-sync-chunks",
+                       test_multifd_tcp_dirty_sync_chunks);
     migration_test_add("/migration/multifd/tcp/plain/cancel",
                        test_multifd_tcp_cancel);
     migration_test_add("/migration/multifd/tcp/plain/zlib",
@@ -3992,6 +4183,10 @@ int main(int argc, char **argv)
     migration_test_add("/migration/multifd/tcp/plain/zstd",
                        test_multifd_tcp_zstd);
 #endif
+#ifdef CONFIG_LZ4
+    migration_test_add("/migration/multifd/tcp/plain/lz4",
+                       test_multifd_tcp_lz4);
+#endif
 #ifdef CONFIG_QPL
     migration_test_add("/migration/multifd/tcp/plain/qpl",
                        test_multifd_tcp_qpl);
@@ -0,0 +1,120 @@
+/*
+ * QTest testcase for the eviction of translation cache regions
+ *
+ * Copyright (c) 2026 The QEMU Project Developers
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+
+/*
+ * x86 boot sector that keeps rewriting the immediate of one of its own
+ * instructions.  Every store invalidates the block being executed, so
+ * the code generation buffer fills up with dead translations.
+ */
+static const uint8_t smc_boot_sector[512] = {
+    /* 7c00: xor %ax,%ax */
+    [0x00] = 0x31,
+    [0x01] = 0xc0,
+    /* 7c02: mov %ax,%ds */
+    [0x02] = 0x8e,
+    [0x03] = 0xd8,
+    /* 7c04: mov %ax,0x7c09 */
+    [0x04] = 0xa3,
+    [0x05] = 0x09,
+    [0x06] = 0x7c,
+    /* 7c07: inc %ax */
+    [0x07] = 0x40,
+    /* 7c08: mov $0,%bx */
+    [0x08] = 0xbb,
+    [0x09] = 0x00,
+    [0x0a] = 0x00,
+    /* 7c0b: jmp 0x7c04 */
+    [0x0b] = 0xeb,
+    [0x0c] = 0xf7,
+    /* End of boot sector marker */
+    [0x1fe] = 0x55,
+    [0x1ff] = 0xaa,
+};
+
+static unsigned int jit_counter(QTestState *qts, const char *name)
+{
+    g_autofree char *info = qtest_hmp(qts, "info jit");
+    const char *p = strstr(info, name);
+
+    g_assert(p);
+    return strtoul(p + strlen(name), NULL, 10);
+}
+
+/*
+ * Run the boot sector until the code generation buffer has been
+ * recycled once, then check which way it was done.
+ */
+static void test_recycle(const char *accel_opts, int smp, bool evict)
+{
+    g_autofree char *disk = NULL;
+    QTestState *qts;
+    unsigned int flushes, evictions;
+    gint64 deadline;
+    int fd;
+
+    fd = g_file_open_tmp("qtest-tcg-evict.XXXXXX", &disk, NULL);
+    g_assert(fd >= 0);
+    g_assert_cmpint(write(fd, smc_boot_sector, sizeof(smc_boot_sector)), ==,
+                    sizeof(smc_boot_sector));
+    close(fd);
+
+    qts = qtest_initf("-machine pc -accel tcg,%s -smp %d "
+                      "-drive file=%s,format=raw,if=ide",
+                      accel_opts, smp, disk);
+
+    deadline = g_get_monotonic_time() + 30 * G_USEC_PER_SEC;
+    do {
+        g_usleep(100 * 1000);
+        flushes = jit_counter(qts, "TB flush count");
+        evictions = jit_counter(qts, "TB eviction count");
+    } while (!flushes && !evictions && g_get_monotonic_time() < deadline);
+
+    if (evict) {
+        g_assert_cmpuint(evictions, >, 0);
+        g_assert_cmpuint(flushes, ==, 0);
+    } else {
+        g_assert_cmpuint(flushes, >, 0);
+        g_assert_cmpuint(evictions, ==, 0);
+    }
+
+    qtest_quit(qts);
+    unlink(disk);
+}
+
+/*
+ * With MTTCG, 8 MiB and two vCPUs give four regions of 2 MiB, two of
+ * which are not held by a vCPU thread and can be evicted.
+ */
+static void test_evict_mttcg(void)
+{
+    test_recycle("thread=multi,tb-size=8", 2, true);
+}
+
+/* A single-threaded TCG has a single region: tb_flush() is the only way */
+static void test_flush_single_thread(void)
+{
+    test_recycle("thread=single,tb-size=1", 2, false);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    if (!qtest_has_accel("tcg")) {
+        g_test_skip("TCG is not available");
+        return g_test_run();
+    }
+
+    qtest_add_func("/tcg/evict/mttcg", test_evict_mttcg);
+    qtest_add_func("/tcg/evict/single-thread", test_flush_single_thread);
+
+    return g_test_run();
+}
@@ -0,0 +1,36 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0-or-later
+#
+# Check the "-d in_asm,op_opt" log of dead-env-store for the stores to
+# env->df that the optimizer should have removed, and the ones it must keep.
+
+log="$1"
+
+# Print how many ops of the TB starting at function $1 contain $2.  The
+# "IN:" line of a TB comes before its "OP after optimization" block, which
+# ends at the next "IN:" line or at the end of the log.
+count_ops()
+{
+    awk -v fn="$1" -v pat="$2" '
+        function done() {
+            if (tb == fn && ops && !found) { found = 1; print n; exit }
+        }
+        /^IN: / { done(); tb = $2; ops = 0; n = 0; next }
+        /^OP after optimization/ { ops = 1; next }
+        ops && index($0, pat) { n++ }
+        END { done() }
+    ' "$log"
+}
+
+check()
+{
+    n=$(count_ops "$1" "$2")
+    if [ "$n" != "$3" ]; then
+        echo "$1: expected $3 ops with '$2', found ${n:-no TB}" >&2
+        exit 1
+    fi
+}
+
+check std_cld_flags 'st_i32 $0xffffffff,env' 0
+check cld_std_flags 'st_i32 $0x1,env' 1
+check std_lodsb_cld 'st_i32 $0xffffffff,env' 1
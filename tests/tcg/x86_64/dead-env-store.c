@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * std and cld store the direction flag to env explicitly, so one of them
+ * followed by the other in the same TB is a dead store that the optimizer
+ * removes.  Check that the direction flag still ends up right;
+ * check-dead-env-store.sh checks that the stores were actually removed.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+
+#define DF (1 << 10)
+
+/* The std is dead, returns RFLAGS */
+uint64_t std_cld_flags(void);
+/* The first cld is dead, returns RFLAGS with DF set */
+uint64_t cld_std_flags(void);
+/* lodsb reads the direction flag, so the std stays; returns the new RSI */
+const uint8_t *std_lodsb_cld(const uint8_t *p);
+
+asm(".text\n"
+    ".globl std_cld_flags\n"
+    "std_cld_flags:\n\t"
+    "std\n\t"
+    "cld\n\t"
+    "pushfq\n\t"
+    "popq %rax\n\t"
+    "ret\n"
+    ".globl cld_std_flags\n"
+    "cld_std_flags:\n\t"
+    "cld\n\t"
+    "std\n\t"
+    "pushfq\n\t"
+    "popq %rax\n\t"
+    "cld\n\t"
+    "ret\n"
+    ".globl std_lodsb_cld\n"
+    "std_lodsb_cld:\n\t"
+    "movq %rdi, %rsi\n\t"
+    "std\n\t"
+    "lodsb\n\t"
+    "cld\n\t"
+    "movq %rsi, %rax\n\t"
+    "ret\n");
+
+int main(void)
+{
+    static const uint8_t buf[2];
+
+    assert(!(std_cld_flags() & DF));
+    assert(cld_std_flags() & DF);
+    assert(std_lodsb_cld(&buf[1]) == &buf[0]);
+    return 0;
+}
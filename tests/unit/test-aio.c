@@ -825,6 +825,133 @@ static void test_worker_thread_co_enter(void)
     g_assert(!aio_poll(ctx, false));
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * aio_add_sqe() must be called from the AioContext home thread, so these
+ * tests run in a thread that makes a fresh AioContext its current one.
+ */
+typedef struct {
+    CqeHandler cqe_handler;
+    int n;
+    int res;
+    bool resubmitted;
+} SqeTestData;
+
+static void sqe_test_cb(CqeHandler *cqe_handler)
+{
+    SqeTestData *data = container_of(cqe_handler, SqeTestData, cqe_handler);
+
+    data->res = cqe_handler->cqe.res;
+    data->n++;
+}
+
+static void *test_add_sqe_thread(void *opaque)
+{
+    bool *skipped = opaque;
+    AioContext *sqe_ctx = aio_context_new(&error_abort);
+    SqeTestData data = { .cqe_handler.cb = sqe_test_cb };
+    struct io_uring_sqe sqe = {};
+    char buf[8] = {};
+    int fds[2];
+
+    qemu_set_current_aio_context(sqe_ctx);
+    g_assert(g_unix_open_pipe(fds, FD_CLOEXEC, NULL));
+
+    g_assert_cmpint(write(fds[1], "qemu", 4), ==, 4);
+    io_uring_prep_read(&sqe, fds[0], buf, sizeof(buf), 0);
+    if (!aio_add_sqe(sqe_ctx, &sqe, &data.cqe_handler)) {
+        *skipped = true;
+        goto out;
+    }
+
+    /* Not submitted before the next aio_poll() */
+    g_assert_cmpint(data.n, ==, 0);
+    while (data.n == 0) {
+        aio_poll(sqe_ctx, true);
+    }
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(data.res, ==, 4);
+    g_assert_cmpstr(buf, ==, "qemu");
+    g_assert(!aio_poll(sqe_ctx, false));
+
+out:
+    close(fds[0]);
+    close(fds[1]);
+    aio_context_unref(sqe_ctx);
+    return NULL;
+}
+
+static void test_add_sqe(void)
+{
+    QemuThread thread;
+    bool skipped = false;
+
+    qemu_thread_create(&thread, "test_add_sqe", test_add_sqe_thread,
+                       &skipped, QEMU_THREAD_JOINABLE);
+    qemu_thread_join(&thread);
+    if (skipped) {
+        g_test_skip("AioContext does not monitor fds with io_uring");
+    }
+}
+
+static void sqe_resubmit_cb(CqeHandler *cqe_handler)
+{
+    SqeTestData *data = container_of(cqe_handler, SqeTestData, cqe_handler);
+    struct io_uring_sqe sqe = {};
+
+    sqe_test_cb(cqe_handler);
+
+    /* The ring is going away, so new requests must be refused */
+    io_uring_prep_nop(&sqe);
+    data->resubmitted = aio_add_sqe(qemu_get_current_aio_context(), &sqe,
+                                    cqe_handler);
+}
+
+static void *test_add_sqe_teardown_thread(void *opaque)
+{
+    bool *skipped = opaque;
+    AioContext *sqe_ctx = aio_context_new(&error_abort);
+    SqeTestData data = { .cqe_handler.cb = sqe_resubmit_cb };
+    struct __kernel_timespec ts = { .tv_nsec = 10 * SCALE_MS };
+    struct io_uring_sqe sqe = {};
+
+    qemu_set_current_aio_context(sqe_ctx);
+
+    io_uring_prep_timeout(&sqe, &ts, 0, 0);
+    if (!aio_add_sqe(sqe_ctx, &sqe, &data.cqe_handler)) {
+        *skipped = true;
+        goto out;
+    }
+
+    /* Submit the request, it cannot have completed yet */
+    aio_poll(sqe_ctx, false);
+    g_assert_cmpint(data.n, ==, 0);
+
+    /* Switching away from io_uring must complete in-flight requests */
+    aio_context_use_g_source(sqe_ctx);
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(data.res, ==, -ETIME);
+    g_assert(!data.resubmitted);
+
+out:
+    aio_context_unref(sqe_ctx);
+    return NULL;
+}
+
+static void test_add_sqe_teardown(void)
+{
+    QemuThread thread;
+    bool skipped = false;
+
+    qemu_thread_create(&thread, "test_add_sqe", test_add_sqe_teardown_thread,
+                       &skipped, QEMU_THREAD_JOINABLE);
+    qemu_thread_join(&thread);
+    if (skipped) {
+        g_test_skip("AioContext does not monitor fds with io_uring");
+    }
+}
+#endif
+
 /* End of tests.  */
 
 int main(int argc, char **argv)
@@ -850,6 +977,10 @@ int main(int argc, char **argv)
 
     g_test_add_func("/aio/coroutine/queue-chaining", test_queue_chaining);
     g_test_add_func("/aio/coroutine/worker-thread-co-enter", test_worker_thread_co_enter);
+#ifdef CONFIG_LINUX_IO_URING
+    g_test_add_func("/aio/io_uring/add-sqe",          test_add_sqe);
+    g_test_add_func("/aio/io_uring/add-sqe/teardown", test_add_sqe_teardown);
+#endif
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
     g_test_add_func("/aio-gsource/bh/schedule",             test_source_bh_schedule);
@@ -173,6 +173,57 @@ static void test_encode_decode(void)
     }
 }
 
+/*
+ * All encoders must produce the same output, including for lengths that
+ * aren't a multiple of the vector size.  Switches to the slowest encoder,
+ * so this has to be the last test.
+ */
+static void test_encode_accel(void)
+{
+    static const int slen[] = { XBZRLE_PAGE_SIZE, XBZRLE_PAGE_SIZE - 8 };
+    uint8_t *old_buf = g_malloc0(XBZRLE_PAGE_SIZE);
+    uint8_t *new_buf = g_malloc0(XBZRLE_PAGE_SIZE);
+    uint8_t *compressed = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *expected[ARRAY_SIZE(slen)];
+    int expected_dlen[ARRAY_SIZE(slen)];
+    bool first = true;
+    int i, j, pos, dlen;
+
+    for (i = 0; i < 32; i++) {
+        pos = g_test_rand_int_range(0, XBZRLE_PAGE_SIZE);
+        memset(new_buf + pos, i + 1,
+               g_test_rand_int_range(1, MIN(XBZRLE_PAGE_SIZE - pos, 64) + 1));
+    }
+
+    do {
+        for (j = 0; j < ARRAY_SIZE(slen); j++) {
+            dlen = xbzrle_encode_buffer(old_buf, new_buf, slen[j],
+                                        compressed, XBZRLE_PAGE_SIZE);
+            g_assert(dlen > 0);
+            if (first) {
+                expected[j] = g_memdup2(compressed, dlen);
+                expected_dlen[j] = dlen;
+            } else {
+                g_assert(dlen == expected_dlen[j]);
+                g_assert(memcmp(compressed, expected[j], dlen) == 0);
+            }
+        }
+        first = false;
+    } while (test_xbzrle_next_accel());
+
+    for (j = 0; j < ARRAY_SIZE(slen); j++) {
+        memset(old_buf, 0, XBZRLE_PAGE_SIZE);
+        g_assert(xbzrle_decode_buffer(expected[j], expected_dlen[j],
+                                      old_buf, slen[j]) > 0);
+        g_assert(memcmp(old_buf, new_buf, slen[j]) == 0);
+        g_free(expected[j]);
+    }
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -185,6 +236,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
@@ -722,6 +722,10 @@ bool aio_poll(AioContext *ctx, bool blocking)
     progress |= aio_bh_poll(ctx);
     progress |= aio_dispatch_ready_handlers(ctx, &ready_list);
 
+    if (ctx->fdmon_ops->dispatch) {
+        progress |= ctx->fdmon_ops->dispatch(ctx);
+    }
+
     aio_free_deleted_handlers(ctx);
 
     qemu_lockcnt_dec(&ctx->list_lock);
@@ -787,3 +791,22 @@ void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch)
 
     aio_notify(ctx);
 }
+
+bool aio_context_set_io_uring_sqpoll(AioContext *ctx, int sq_thread_cpu,
+                                     Error **errp)
+{
+    return fdmon_io_uring_setup_sqpoll(ctx, sq_thread_cpu, errp);
+}
+
+#ifdef CONFIG_LINUX_IO_URING
+bool aio_add_sqe(AioContext *ctx, const struct io_uring_sqe *sqe,
+                 CqeHandler *cqe_handler)
+{
+    assert(in_aio_context_home_thread(ctx));
+
+    if (!ctx->fdmon_ops->add_sqe) {
+        return false;
+    }
+    return ctx->fdmon_ops->add_sqe(ctx, sqe, cqe_handler);
+}
+#endif
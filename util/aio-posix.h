@@ -18,6 +18,7 @@
 #define AIO_POSIX_H
 
 #include "block/aio.h"
+#include "qapi/error.h"
 
 struct AioHandler {
     GPollFD pfd;
@@ -67,6 +68,8 @@ static inline void fdmon_epoll_disable(AioContext *ctx)
 
 #ifdef CONFIG_LINUX_IO_URING
 bool fdmon_io_uring_setup(AioContext *ctx);
+bool fdmon_io_uring_setup_sqpoll(AioContext *ctx, int sq_thread_cpu,
+                                 Error **errp);
 void fdmon_io_uring_destroy(AioContext *ctx);
 #else
 static inline bool fdmon_io_uring_setup(AioContext *ctx)
@@ -74,6 +77,14 @@ static inline bool fdmon_io_uring_setup(AioContext *ctx)
     return false;
 }
 
+static inline bool fdmon_io_uring_setup_sqpoll(AioContext *ctx,
+                                               int sq_thread_cpu,
+                                               Error **errp)
+{
+    error_setg(errp, "io_uring is not supported in this build");
+    return false;
+}
+
 static inline void fdmon_io_uring_destroy(AioContext *ctx)
 {
 }
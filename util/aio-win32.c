@@ -441,3 +441,10 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
 void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch)
 {
 }
+
+bool aio_context_set_io_uring_sqpoll(AioContext *ctx, int sq_thread_cpu,
+                                     Error **errp)
+{
+    error_setg(errp, "io_uring is not supported on this platform");
+    return false;
+}
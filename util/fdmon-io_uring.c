@@ -19,9 +19,11 @@
  * 4. Nanosecond timeouts are supported so it requires fewer syscalls than
  *    epoll(7).
  *
- * This code only monitors file descriptors and does not do asynchronous disk
- * I/O.  Implementing disk I/O efficiently has other requirements and should
- * use a separate io_uring so it does not make sense to unify the code.
+ * Other io_uring requests, such as disk I/O from block/io_uring.c, can share
+ * the ring through aio_add_sqe().  Their user_data points to a CqeHandler,
+ * tagged with FDMON_IO_URING_CQE_HANDLER to tell them apart from AioHandlers.
+ * Completions of both kinds are then reaped by a single io_uring_enter(2) and
+ * CqeHandler callbacks run from aio_poll() via fdmon_io_uring_dispatch().
  *
  * File descriptor monitoring is implemented using the following operations:
  *
@@ -41,10 +43,16 @@
  * fdmon_io_uring_wait().  Changes to AioHandlers are made by enqueuing them on
  * ctx->submit_list so that fdmon_io_uring_wait() can submit IORING_OP_POLL_ADD
  * and/or IORING_OP_POLL_REMOVE sqes for them.
+ *
+ * Optionally the ring is created with IORING_SETUP_SQPOLL.  A kernel thread
+ * then consumes the sq ring so submission does not need io_uring_enter(2)
+ * unless that thread went idle.  SQPOLL rings that request the same CPU for
+ * the kernel thread share it via IORING_SETUP_ATTACH_WQ.
  */
 
 #include "qemu/osdep.h"
 #include <poll.h>
+#include "qemu/lockable.h"
 #include "qemu/rcu_queue.h"
 #include "aio-posix.h"
 
@@ -57,6 +65,19 @@ enum {
     FDMON_IO_URING_REMOVE   = (1 << 2),
 };
 
+/* Tag in the cqe user_data field for CqeHandlers */
+#define FDMON_IO_URING_CQE_HANDLER ((uintptr_t)1)
+
+/* AioContexts with an SQPOLL ring, for sharing the kernel thread */
+static QemuMutex sqpoll_lock;
+static QLIST_HEAD(, AioContext) sqpoll_contexts =
+    QLIST_HEAD_INITIALIZER(sqpoll_contexts);
+
+static void __attribute__((__constructor__)) fdmon_io_uring_init(void)
+{
+    qemu_mutex_init(&sqpoll_lock);
+}
+
 static inline int poll_events_from_pfd(int pfd_events)
 {
     return (pfd_events & G_IO_IN ? POLLIN : 0) |
@@ -93,6 +114,16 @@ static struct io_uring_sqe *get_sqe(AioContext *ctx)
     } while (ret == -EINTR);
 
     assert(ret > 1);
+
+    if (ring->flags & IORING_SETUP_SQPOLL) {
+        /* The kernel thread consumes sqes asynchronously, wait for room */
+        do {
+            ret = io_uring_sqring_wait(ring);
+        } while (ret == -EINTR);
+
+        assert(ret >= 0);
+    }
+
     sqe = io_uring_get_sqe(ring);
     assert(sqe);
     return sqe;
@@ -191,13 +222,19 @@ static void add_poll_remove_sqe(AioContext *ctx, AioHandler *node)
 static void add_timeout_sqe(AioContext *ctx, int64_t ns)
 {
     struct io_uring_sqe *sqe;
-    struct __kernel_timespec ts = {
+    struct __kernel_timespec *ts = &ctx->fdmon_io_uring_ts;
+
+    /*
+     * The kernel reads the timespec when it consumes the sqe, which may be
+     * after this function returns (and asynchronously with SQPOLL).
+     */
+    *ts = (struct __kernel_timespec) {
         .tv_sec = ns / NANOSECONDS_PER_SECOND,
         .tv_nsec = ns % NANOSECONDS_PER_SECOND,
     };
 
     sqe = get_sqe(ctx);
-    io_uring_prep_timeout(sqe, &ts, 1, 0);
+    io_uring_prep_timeout(sqe, ts, 1, 0);
     io_uring_sqe_set_data(sqe, NULL);
 }
 
@@ -234,6 +271,16 @@ static bool process_cqe(AioContext *ctx,
         return false;
     }
 
+    if ((uintptr_t)node & FDMON_IO_URING_CQE_HANDLER) {
+        CqeHandler *cqe_handler = (CqeHandler *)
+            ((uintptr_t)node & ~FDMON_IO_URING_CQE_HANDLER);
+
+        cqe_handler->cqe = *cqe;
+        ctx->cqe_handler_in_flight--;
+        QSIMPLEQ_INSERT_TAIL(&ctx->cqe_handler_ready_list, cqe_handler, next);
+        return false;
+    }
+
     /*
      * Deletion can only happen when IORING_OP_POLL_ADD completes.  If we race
      * with enqueue() here then we can safely clear the FDMON_IO_URING_REMOVE
@@ -278,7 +325,7 @@ static int fdmon_io_uring_wait(AioContext *ctx, AioHandlerList *ready_list,
     unsigned wait_nr = 1; /* block until at least one cqe is ready */
     int ret;
 
-    if (timeout == 0) {
+    if (timeout == 0 || !QSIMPLEQ_EMPTY(&ctx->cqe_handler_ready_list)) {
         wait_nr = 0; /* non-blocking */
     } else if (timeout > 0) {
         add_timeout_sqe(ctx, timeout);
@@ -312,15 +359,73 @@ static bool fdmon_io_uring_need_wait(AioContext *ctx)
         return true;
     }
 
+    /* Are there completed requests left over from a nested aio_poll()? */
+    if (!QSIMPLEQ_EMPTY(&ctx->cqe_handler_ready_list)) {
+        return true;
+    }
+
     return false;
 }
 
+static bool fdmon_io_uring_dispatch(AioContext *ctx)
+{
+    CqeHandler *cqe_handler;
+    bool progress = false;
+
+    /* Callbacks may run a nested aio_poll(), so take one at a time */
+    while ((cqe_handler = QSIMPLEQ_FIRST(&ctx->cqe_handler_ready_list))) {
+        QSIMPLEQ_REMOVE_HEAD(&ctx->cqe_handler_ready_list, next);
+        cqe_handler->cb(cqe_handler);
+        progress = true;
+    }
+    return progress;
+}
+
+static bool fdmon_io_uring_add_sqe(AioContext *ctx,
+                                   const struct io_uring_sqe *sqe,
+                                   CqeHandler *cqe_handler)
+{
+    struct io_uring_sqe *new_sqe = get_sqe(ctx);
+
+    *new_sqe = *sqe;
+    io_uring_sqe_set_data(new_sqe, (void *)((uintptr_t)cqe_handler |
+                                            FDMON_IO_URING_CQE_HANDLER));
+    ctx->cqe_handler_in_flight++;
+    return true;
+}
+
 static const FDMonOps fdmon_io_uring_ops = {
     .update = fdmon_io_uring_update,
     .wait = fdmon_io_uring_wait,
     .need_wait = fdmon_io_uring_need_wait,
+    .dispatch = fdmon_io_uring_dispatch,
+    .add_sqe = fdmon_io_uring_add_sqe,
 };
 
+/*
+ * Complete all requests added with aio_add_sqe() before the ring goes away.
+ * ctx->fdmon_ops must no longer point to fdmon_io_uring_ops so that callbacks
+ * which submit new requests fall back to other means.
+ */
+static void fdmon_io_uring_drain(AioContext *ctx)
+{
+    while (ctx->cqe_handler_in_flight > 0) {
+        AioHandlerList ready_list = QLIST_HEAD_INITIALIZER(ready_list);
+        int ret;
+
+        do {
+            ret = io_uring_submit_and_wait(&ctx->fdmon_io_uring, 1);
+        } while (ret == -EINTR);
+
+        assert(ret >= 0);
+
+        /* Ready fds are dropped, the next fd monitor will see them again */
+        process_cq_ring(ctx, &ready_list);
+        fdmon_io_uring_dispatch(ctx);
+    }
+    fdmon_io_uring_dispatch(ctx);
+}
+
 bool fdmon_io_uring_setup(AioContext *ctx)
 {
     int ret;
@@ -331,6 +436,85 @@ bool fdmon_io_uring_setup(AioContext *ctx)
     }
 
     QSLIST_INIT(&ctx->submit_list);
+    QSIMPLEQ_INIT(&ctx->cqe_handler_ready_list);
+    ctx->cqe_handler_in_flight = 0;
+    ctx->fdmon_ops = &fdmon_io_uring_ops;
+    return true;
+}
+
+/* Create an SQPOLL ring, called with sqpoll_lock held */
+static int fdmon_io_uring_init_sqpoll(AioContext *ctx, int sq_thread_cpu)
+{
+    struct io_uring_params params = {
+        .flags = IORING_SETUP_SQPOLL,
+    };
+    AioContext *other;
+    int ret;
+
+    if (sq_thread_cpu >= 0) {
+        params.flags |= IORING_SETUP_SQ_AFF;
+        params.sq_thread_cpu = sq_thread_cpu;
+    }
+
+    QLIST_FOREACH(other, &sqpoll_contexts, fdmon_io_uring_sq_next) {
+        if (other->fdmon_io_uring_sq_cpu == sq_thread_cpu) {
+            params.flags |= IORING_SETUP_ATTACH_WQ;
+            params.wq_fd = other->fdmon_io_uring.ring_fd;
+
+            ret = io_uring_queue_init_params(FDMON_IO_URING_ENTRIES,
+                                             &ctx->fdmon_io_uring, &params);
+            if (ret == 0) {
+                return 0;
+            }
+
+            /* Kernels before 5.11 cannot share SQPOLL threads */
+            params.flags &= ~IORING_SETUP_ATTACH_WQ;
+            params.wq_fd = 0;
+            break;
+        }
+    }
+
+    return io_uring_queue_init_params(FDMON_IO_URING_ENTRIES,
+                                      &ctx->fdmon_io_uring, &params);
+}
+
+bool fdmon_io_uring_setup_sqpoll(AioContext *ctx, int sq_thread_cpu,
+                                 Error **errp)
+{
+    AioHandler *node;
+    int ret;
+
+    if (ctx->fdmon_ops != &fdmon_io_uring_ops) {
+        error_setg(errp, "io_uring file descriptor monitoring is not "
+                   "available");
+        return false;
+    }
+
+    /* Replace the regular ring, this falls back to fdmon-poll meanwhile */
+    fdmon_io_uring_destroy(ctx);
+
+    QEMU_LOCK_GUARD(&sqpoll_lock);
+
+    ret = fdmon_io_uring_init_sqpoll(ctx, sq_thread_cpu);
+    if (ret != 0) {
+        error_setg_errno(errp, -ret, "Failed to create io_uring with "
+                         "IORING_SETUP_SQPOLL");
+        return false;
+    }
+
+    ctx->fdmon_io_uring_sq_cpu = sq_thread_cpu;
+    QLIST_INSERT_HEAD(&sqpoll_contexts, ctx, fdmon_io_uring_sq_next);
+
+    /* Monitor the existing handlers on the new ring */
+    QSLIST_INIT(&ctx->submit_list);
+    QSIMPLEQ_INIT(&ctx->cqe_handler_ready_list);
+    ctx->cqe_handler_in_flight = 0;
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!QLIST_IS_INSERTED(node, node_deleted)) {
+            enqueue(&ctx->submit_list, node, FDMON_IO_URING_ADD);
+        }
+    }
+
     ctx->fdmon_ops = &fdmon_io_uring_ops;
     return true;
 }
@@ -340,6 +524,15 @@ void fdmon_io_uring_destroy(AioContext *ctx)
     if (ctx->fdmon_ops == &fdmon_io_uring_ops) {
         AioHandler *node;
 
+        ctx->fdmon_ops = &fdmon_poll_ops;
+        fdmon_io_uring_drain(ctx);
+
+        if (QLIST_IS_INSERTED(ctx, fdmon_io_uring_sq_next)) {
+            WITH_QEMU_LOCK_GUARD(&sqpoll_lock) {
+                QLIST_REMOVE(ctx, fdmon_io_uring_sq_next);
+            }
+        }
+
         io_uring_queue_exit(&ctx->fdmon_io_uring);
 
         /* Move handlers due to be removed onto the deleted list */
@@ -355,7 +548,5 @@ void fdmon_io_uring_destroy(AioContext *ctx)
 
             QSLIST_REMOVE_HEAD_RCU(&ctx->submit_list, node_submitted);
         }
-
-        ctx->fdmon_ops = &fdmon_poll_ops;
     }
 }